@@ -63,9 +63,13 @@
 
 #ifdef ZIP_STD
 #include "XUnzip.h"
+#ifdef ZU_TRACE
+#include "XZtrace.h"
+#endif
 //
 #include <malloc.h>
 
+#include <cerrno>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -86,6 +90,7 @@
 //
 typedef unsigned short WORD;
 #define _tcslen strlen
+#define _tcscmp strcmp
 #define _tcsicmp stricmp
 #define _tcscpy strcpy
 #define _tcsncpy strncpy
@@ -104,6 +109,9 @@ typedef unsigned short WORD;
 //
 #else
 #include "XUnzip.h"
+#ifdef ZU_TRACE
+#include "XZtrace.h"
+#endif
 //
 #include <tchar.h>
 #include <windows.h>
@@ -113,17 +121,105 @@ typedef unsigned short WORD;
 #include <cstring>
 #endif
 
-#include <memory>
+#include <chrono>
 #include <new>
 #include <string_view>
+#include <utility>
 
-enum ZipMode { ZIP_HANDLE = 1, ZIP_FILENAME = 2, ZIP_MEMORY = 3 };
-
-#define zmalloc(len) malloc(len)
-#define zfree(p) free(p)
+enum ZipMode {
+  ZIP_HANDLE = 1,
+  ZIP_FILENAME = 2,
+  ZIP_MEMORY = 3,
+  ZIP_READER = 4
+};
 
 namespace {
 
+// The allocator used when the caller doesn't give one.
+void *DefaultAllocate(void *, size_t size) { return malloc(size); }
+void DefaultDeallocate(void *, void *ptr) { free(ptr); }
+
+constexpr ZALLOCATOR default_allocator{DefaultAllocate, DefaultDeallocate,
+                                       nullptr};
+
+void *zaalloc(const ZALLOCATOR &a, size_t size) {
+  return a.allocate(a.opaque, size);
+}
+
+void zafree(const ZALLOCATOR &a, void *ptr) {
+  if (ptr) a.deallocate(a.opaque, ptr);
+}
+
+// Constructs a T in memory obtained from the allocator, nullptr on failure.
+template <typename T, typename... Args>
+T *zanew(const ZALLOCATOR &a, Args &&...args) {
+  void *mem{zaalloc(a, sizeof(T))};
+  return mem ? new (mem) T(std::forward<Args>(args)...) : nullptr;
+}
+
+template <typename T>
+void zadelete(const ZALLOCATOR &a, T *ptr) {
+  if (ptr) {
+    ptr->~T();
+    a.deallocate(a.opaque, ptr);
+  }
+}
+
+// Counting for UnzipGetStats.  Without ZU_STATS it all compiles away: the
+// macros expand to nothing and nothing keeps any counts.
+#ifdef ZU_STATS
+// Adds the nanoseconds it lives for to ns.
+class TStatTimer {
+ public:
+  explicit TStatTimer(unsigned long long &ns) noexcept
+      : ns_{ns}, start_{std::chrono::steady_clock::now()} {}
+  ~TStatTimer() noexcept {
+    const auto took{std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_)};
+
+    ns_ += static_cast<unsigned long long>(took.count());
+  }
+
+  TStatTimer(const TStatTimer &) = delete;
+  TStatTimer &operator=(const TStatTimer &) = delete;
+
+ private:
+  unsigned long long &ns_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+#define ZSTAT_ADD(count, n) ((count) += (n))
+#define ZSTAT_TIME(ns) const TStatTimer stattimer{ns}
+#else
+#define ZSTAT_ADD(count, n) ((void)0)
+#define ZSTAT_TIME(ns) ((void)0)
+#endif
+
+// Scopes for the timeline of XZtrace.h, which without ZU_TRACE compile away.
+#ifdef ZU_TRACE
+// Reports the time it lives for to the trace sink, if there is one.
+class TTraceScope {
+ public:
+  explicit TTraceScope(const char *name) noexcept
+      : name_{ZipTraceEnabled() ? name : nullptr},
+        start_{name_ ? ZipTraceNow() : 0} {}
+  ~TTraceScope() noexcept {
+    if (name_) ZipTraceScope(name_, start_);
+  }
+
+  TTraceScope(const TTraceScope &) = delete;
+  TTraceScope &operator=(const TTraceScope &) = delete;
+
+ private:
+  const char *const name_;
+  const unsigned long long start_;
+};
+
+#define ZTRACE_SCOPE(name) const TTraceScope tracescope{name}
+#else
+#define ZTRACE_SCOPE(name) ((void)0)
+#endif
+
 // define it ourselves since we don't include time.h
 typedef unsigned long lutime_t;
 
@@ -323,6 +419,9 @@ typedef struct z_stream_s {
   int data_type;   // best guess about the data type: ascii or binary
   uLong adler;     // adler32 value of the uncompressed data
   uLong reserved;  // reserved for future use
+#ifdef ZU_STATS
+  UNZIPSTATS *stats;  // where inflate_blocks counts the blocks it meets
+#endif
 } z_stream;
 
 typedef z_stream *z_streamp;
@@ -581,6 +680,7 @@ int inflate_trees_bits(uInt *,           // 19 code lengths
                        uInt *,           // bits tree desired/actual depth
                        inflate_huft **,  // bits tree result
                        inflate_huft *,   // space for trees
+                       uInt *,           // work area for huft_build
                        z_streamp);       // for messages
 
 int inflate_trees_dynamic(uInt,             // number of literal/length codes
@@ -591,6 +691,7 @@ int inflate_trees_dynamic(uInt,             // number of literal/length codes
                           inflate_huft **,  // literal/length tree result
                           inflate_huft **,  // distance tree result
                           inflate_huft *,   // space for trees
+                          uInt *,           // work area for huft_build
                           z_streamp);       // for messages
 
 int inflate_trees_fixed(uInt *,  // literal desired/actual bit depth
@@ -617,13 +718,11 @@ int inflate_blocks_free(inflate_blocks_statef *, z_streamp);
 struct inflate_codes_state;
 typedef struct inflate_codes_state inflate_codes_statef;
 
-inflate_codes_statef *inflate_codes_new(uInt, uInt, const inflate_huft *,
-                                        const inflate_huft *, z_streamp);
+void inflate_codes_init(inflate_codes_statef *, uInt, uInt,
+                        const inflate_huft *, const inflate_huft *);
 
 int inflate_codes(inflate_blocks_statef *, z_streamp, int);
 
-void inflate_codes_free(inflate_codes_statef *, z_streamp);
-
 typedef enum {
   IBM_TYPE,    // get type bits (3, including end bit)
   IBM_LENS,    // get lengths for stored
@@ -663,7 +762,12 @@ struct inflate_blocks_state {
   uInt bitk;            // bits in bit buffer
   uLong bitb;           // bit buffer
   inflate_huft *hufts;  // single malloc for tree space
-  Byte *window;         // sliding window
+  // The following are allocated once with the blocks state and reused by
+  // every block and every stream, so that inflating does no allocations.
+  inflate_codes_statef *codes;  // codes state for the current block
+  uInt *lens;                   // bit lengths of codes for dynamic blocks
+  uInt *work;                   // work area for huft_build
+  Byte *window;                 // sliding window
   Byte *end;            // one byte after sliding window
   Byte *read;           // window read pointer
   Byte *write;          // window write pointer
@@ -1015,22 +1119,15 @@ struct inflate_codes_state {
   const inflate_huft *dtree;  // distance tree
 };
 
-inflate_codes_statef *inflate_codes_new(
-    uInt bl, uInt bd, const inflate_huft *tl,
-    const inflate_huft *td,  // need separate declaration for Borland C++
-    z_streamp z) {
-  inflate_codes_statef *c;
-
-  if ((c = (inflate_codes_statef *)ZALLOC(
-           z, 1, sizeof(struct inflate_codes_state))) != Z_NULL) {
-    c->mode = START;
-    c->lbits = (Byte)bl;
-    c->dbits = (Byte)bd;
-    c->ltree = tl;
-    c->dtree = td;
-    LuTracev((stderr, "inflate:       codes new\n"));
-  }
-  return c;
+void inflate_codes_init(
+    inflate_codes_statef *c, uInt bl, uInt bd, const inflate_huft *tl,
+    const inflate_huft *td) {  // need separate declaration for Borland C++
+  c->mode = START;
+  c->lbits = (Byte)bl;
+  c->dbits = (Byte)bd;
+  c->ltree = tl;
+  c->dtree = td;
+  LuTracev((stderr, "inflate:       codes init\n"));
 }
 
 int inflate_codes(inflate_blocks_statef *s, z_streamp z, int r) {
@@ -1185,11 +1282,6 @@ int inflate_codes(inflate_blocks_statef *s, z_streamp z, int r) {
   }
 }
 
-void inflate_codes_free(inflate_codes_statef *c, z_streamp z) {
-  ZFREE(z, c);
-  LuTracev((stderr, "inflate:       codes free\n"));
-}
-
 // infblock.c -- interpret and process block types to last block
 // Copyright (C) 1995-1998 Mark Adler
 // For conditions of distribution and use, see copyright notice in zlib.h
@@ -1245,9 +1337,6 @@ constexpr uInt border[] = {  // Order of the bit length code lengths
 
 void inflate_blocks_reset(inflate_blocks_statef *s, z_streamp z, uLong *c) {
   if (c != Z_NULL) *c = s->check;
-  if (s->mode == IBM_BTREE || s->mode == IBM_DTREE)
-    ZFREE(z, s->sub.trees.blens);
-  if (s->mode == IBM_CODES) inflate_codes_free(s->sub.decode.codes, z);
   s->mode = IBM_TYPE;
   s->bitk = 0;
   s->bitb = 0;
@@ -1257,19 +1346,28 @@ void inflate_blocks_reset(inflate_blocks_statef *s, z_streamp z, uLong *c) {
   LuTracev((stderr, "inflate:   blocks reset\n"));
 }
 
+// Most literal/length plus distance code lengths a dynamic block can have.
+#define MAX_LENS (258 + 0x1f + 0x1f)
+
 inflate_blocks_statef *inflate_blocks_new(z_streamp z, check_func c, uInt w) {
   inflate_blocks_statef *s;
 
   if ((s = (inflate_blocks_statef *)ZALLOC(
            z, 1, sizeof(struct inflate_blocks_state))) == Z_NULL)
     return s;
-  if ((s->hufts = (inflate_huft *)ZALLOC(z, sizeof(inflate_huft), MANY)) ==
-      Z_NULL) {
-    ZFREE(z, s);
-    return Z_NULL;
-  }
-  if ((s->window = (Byte *)ZALLOC(z, 1, w)) == Z_NULL) {
-    ZFREE(z, s->hufts);
+  s->hufts = (inflate_huft *)ZALLOC(z, sizeof(inflate_huft), MANY);
+  s->codes = (inflate_codes_statef *)ZALLOC(z, 1,
+                                            sizeof(struct inflate_codes_state));
+  s->lens = (uInt *)ZALLOC(z, MAX_LENS, sizeof(uInt));
+  s->work = (uInt *)ZALLOC(z, 288, sizeof(uInt));
+  s->window = (Byte *)ZALLOC(z, 1, w);
+  if (s->hufts == Z_NULL || s->codes == Z_NULL || s->lens == Z_NULL ||
+      s->work == Z_NULL || s->window == Z_NULL) {
+    TRY_FREE(z, s->window);
+    TRY_FREE(z, s->work);
+    TRY_FREE(z, s->lens);
+    TRY_FREE(z, s->codes);
+    TRY_FREE(z, s->hufts);
     ZFREE(z, s);
     return Z_NULL;
   }
@@ -1307,6 +1405,7 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
           t = k & 7;  // go to byte boundary
           DUMPBITS(t)
           s->mode = IBM_LENS;  // get length of stored block
+          ZSTAT_ADD(z->stats->blocks_stored, 1);
           break;
         case 1:  // fixed
           LuTracev((stderr, "inflate:     fixed codes block%s\n",
@@ -1316,20 +1415,19 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
             const inflate_huft *tl, *td;
 
             inflate_trees_fixed(&bl, &bd, &tl, &td, z);
-            s->sub.decode.codes = inflate_codes_new(bl, bd, tl, td, z);
-            if (s->sub.decode.codes == Z_NULL) {
-              r = Z_MEM_ERROR;
-              LEAVE
-            }
+            inflate_codes_init(s->codes, bl, bd, tl, td);
+            s->sub.decode.codes = s->codes;
           }
           DUMPBITS(3)
           s->mode = IBM_CODES;
+          ZSTAT_ADD(z->stats->blocks_fixed, 1);
           break;
         case 2:  // dynamic
           LuTracev((stderr, "inflate:     dynamic codes block%s\n",
                     s->last ? " (last)" : ""));
           DUMPBITS(3)
           s->mode = IBM_TABLE;
+          ZSTAT_ADD(z->stats->blocks_dynamic, 1);
           break;
         case 3:  // illegal
           DUMPBITS(3)
@@ -1381,11 +1479,7 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
         LEAVE
       }
       // end remove
-      t = 258 + (t & 0x1f) + ((t >> 5) & 0x1f);
-      if ((s->sub.trees.blens = (uInt *)ZALLOC(z, t, sizeof(uInt))) == Z_NULL) {
-        r = Z_MEM_ERROR;
-        LEAVE
-      }
+      s->sub.trees.blens = s->lens;
       DUMPBITS(14)
       s->sub.trees.index = 0;
       LuTracev((stderr, "inflate:       table sizes ok\n"));
@@ -1400,13 +1494,10 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
         s->sub.trees.blens[border[s->sub.trees.index++]] = 0;
       s->sub.trees.bb = 7;
       t = inflate_trees_bits(s->sub.trees.blens, &s->sub.trees.bb,
-                             &s->sub.trees.tb, s->hufts, z);
+                             &s->sub.trees.tb, s->hufts, s->work, z);
       if (t != Z_OK) {
         r = t;
-        if (r == Z_DATA_ERROR) {
-          ZFREE(z, s->sub.trees.blens);
-          s->mode = IBM_BAD;
-        }
+        if (r == Z_DATA_ERROR) s->mode = IBM_BAD;
         LEAVE
       }
       s->sub.trees.index = 0;
@@ -1438,7 +1529,6 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
           t = s->sub.trees.table;
           if (i + j > 258 + (t & 0x1f) + ((t >> 5) & 0x1f) ||
               (c == 16 && i < 1)) {
-            ZFREE(z, s->sub.trees.blens);
             s->mode = IBM_BAD;
             z->msg = (char *)"invalid bit length repeat";
             r = Z_DATA_ERROR;
@@ -1455,37 +1545,28 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
       {
         uInt bl, bd;
         inflate_huft *tl, *td;
-        inflate_codes_statef *c;
 
         bl = 9;  // must be <= 9 for lookahead assumptions
         bd = 6;  // must be <= 9 for lookahead assumptions
         t = s->sub.trees.table;
         t = inflate_trees_dynamic(257 + (t & 0x1f), 1 + ((t >> 5) & 0x1f),
                                   s->sub.trees.blens, &bl, &bd, &tl, &td,
-                                  s->hufts, z);
+                                  s->hufts, s->work, z);
         if (t != Z_OK) {
-          if (t == (uInt)Z_DATA_ERROR) {
-            ZFREE(z, s->sub.trees.blens);
-            s->mode = IBM_BAD;
-          }
+          if (t == (uInt)Z_DATA_ERROR) s->mode = IBM_BAD;
           r = t;
           LEAVE
         }
         LuTracev((stderr, "inflate:       trees ok\n"));
-        if ((c = inflate_codes_new(bl, bd, tl, td, z)) == Z_NULL) {
-          r = Z_MEM_ERROR;
-          LEAVE
-        }
-        s->sub.decode.codes = c;
+        inflate_codes_init(s->codes, bl, bd, tl, td);
+        s->sub.decode.codes = s->codes;
       }
-      ZFREE(z, s->sub.trees.blens);
       s->mode = IBM_CODES;
     case IBM_CODES:
       UPDATE
       if ((r = inflate_codes(s, z, r)) != Z_STREAM_END)
         return inflate_flush(s, z, r);
       r = Z_OK;
-      inflate_codes_free(s->sub.decode.codes, z);
       LOAD LuTracev((stderr, "inflate:       codes end, %lu total out\n",
                      z->total_out + (q >= s->read ? q - s->read
                                                   : (s->end - s->read) +
@@ -1514,6 +1595,9 @@ int inflate_blocks(inflate_blocks_statef *s, z_streamp z, int r) {
 int inflate_blocks_free(inflate_blocks_statef *s, z_streamp z) {
   inflate_blocks_reset(s, z, Z_NULL);
   ZFREE(z, s->window);
+  ZFREE(z, s->work);
+  ZFREE(z, s->lens);
+  ZFREE(z, s->codes);
   ZFREE(z, s->hufts);
   ZFREE(z, s);
   LuTracev((stderr, "inflate:   blocks freed\n"));
@@ -1773,13 +1857,12 @@ int inflate_trees_bits(uInt *c,            // 19 code lengths
                        uInt *bb,           // bits tree desired/actual depth
                        inflate_huft **tb,  // bits tree result
                        inflate_huft *hp,   // space for trees
+                       uInt *v,            // work area for huft_build
                        z_streamp z)        // for messages
 {
   int r;
   uInt hn = 0;  // hufts used in space
-  uInt *v;      // work area for huft_build
 
-  if ((v = (uInt *)ZALLOC(z, 19, sizeof(uInt))) == Z_NULL) return Z_MEM_ERROR;
   r = huft_build(c, 19, 19, (uInt *)Z_NULL, (uInt *)Z_NULL, tb, bb, hp, &hn, v);
   if (r == Z_DATA_ERROR)
     z->msg = (char *)"oversubscribed dynamic bit lengths tree";
@@ -1787,7 +1870,6 @@ int inflate_trees_bits(uInt *c,            // 19 code lengths
     z->msg = (char *)"incomplete dynamic bit lengths tree";
     r = Z_DATA_ERROR;
   }
-  ZFREE(z, v);
   return r;
 }
 
@@ -1799,14 +1881,11 @@ int inflate_trees_dynamic(uInt nl,   // number of literal/length codes
                           inflate_huft **tl,  // literal/length tree result
                           inflate_huft **td,  // distance tree result
                           inflate_huft *hp,   // space for trees
+                          uInt *v,            // work area for huft_build
                           z_streamp z)        // for messages
 {
   int r;
   uInt hn = 0;  // hufts used in space
-  uInt *v;      // work area for huft_build
-
-  // allocate work area
-  if ((v = (uInt *)ZALLOC(z, 288, sizeof(uInt))) == Z_NULL) return Z_MEM_ERROR;
 
   // build literal/length tree
   r = huft_build(c, nl, 257, cplens, cplext, tl, bl, hp, &hn, v);
@@ -1817,7 +1896,6 @@ int inflate_trees_dynamic(uInt nl,   // number of literal/length codes
       z->msg = (char *)"incomplete literal/length tree";
       r = Z_DATA_ERROR;
     }
-    ZFREE(z, v);
     return r;
   }
 
@@ -1833,12 +1911,10 @@ int inflate_trees_dynamic(uInt nl,   // number of literal/length codes
       z->msg = (char *)"empty distance tree with lengths";
       r = Z_DATA_ERROR;
     }
-    ZFREE(z, v);
     return r;
   }
 
   // done
-  ZFREE(z, v);
   return Z_OK;
 }
 
@@ -2201,14 +2277,22 @@ uLong adler32(uLong adler, const Byte *buf, uInt len) {
 // uncompress()
 [[maybe_unused]] const char *zError(int err) { return ERR_MSG(err); }
 
+// opaque is the ZALLOCATOR to use, or nullptr for the default one.
 voidpf zcalloc(voidpf opaque, unsigned items, unsigned size) {
-  if (opaque) items += size - size;  // make compiler happy
-  return calloc(items, size);
+  const auto *a = opaque ? static_cast<const ZALLOCATOR *>(opaque)
+                         : &default_allocator;
+  const size_t len{static_cast<size_t>(items) * size};
+
+  voidpf ptr{zaalloc(*a, len)};
+  if (ptr) memset(ptr, 0, len);
+
+  return ptr;
 }
 
 void zcfree(voidpf opaque, voidpf ptr) {
-  zfree(ptr);
-  if (opaque) return;  // make compiler happy
+  const auto *a = opaque ? static_cast<const ZALLOCATOR *>(opaque)
+                         : &default_allocator;
+  zafree(*a, ptr);
 }
 
 // inflate.c -- zlib interface to inflate modules
@@ -2473,24 +2557,118 @@ typedef struct unz_file_info_internal_s {
 } unz_file_info_internal;
 
 struct LUFILE {
-  bool is_handle;  // either a handle or memory
+  ZALLOCATOR alloc;  // where this LUFILE came from
+  // Seekable sources, whatever they are, are read through reader with
+  // positional reads only, so no read depends on where the last one left off.
+  // Anything else is a pipe, read front to back from h.
   bool canseek;
+  ZREADER reader;
+  unsigned long pos;             // where the next lufread reads from
+  unsigned long initial_offset;  // added to pos for every read
+  bool herr;
+  // Headers are parsed a few bytes at a time, so small reads are served from
+  // a copy of the range around them rather than going to the reader each time.
+  unsigned char *cache;
+  unsigned long cachestart;  // reader offset of cache[0]
+  unsigned int cachelen;
   // for handles:
   HANDLE h;
-  bool herr;
-  unsigned long initial_offset;
   bool mustclosehandle;
   // for memory:
   void *buf;
-  unsigned int len, pos;  // if it's a memory block
+  unsigned int len;
+  // Bytes handed back by lufunread, returned by lufread before anything else.
+  // Only used when streaming from a handle that can't seek.
+  unsigned char *pushback;
+  unsigned int pushbacklen, pushbackpos;
+#ifdef ZU_STATS
+  UNZIPSTATS *stats;  // the TUnzip's, for everything read through here
+#endif
 };
 
-LUFILE *lufopen(void *z, unsigned int len, ZipMode flags, ZRESULT *err) {
-  if (flags != ZIP_HANDLE && flags != ZIP_FILENAME && flags != ZIP_MEMORY) {
+// The built-in readers, for files and memory blocks.  opaque is the LUFILE.
+long file_read_at(void *opaque, unsigned long offset, void *buf,
+                  unsigned int len) {
+  const auto *lf = static_cast<const LUFILE *>(opaque);
+
+#ifdef ZIP_STD
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+  // no pread here, but nothing else moves this handle while we have it
+  if (fseek(lf->h, static_cast<long>(offset), SEEK_SET) != 0) return -1;
+
+  const size_t red{fread(buf, 1, len, lf->h)};
+  if (red < len && ferror(lf->h)) return -1;
+
+  return static_cast<long>(red);
+#else
+  ssize_t red;
+  do {
+    red = pread(fileno(lf->h), buf, len, static_cast<off_t>(offset));
+  } while (red < 0 && errno == EINTR);
+
+  return static_cast<long>(red);
+#endif
+#else
+  OVERLAPPED ov = {};
+  ov.Offset = static_cast<DWORD>(offset);
+
+  DWORD red{0};
+  if (!ReadFile(lf->h, buf, len, &red, &ov)) {
+    return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+  }
+
+  return static_cast<long>(red);
+#endif
+}
+
+unsigned long file_size(void *opaque) {
+  const auto *lf = static_cast<const LUFILE *>(opaque);
+
+#ifdef ZIP_STD
+  struct stat st;
+  if (fstat(fileno(lf->h), &st) == -1) return 0;
+
+  return static_cast<unsigned long>(st.st_size);
+#else
+  const DWORD size{GetFileSize(lf->h, nullptr)};
+
+  return size != INVALID_FILE_SIZE ? size : 0;
+#endif
+}
+
+long mem_read_at(void *opaque, unsigned long offset, void *buf,
+                 unsigned int len) {
+  const auto *lf = static_cast<const LUFILE *>(opaque);
+  if (offset >= lf->len) return 0;
+
+  if (len > lf->len - offset) len = static_cast<unsigned int>(lf->len - offset);
+
+  memcpy(buf, static_cast<const char *>(lf->buf) + offset, len);
+
+  return static_cast<long>(len);
+}
+
+unsigned long mem_size(void *opaque) {
+  return static_cast<const LUFILE *>(opaque)->len;
+}
+
+LUFILE *lufopen(void *z, unsigned int len, ZipMode flags,
+                const ZALLOCATOR &alloc, ZRESULT *err) {
+  if (flags != ZIP_HANDLE && flags != ZIP_FILENAME && flags != ZIP_MEMORY &&
+      flags != ZIP_READER) {
     *err = ZR_ARGS;
     return nullptr;
   }
 
+  if (flags == ZIP_READER) {
+    const auto *reader = static_cast<const ZREADER *>(z);
+
+    if (!reader || !reader->read_at || !reader->size) {
+      *err = ZR_ARGS;
+      return nullptr;
+    }
+  }
+
   *err = ZR_OK;
 
   HANDLE h{nullptr};
@@ -2535,32 +2713,43 @@ LUFILE *lufopen(void *z, unsigned int len, ZipMode flags, ZRESULT *err) {
     canseek = pos != INVALID_SET_FILE_POINTER;
   }
 
-  LUFILE *lf = new (std::nothrow) LUFILE;
+  LUFILE *lf = zanew<LUFILE>(alloc);
   if (!lf) {
+#ifdef ZIP_STD
+    if (mustclosehandle) fclose(h);
+#else
+    if (mustclosehandle) CloseHandle(h);
+#endif
     *err = ZR_NOALLOC;
     return nullptr;
   }
 
+  lf->alloc = alloc;
+  lf->pos = 0;
+  lf->initial_offset = 0;
+  lf->herr = false;
+
   if (flags == ZIP_HANDLE || flags == ZIP_FILENAME) {
-    lf->is_handle = true;
     lf->mustclosehandle = mustclosehandle;
     lf->buf = nullptr;
     lf->len = 0;
-    lf->pos = 0;
     lf->canseek = canseek;
     lf->h = h;
-    lf->herr = false;
-    lf->initial_offset = 0;
 
-    if (canseek) lf->initial_offset = pos;
-  } else {
-    lf->is_handle = false;
+    if (canseek) {
+      lf->reader = {file_read_at, file_size, lf};
+      lf->initial_offset = pos;
+    }
+  } else if (flags == ZIP_MEMORY) {
     lf->canseek = true;
     lf->mustclosehandle = false;
     lf->buf = z;
     lf->len = len;
-    lf->pos = 0;
-    lf->initial_offset = 0;
+    lf->reader = {mem_read_at, mem_size, lf};
+  } else {
+    lf->canseek = true;
+    lf->mustclosehandle = false;
+    lf->reader = *static_cast<const ZREADER *>(z);
   }
 
   *err = ZR_OK;
@@ -2582,99 +2771,177 @@ int lufclose(LUFILE *stream) {
   }
 #endif
 
-  delete stream;
+  const ZALLOCATOR alloc{stream->alloc};
+  zafree(alloc, stream->pushback);
+  zafree(alloc, stream->cache);
+  zadelete(alloc, stream);
 
   return rc;
 }
 
-int luferror(LUFILE *stream) {
-  if (stream->is_handle && stream->herr) return 1;
-
-  return 0;
-}
+int luferror(LUFILE *stream) { return stream->herr ? 1 : 0; }
 
 long int luftell(LUFILE *stream) {
-  if (stream->is_handle && stream->canseek) {
-    const DWORD pos{GetFilePosU(stream->h)};
-    if (pos == INVALID_SET_FILE_POINTER) return 0;
-
-    return pos - stream->initial_offset;
-  }
+  if (!stream->canseek) return 0;
 
-  if (stream->is_handle) return 0;
-
-  return stream->pos;
+  return static_cast<long>(stream->pos);
 }
 
 int lufseek(LUFILE *stream, long offset, int whence) {
-  if (stream->is_handle && stream->canseek) {
-#ifdef ZIP_STD
-    return fseek(stream->h, stream->initial_offset + offset, whence);
-#else
-    if (whence == SEEK_SET) {
-      if (SetFilePointer(stream->h, stream->initial_offset + offset, 0,
-                         FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-        return -1;
-      }
-    } else if (whence == SEEK_CUR) {
-      if (SetFilePointer(stream->h, offset, nullptr, FILE_CURRENT) ==
-          INVALID_SET_FILE_POINTER) {
-        return -1;
-      }
-    } else if (whence == SEEK_END) {
-      if (SetFilePointer(stream->h, offset, nullptr, FILE_END) ==
-          INVALID_SET_FILE_POINTER) {
-        return -1;
-      }
-    } else
-      return EINVAL;
+  if (!stream->canseek) return 29;  // ESPIPE
 
-    return 0;
+#ifdef ZU_STATS
+  const unsigned long was{stream->pos};
 #endif
-  }
 
-  if (stream->is_handle) return 29;  // ESPIPE
-
-  if (whence == SEEK_SET)
+  if (whence == SEEK_SET) {
     stream->pos = offset;
-  else if (whence == SEEK_CUR)
+  } else if (whence == SEEK_CUR) {
     stream->pos += offset;
-  else if (whence == SEEK_END)
-    stream->pos = stream->len + offset;
+  } else if (whence == SEEK_END) {
+    const unsigned long size{stream->reader.size(stream->reader.opaque)};
+    if (size < stream->initial_offset) return EINVAL;
+
+    stream->pos = size - stream->initial_offset + offset;
+  } else {
+    return EINVAL;
+  }
+
+#ifdef ZU_STATS
+  if (stream->pos != was) ++stream->stats->seeks;
+#endif
 
   return 0;
 }
 
+#define LUF_CACHESIZE (4096)
+
+// Reads len bytes at offset from the stream's reader, going round again after
+// short reads.  Returns how many bytes arrived.
+unsigned int lufreadat(LUFILE *stream, unsigned long offset, void *ptr,
+                       unsigned int len) {
+  ZTRACE_SCOPE("read");
+  ZSTAT_TIME(stream->stats->read_ns);
+
+  unsigned int red{0};
+  while (red < len) {
+    ZSTAT_ADD(stream->stats->reads, 1);
+
+    const long got{stream->reader.read_at(stream->reader.opaque, offset + red,
+                                          (char *)ptr + red, len - red)};
+    if (got <= 0) {
+      if (got < 0) stream->herr = true;
+      break;
+    }
+
+    red += static_cast<unsigned int>(got);
+  }
+
+  ZSTAT_ADD(stream->stats->bytes_in, red);
+  return red;
+}
+
 size_t lufread(void *ptr, size_t size, size_t n, LUFILE *stream) {
   unsigned int toread = (unsigned int)(size * n);
 
-  if (stream->is_handle) {
+  if (stream->pushbackpos < stream->pushbacklen) {
+    const unsigned int avail{stream->pushbacklen - stream->pushbackpos};
+    const unsigned int take{toread < avail ? toread : avail};
+
+    memcpy(ptr, stream->pushback + stream->pushbackpos, take);
+    stream->pushbackpos += take;
+
+    const size_t more{
+        take < toread ? lufread((char *)ptr + take, 1, toread - take, stream)
+                      : 0};
+    return (take + more) / size;
+  }
+
+  if (stream->canseek) {
+    const unsigned long offset{stream->initial_offset + stream->pos};
+    unsigned int red;
+
+    if (toread >= LUF_CACHESIZE / 4) {
+      red = lufreadat(stream, offset, ptr, toread);
+    } else {
+      if (!stream->cache) {
+        stream->cache =
+            static_cast<unsigned char *>(zaalloc(stream->alloc, LUF_CACHESIZE));
+        if (!stream->cache) {
+          stream->herr = true;
+          return 0;
+        }
+      }
+
+      if (offset < stream->cachestart ||
+          offset + toread > stream->cachestart + stream->cachelen) {
+        stream->cachestart = offset;
+        stream->cachelen =
+            lufreadat(stream, offset, stream->cache, LUF_CACHESIZE);
+      }
+
+      // either a hit, or refilled from offset; short only at the end
+      const unsigned long avail{stream->cachestart + stream->cachelen -
+                                offset};
+      red = toread < avail ? toread : static_cast<unsigned int>(avail);
+
+      memcpy(ptr, stream->cache + (offset - stream->cachestart), red);
+    }
+
+    stream->pos += red;
+    return red / size;
+  }
+
+  ZTRACE_SCOPE("read");
+  ZSTAT_TIME(stream->stats->read_ns);
+  ZSTAT_ADD(stream->stats->reads, 1);
+
 #ifdef ZIP_STD
-    size_t read = fread(ptr, size, n, stream->h);
+  size_t read = fread(ptr, size, n, stream->h);
 
-    // distinguish error and eof.
-    if (read < n) stream->herr = ferror(stream->h) ? true : false;
+  // distinguish error and eof.
+  if (read < n) stream->herr = ferror(stream->h) ? true : false;
 
-    return read;
+  ZSTAT_ADD(stream->stats->bytes_in, read * size);
+  return read;
 #else
-    DWORD read{0};
-    const BOOL res{ReadFile(stream->h, ptr, toread, &read, nullptr)};
+  DWORD read{0};
+  const BOOL res{ReadFile(stream->h, ptr, toread, &read, nullptr)};
 
-    if (!res) stream->herr = true;
+  if (!res) stream->herr = true;
 
-    return read / size;
+  ZSTAT_ADD(stream->stats->bytes_in, read);
+  return read / size;
 #endif
+}
+
+// Puts len bytes back in front of the stream, so the next lufread returns them
+// first.  The pushback is at most UNZ_BUFSIZE bytes, which is enough since we
+// never read further ahead than one read buffer.
+int lufunread(const void *ptr, unsigned int len, LUFILE *stream) {
+  if (len == 0) return 0;
+
+  const unsigned int kept{stream->pushbacklen - stream->pushbackpos};
+  if (len + kept > UNZ_BUFSIZE) return EOF;
+
+  if (!stream->pushback) {
+    stream->pushback =
+        static_cast<unsigned char *>(zaalloc(stream->alloc, UNZ_BUFSIZE));
+    if (!stream->pushback) return EOF;
   }
 
-  if (stream->pos + toread > stream->len) {
-    toread = stream->len - stream->pos;
+  if (len <= stream->pushbackpos) {
+    stream->pushbackpos -= len;
+  } else {
+    memmove(stream->pushback + len, stream->pushback + stream->pushbackpos,
+            kept);
+    stream->pushbackpos = 0;
+    stream->pushbacklen = len + kept;
   }
 
-  memcpy(ptr, (char *)stream->buf + stream->pos, toread);
+  memcpy(stream->pushback + stream->pushbackpos, ptr, len);
 
-  const DWORD red{toread};
-  stream->pos += red;
-  return red / size;
+  return 0;
 }
 
 // file_in_zip_read_info_s contain internal information about a file in zipfile,
@@ -2703,10 +2970,24 @@ typedef struct {
                     // many encryption-header bytes first
   char crcenctest;  // if encrypted, we'll check the encryption buffer against
                     // this
+  unsigned long chunkkeys[3];  // keys before read_buffer was decrypted, so
+                               // bytes read past a streamed file can be
+                               // encrypted back
 } file_in_zip_read_info_s;
 
+// How far a streamed zip has got with the data of its current file.
+enum StreamState {
+  STREAM_FRESH,    // just after the local header
+  STREAM_READING,  // somewhere in the data
+  STREAM_DONE      // past the data and any data descriptor
+};
+
+// stands in for the sizes of a streamed file until its data descriptor
+constexpr uLong UNZ_UNKNOWN_SIZE{~0UL};
+
 // unz_s contain internal information about the zipfile
 typedef struct {
+  ZALLOCATOR alloc;               // all memory for the zipfile comes from here
   LUFILE *file;                   // io structore of the zipfile
   unz_global_info gi;             // public global information
   uLong byte_before_the_zipfile;  // byte before the zipfile, (>0 for sfx)
@@ -2723,6 +3004,18 @@ typedef struct {
   unz_file_info_internal cur_file_info_internal;  // private info about it
   // structure about the current file if we are decompressing it
   file_in_zip_read_info_s *pfile_in_zip_read;
+  // read info, buffer and inflate state kept between files, so that opening
+  // the next file only resets them instead of allocating them again
+  file_in_zip_read_info_s *pfile_in_zip_read_pool;
+
+  // A zip read from a handle that can't seek is streamed: we never see the
+  // central directory, and walk forward through the local headers instead.
+  bool streaming;
+  StreamState stream_state;
+  bool stream_sizes_unknown;  // sizes and crc follow the data (flag bit 3)
+  char stream_name[UNZ_MAXFILENAMEINZIP + 1];  // from the local header
+  unsigned char *stream_extra;                 // likewise, the extra field
+  uInt stream_extra_size;                      // allocated size of it
 } unz_s, *unzFile;
 
 //   Compare two filename (fileName1,fileName2).
@@ -2832,8 +3125,7 @@ uLong unzlocal_SearchCentralDir(LUFILE *fin) {
   if (uMaxBack > uSizeFile) uMaxBack = uSizeFile;
 
   constexpr long bufSize{BUFREADCOMMENT + 4};
-  auto buf = std::make_unique<unsigned char[]>(bufSize);
-  if (!buf) return 0xFFFFFFFF;
+  unsigned char buf[bufSize];
 
   long uPosFound{-1}, uBackRead{4};
 
@@ -2849,12 +3141,11 @@ uLong unzlocal_SearchCentralDir(LUFILE *fin) {
     uReadSize = bufSize < uReadSize ? bufSize : uReadSize;
 
     if (lufseek(fin, uReadPos, SEEK_SET) != 0) break;
-    if (lufread(buf.get(), uReadSize, 1, fin) != 1) break;
+    if (lufread(buf, uReadSize, 1, fin) != 1) break;
 
     for (long i{uReadSize - 3}; i >= 0; i--) {
-      if (((*(buf.get() + i)) == 0x50) && ((*(buf.get() + i + 1)) == 0x4b) &&
-          ((*(buf.get() + i + 2)) == 0x05) &&
-          ((*(buf.get() + i + 3)) == 0x06)) {
+      if ((buf[i] == 0x50) && (buf[i + 1] == 0x4b) && (buf[i + 2] == 0x05) &&
+          (buf[i + 3] == 0x06)) {
         uPosFound = uReadPos + i;
 
         break;
@@ -2869,6 +3160,8 @@ uLong unzlocal_SearchCentralDir(LUFILE *fin) {
 
 int unzGoToFirstFile(unzFile file);
 int unzCloseCurrentFile(unzFile file);
+void unzlocal_FreeFileInfo(unz_s *s,
+                           file_in_zip_read_info_s *pfile_in_zip_read_info);
 
 // Open a Zip file.
 //
@@ -2876,6 +3169,8 @@ int unzCloseCurrentFile(unzFile file);
 // nullptr.  Otherwise, the return value is a unzFile Handle, usable with other
 // unzip functions
 unzFile unzOpenInternal(LUFILE *fin) {
+  ZTRACE_SCOPE("end_of_central_dir");
+
   if (fin == nullptr) return nullptr;
   if (unz_copyright[0] != ' ') {
     lufclose(fin);
@@ -2941,17 +3236,22 @@ unzFile unzOpenInternal(LUFILE *fin) {
     return nullptr;
   }
 
+  us.alloc = fin->alloc;
   us.file = fin;
   us.byte_before_the_zipfile = central_pos + fin->initial_offset -
                                (us.offset_central_dir + us.size_central_dir);
   us.central_pos = central_pos;
   us.pfile_in_zip_read = nullptr;
+  us.pfile_in_zip_read_pool = nullptr;
 
   // since the zipfile itself is expected to handle this
   fin->initial_offset = 0;
 
-  auto *s = static_cast<unz_s *>(zmalloc(sizeof(unz_s)));
-  if (!s) return nullptr;
+  auto *s = static_cast<unz_s *>(zaalloc(us.alloc, sizeof(unz_s)));
+  if (!s) {
+    lufclose(fin);
+    return nullptr;
+  }
 
   *s = us;
   unzGoToFirstFile(s);
@@ -2970,8 +3270,18 @@ int unzClose(unzFile file) {
   unz_s *s{file};
   if (s->pfile_in_zip_read != nullptr) unzCloseCurrentFile(file);
 
+  file_in_zip_read_info_s *pool{s->pfile_in_zip_read_pool};
+  if (pool != nullptr) {
+    unzlocal_FreeFileInfo(s, pool);
+    zafree(s->alloc, pool);
+    s->pfile_in_zip_read_pool = nullptr;
+  }
+
+  zafree(s->alloc, s->stream_extra);
+
   const int rc{lufclose(s->file)};
-  zfree(s);  // unused s=0;
+  const ZALLOCATOR alloc{s->alloc};
+  zafree(alloc, s);  // unused s=0;
 
   return rc == 0 ? UNZ_OK : UNZ_EOF;
 }
@@ -2988,102 +3298,287 @@ void unzlocal_DosDateToTmuDate(uLong ulDosDate, tm_unz *ptm) {
   ptm->tm_sec = (uInt)(2 * (ulDosDate & 0x1f));
 }
 
-//  Get Info about the current file in the zipfile, with internal only info
-int unzlocal_GetCurrentFileInfoInternal(
-    unzFile file, unz_file_info *pfile_info,
-    unz_file_info_internal *pfile_info_internal, char *szFileName,
-    uLong fileNameBufferSize, void *extraField, uLong extraFieldBufferSize,
-    char *szComment, uLong commentBufferSize);
+// Reads exactly len bytes, however many reads it takes (a pipe may return less
+// than was asked for).
+int unzlocal_StreamRead(LUFILE *fin, void *buf, uLong len) {
+  auto *p = static_cast<char *>(buf);
 
-int unzlocal_GetCurrentFileInfoInternal(
-    unzFile file, unz_file_info *pfile_info,
-    unz_file_info_internal *pfile_info_internal, char *szFileName,
-    uLong fileNameBufferSize, void *extraField, uLong extraFieldBufferSize,
-    char *szComment, uLong commentBufferSize) {
-  unz_file_info file_info = {};
-  unz_file_info_internal file_info_internal = {};
-  int err = UNZ_OK;
-  uLong uMagic;
+  while (len > 0) {
+    const size_t got{lufread(p, 1, (uInt)len, fin)};
+    if (got == 0) return UNZ_ERRNO;
 
-  if (file == nullptr) return UNZ_PARAMERROR;
+    p += got;
+    len -= got;
+  }
 
-  unz_s *s{file};
-  if (lufseek(s->file, s->pos_in_central_dir + s->byte_before_the_zipfile,
-              SEEK_SET) != 0)
-    err = UNZ_ERRNO;
+  return UNZ_OK;
+}
 
-  // we check the magic
-  if (err == UNZ_OK) {
-    if (unzlocal_getLong(s->file, &uMagic) != UNZ_OK) {
-      err = UNZ_ERRNO;
-    } else if (uMagic != 0x02014b50) {
-      err = UNZ_BADZIPFILE;
-    }
+// Reads and throws away len bytes.
+int unzlocal_StreamDiscard(LUFILE *fin, uLong len) {
+  char buf[1024];
+
+  while (len > 0) {
+    const uLong n{len < sizeof(buf) ? len : sizeof(buf)};
+    if (unzlocal_StreamRead(fin, buf, n) != UNZ_OK) return UNZ_ERRNO;
+
+    len -= n;
   }
 
-  if (unzlocal_getShort(s->file, &file_info.version) != UNZ_OK) err = UNZ_ERRNO;
+  return UNZ_OK;
+}
 
-  if (unzlocal_getShort(s->file, &file_info.version_needed) != UNZ_OK)
-    err = UNZ_ERRNO;
+// Reads the local header at the current position of a streamed zip, and makes
+// it the current file.  Returns UNZ_END_OF_LIST_OF_FILE when the central
+// directory turns up instead.
+int unzlocal_StreamReadHeader(unz_s *s) {
+  LUFILE *fin{s->file};
+  unz_file_info file_info = {};
+  uLong uMagic;
 
-  if (unzlocal_getShort(s->file, &file_info.flag) != UNZ_OK) err = UNZ_ERRNO;
+  s->current_file_ok = 0;
 
-  if (unzlocal_getShort(s->file, &file_info.compression_method) != UNZ_OK)
+  if (unzlocal_getLong(fin, &uMagic) != UNZ_OK) return UNZ_ERRNO;
+  if (uMagic == 0x02014b50 || uMagic == 0x06054b50)
+    return UNZ_END_OF_LIST_OF_FILE;
+  if (uMagic != 0x04034b50) return UNZ_BADZIPFILE;
+
+  int err{UNZ_OK};
+  if (unzlocal_getShort(fin, &file_info.version_needed) != UNZ_OK)
     err = UNZ_ERRNO;
 
-  if (unzlocal_getLong(s->file, &file_info.dosDate) != UNZ_OK) err = UNZ_ERRNO;
+  if (unzlocal_getShort(fin, &file_info.flag) != UNZ_OK) err = UNZ_ERRNO;
 
-  unzlocal_DosDateToTmuDate(file_info.dosDate, &file_info.tmu_date);
+  if (unzlocal_getShort(fin, &file_info.compression_method) != UNZ_OK)
+    err = UNZ_ERRNO;
 
-  if (unzlocal_getLong(s->file, &file_info.crc) != UNZ_OK) err = UNZ_ERRNO;
+  if (unzlocal_getLong(fin, &file_info.dosDate) != UNZ_OK) err = UNZ_ERRNO;
 
-  if (unzlocal_getLong(s->file, &file_info.compressed_size) != UNZ_OK)
-    err = UNZ_ERRNO;
+  if (unzlocal_getLong(fin, &file_info.crc) != UNZ_OK) err = UNZ_ERRNO;
 
-  if (unzlocal_getLong(s->file, &file_info.uncompressed_size) != UNZ_OK)
+  if (unzlocal_getLong(fin, &file_info.compressed_size) != UNZ_OK)
     err = UNZ_ERRNO;
 
-  if (unzlocal_getShort(s->file, &file_info.size_filename) != UNZ_OK)
+  if (unzlocal_getLong(fin, &file_info.uncompressed_size) != UNZ_OK)
     err = UNZ_ERRNO;
 
-  if (unzlocal_getShort(s->file, &file_info.size_file_extra) != UNZ_OK)
-    err = UNZ_ERRNO;
+  uLong size_filename;
+  if (unzlocal_getShort(fin, &size_filename) != UNZ_OK) err = UNZ_ERRNO;
 
-  if (unzlocal_getShort(s->file, &file_info.size_file_comment) != UNZ_OK)
+  if (unzlocal_getShort(fin, &file_info.size_file_extra) != UNZ_OK)
     err = UNZ_ERRNO;
 
-  if (unzlocal_getShort(s->file, &file_info.disk_num_start) != UNZ_OK)
-    err = UNZ_ERRNO;
+  if (err != UNZ_OK) return err;
 
-  if (unzlocal_getShort(s->file, &file_info.internal_fa) != UNZ_OK)
-    err = UNZ_ERRNO;
+  if ((file_info.compression_method != 0) &&
+      (file_info.compression_method != Z_DEFLATED))
+    return UNZ_BADZIPFILE;
 
-  if (unzlocal_getLong(s->file, &file_info.external_fa) != UNZ_OK)
-    err = UNZ_ERRNO;
+  unzlocal_DosDateToTmuDate(file_info.dosDate, &file_info.tmu_date);
 
-  if (unzlocal_getLong(s->file, &file_info_internal.offset_curfile) != UNZ_OK)
-    err = UNZ_ERRNO;
+  // names too long for us are cut short, as unzGetCurrentFileInfo would
+  file_info.size_filename = size_filename < UNZ_MAXFILENAMEINZIP
+                                ? size_filename
+                                : UNZ_MAXFILENAMEINZIP;
+  if (unzlocal_StreamRead(fin, s->stream_name, file_info.size_filename) !=
+          UNZ_OK ||
+      unzlocal_StreamDiscard(fin, size_filename - file_info.size_filename) !=
+          UNZ_OK)
+    return UNZ_ERRNO;
 
-  long lSeek = static_cast<long>(file_info.size_filename);
-  if ((err == UNZ_OK) && (szFileName != nullptr)) {
-    uLong uSizeRead;
-    if (file_info.size_filename < fileNameBufferSize) {
-      *(szFileName + file_info.size_filename) = '\0';
-      uSizeRead = file_info.size_filename;
-    } else
-      uSizeRead = fileNameBufferSize;
+  s->stream_name[file_info.size_filename] = '\0';
 
-    if ((file_info.size_filename > 0) && (fileNameBufferSize > 0))
-      if (lufread(szFileName, (uInt)uSizeRead, 1, s->file) != 1)
-        err = UNZ_ERRNO;
+  if (file_info.size_file_extra > s->stream_extra_size) {
+    zafree(s->alloc, s->stream_extra);
+    s->stream_extra_size = 0;
 
-    lSeek -= uSizeRead;
+    s->stream_extra = static_cast<unsigned char *>(
+        zaalloc(s->alloc, file_info.size_file_extra));
+    if (!s->stream_extra) return UNZ_INTERNALERROR;
+
+    s->stream_extra_size = file_info.size_file_extra;
   }
 
-  if ((err == UNZ_OK) && (extraField != nullptr)) {
-    uLong uSizeRead;
-    if (file_info.size_file_extra < extraFieldBufferSize)
-      uSizeRead = file_info.size_file_extra;
+  if (unzlocal_StreamRead(fin, s->stream_extra, file_info.size_file_extra) !=
+      UNZ_OK)
+    return UNZ_ERRNO;
+
+  // The attributes are only in the central directory, so make some up: a
+  // unix host, a rw-r--r-- file or a rwxr-xr-x directory (with the msdos
+  // directory bit too) according to the trailing slash.
+  const char last{file_info.size_filename > 0
+                      ? s->stream_name[file_info.size_filename - 1]
+                      : '\0'};
+  const bool isdir{last == '/' || last == '\\'};
+
+  file_info.version = (3 << 8) | 20;
+  file_info.external_fa = isdir ? (0040755UL << 16) | 0x10 : 0100644UL << 16;
+
+  s->cur_file_info = file_info;
+  s->cur_file_info_internal.offset_curfile = 0;
+  s->stream_sizes_unknown =
+      (file_info.flag & 8) != 0 && file_info.compression_method != 0;
+  s->stream_state = STREAM_FRESH;
+  s->current_file_ok = 1;
+
+  return UNZ_OK;
+}
+
+// Open a Zip file which is read forward from a handle that can't seek, such
+// as a pipe.  The first local header is read straight away.
+unzFile unzOpenStreamInternal(LUFILE *fin) {
+  if (fin == nullptr) return nullptr;
+
+  auto *s = static_cast<unz_s *>(zaalloc(fin->alloc, sizeof(unz_s)));
+  if (!s) {
+    lufclose(fin);
+    return nullptr;
+  }
+
+  unz_s us = {};
+  us.alloc = fin->alloc;
+  us.file = fin;
+  us.streaming = true;
+
+  *s = us;
+
+  const int err{unzlocal_StreamReadHeader(s)};
+  if (err != UNZ_OK && err != UNZ_END_OF_LIST_OF_FILE) {
+    unzClose(s);
+    return nullptr;
+  }
+
+  return s;
+}
+
+//  Get Info about the current file in the zipfile, with internal only info
+int unzlocal_GetCurrentFileInfoInternal(
+    unzFile file, unz_file_info *pfile_info,
+    unz_file_info_internal *pfile_info_internal, char *szFileName,
+    uLong fileNameBufferSize, void *extraField, uLong extraFieldBufferSize,
+    char *szComment, uLong commentBufferSize);
+
+int unzlocal_GetCurrentFileInfoInternal(
+    unzFile file, unz_file_info *pfile_info,
+    unz_file_info_internal *pfile_info_internal, char *szFileName,
+    uLong fileNameBufferSize, void *extraField, uLong extraFieldBufferSize,
+    char *szComment, uLong commentBufferSize) {
+  unz_file_info file_info = {};
+  unz_file_info_internal file_info_internal = {};
+  int err = UNZ_OK;
+  uLong uMagic;
+
+  if (file == nullptr) return UNZ_PARAMERROR;
+
+  unz_s *s{file};
+  if (s->streaming) {
+    // everything we know came from the local header
+    if (!s->current_file_ok) return UNZ_END_OF_LIST_OF_FILE;
+
+    file_info = s->cur_file_info;
+
+    if (szFileName != nullptr && fileNameBufferSize > 0) {
+      uLong uSizeRead{file_info.size_filename};
+      if (uSizeRead < fileNameBufferSize)
+        szFileName[uSizeRead] = '\0';
+      else
+        uSizeRead = fileNameBufferSize;
+
+      memcpy(szFileName, s->stream_name, uSizeRead);
+    }
+
+    if (extraField != nullptr) {
+      const uLong uSizeRead{file_info.size_file_extra < extraFieldBufferSize
+                                ? file_info.size_file_extra
+                                : extraFieldBufferSize};
+      if (uSizeRead > 0) memcpy(extraField, s->stream_extra, uSizeRead);
+    }
+
+    if (szComment != nullptr && commentBufferSize > 0) *szComment = '\0';
+
+    if (pfile_info != nullptr) *pfile_info = file_info;
+    if (pfile_info_internal != nullptr)
+      *pfile_info_internal = s->cur_file_info_internal;
+
+    return UNZ_OK;
+  }
+
+  if (lufseek(s->file, s->pos_in_central_dir + s->byte_before_the_zipfile,
+              SEEK_SET) != 0)
+    err = UNZ_ERRNO;
+
+  // we check the magic
+  if (err == UNZ_OK) {
+    if (unzlocal_getLong(s->file, &uMagic) != UNZ_OK) {
+      err = UNZ_ERRNO;
+    } else if (uMagic != 0x02014b50) {
+      err = UNZ_BADZIPFILE;
+    }
+  }
+
+  if (unzlocal_getShort(s->file, &file_info.version) != UNZ_OK) err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.version_needed) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.flag) != UNZ_OK) err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.compression_method) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getLong(s->file, &file_info.dosDate) != UNZ_OK) err = UNZ_ERRNO;
+
+  unzlocal_DosDateToTmuDate(file_info.dosDate, &file_info.tmu_date);
+
+  if (unzlocal_getLong(s->file, &file_info.crc) != UNZ_OK) err = UNZ_ERRNO;
+
+  if (unzlocal_getLong(s->file, &file_info.compressed_size) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getLong(s->file, &file_info.uncompressed_size) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.size_filename) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.size_file_extra) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.size_file_comment) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.disk_num_start) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getShort(s->file, &file_info.internal_fa) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getLong(s->file, &file_info.external_fa) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  if (unzlocal_getLong(s->file, &file_info_internal.offset_curfile) != UNZ_OK)
+    err = UNZ_ERRNO;
+
+  long lSeek = static_cast<long>(file_info.size_filename);
+  if ((err == UNZ_OK) && (szFileName != nullptr)) {
+    uLong uSizeRead;
+    if (file_info.size_filename < fileNameBufferSize) {
+      *(szFileName + file_info.size_filename) = '\0';
+      uSizeRead = file_info.size_filename;
+    } else
+      uSizeRead = fileNameBufferSize;
+
+    if ((file_info.size_filename > 0) && (fileNameBufferSize > 0))
+      if (lufread(szFileName, (uInt)uSizeRead, 1, s->file) != 1)
+        err = UNZ_ERRNO;
+
+    lSeek -= uSizeRead;
+  }
+
+  if ((err == UNZ_OK) && (extraField != nullptr)) {
+    uLong uSizeRead;
+    if (file_info.size_file_extra < extraFieldBufferSize)
+      uSizeRead = file_info.size_file_extra;
     else
       uSizeRead = extraFieldBufferSize;
 
@@ -3147,6 +3642,9 @@ int unzGoToFirstFile(unzFile file) {
   if (file == nullptr) return UNZ_PARAMERROR;
 
   unz_s *s{file};
+  // a streamed zip can't go back
+  if (s->streaming) return s->num_file == 0 ? UNZ_OK : UNZ_ERRNO;
+
   s->pos_in_central_dir = s->offset_central_dir;
   s->num_file = 0;
   const int err{unzlocal_GetCurrentFileInfoInternal(
@@ -3164,6 +3662,17 @@ int unzGoToNextFile(unzFile file) {
 
   unz_s *s{file};
   if (!s->current_file_ok) return UNZ_END_OF_LIST_OF_FILE;
+
+  if (s->streaming) {
+    // the next local header is only there once this file has been got past,
+    // see unzStreamSkipCurrentFile
+    if (s->stream_state != STREAM_DONE) return UNZ_PARAMERROR;
+
+    const int err{unzlocal_StreamReadHeader(s)};
+    if (err == UNZ_OK) s->num_file++;
+    return err;
+  }
+
   if (s->num_file + 1 == s->gi.number_entry) return UNZ_END_OF_LIST_OF_FILE;
 
   s->pos_in_central_dir += SIZECENTRALDIRITEM + s->cur_file_info.size_filename +
@@ -3222,6 +3731,8 @@ int unzLocateFile(unzFile file, const char *szFileName, int iCaseSensitivity) {
 int unzlocal_CheckCurrentFileCoherencyHeader(unz_s *s, uInt *piSizeVar,
                                              uLong *poffset_local_extrafield,
                                              uInt *psize_local_extrafield) {
+  ZTRACE_SCOPE("local_header");
+
   uLong uMagic, uData, uFlags;
   uLong size_filename;
   uLong size_extra_field;
@@ -3296,44 +3807,38 @@ int unzlocal_CheckCurrentFileCoherencyHeader(unz_s *s, uInt *piSizeVar,
   return err;
 }
 
-//  Open for reading data the current file in the zipfile.
-//  If there is no error and the file is opened, the return value is UNZ_OK.
-int unzOpenCurrentFile(unzFile file, const char *password) {
+//  Sets up pfile_in_zip_read_info for reading the current file in the
+//  zipfile.  Its read buffer and inflate state are made the first time, and
+//  only reset when it is used again for another file.
+int unzlocal_OpenFileInfo(unz_s *s,
+                          file_in_zip_read_info_s *pfile_in_zip_read_info,
+                          const char *password) {
   uInt iSizeVar;
   uLong offset_local_extrafield;  // offset of the local extra field
   uInt size_local_extrafield;     // size of the local extra field
 
-  if (file == nullptr) return UNZ_PARAMERROR;
-
-  unz_s *s{file};
-  if (!s->current_file_ok) return UNZ_PARAMERROR;
-
-  if (s->pfile_in_zip_read != nullptr) unzCloseCurrentFile(file);
-
-  if (unzlocal_CheckCurrentFileCoherencyHeader(
-          s, &iSizeVar, &offset_local_extrafield, &size_local_extrafield) !=
-      UNZ_OK) {
+  if (s->streaming) {
+    // the stream is already just past the local header
+    iSizeVar = 0;
+    offset_local_extrafield = 0;
+    size_local_extrafield = 0;
+  } else if (unzlocal_CheckCurrentFileCoherencyHeader(
+                 s, &iSizeVar, &offset_local_extrafield,
+                 &size_local_extrafield) != UNZ_OK) {
     return UNZ_BADZIPFILE;
   }
 
-  auto *pfile_in_zip_read_info = static_cast<file_in_zip_read_info_s *>(
-      zmalloc(sizeof(file_in_zip_read_info_s)));
-  if (pfile_in_zip_read_info == nullptr) return UNZ_INTERNALERROR;
+  if (pfile_in_zip_read_info->read_buffer == nullptr) {
+    pfile_in_zip_read_info->read_buffer =
+        static_cast<char *>(zaalloc(s->alloc, UNZ_BUFSIZE));
+    if (pfile_in_zip_read_info->read_buffer == nullptr)
+      return UNZ_INTERNALERROR;
+  }
 
-  pfile_in_zip_read_info->read_buffer =
-      static_cast<char *>(zmalloc(UNZ_BUFSIZE));
   pfile_in_zip_read_info->offset_local_extrafield = offset_local_extrafield;
   pfile_in_zip_read_info->size_local_extrafield = size_local_extrafield;
   pfile_in_zip_read_info->pos_local_extrafield = 0;
 
-  if (pfile_in_zip_read_info->read_buffer == nullptr) {
-    if (pfile_in_zip_read_info != 0)
-      zfree(pfile_in_zip_read_info);  // unused pfile_in_zip_read_info=0;
-    return UNZ_INTERNALERROR;
-  }
-
-  pfile_in_zip_read_info->stream_initialised = 0;
-
   if ((s->cur_file_info.compression_method != 0) &&
       (s->cur_file_info.compression_method !=
        Z_DEFLATED)) {  // unused err=UNZ_BADZIPFILE;
@@ -3348,11 +3853,17 @@ int unzOpenCurrentFile(unzFile file, const char *password) {
   pfile_in_zip_read_info->byte_before_the_zipfile = s->byte_before_the_zipfile;
 
   pfile_in_zip_read_info->stream.total_out = 0;
+#ifdef ZU_STATS
+  pfile_in_zip_read_info->stream.stats = s->file->stats;
+#endif
 
-  if (!Store) {
-    pfile_in_zip_read_info->stream.zalloc = (alloc_func)0;
-    pfile_in_zip_read_info->stream.zfree = (free_func)0;
-    pfile_in_zip_read_info->stream.opaque = (voidpf)0;
+  if (!Store && pfile_in_zip_read_info->stream_initialised) {
+    // the window and trees left by the previous file are simply reused
+    inflateReset(&pfile_in_zip_read_info->stream);
+  } else if (!Store) {
+    pfile_in_zip_read_info->stream.zalloc = zcalloc;
+    pfile_in_zip_read_info->stream.zfree = zcfree;
+    pfile_in_zip_read_info->stream.opaque = (voidpf)&s->alloc;
 
     const int err{inflateInit2(&pfile_in_zip_read_info->stream)};
     if (err == Z_OK) pfile_in_zip_read_info->stream_initialised = 1;
@@ -3387,12 +3898,144 @@ int unzOpenCurrentFile(unzFile file, const char *password) {
 
   pfile_in_zip_read_info->stream.avail_in = (uInt)0;
 
+  if (s->streaming) {
+    // pos_in_zipfile counts what has been read of the data instead
+    pfile_in_zip_read_info->pos_in_zipfile = 0;
+
+    if (s->stream_sizes_unknown) {
+      pfile_in_zip_read_info->rest_read_compressed = UNZ_UNKNOWN_SIZE;
+      pfile_in_zip_read_info->rest_read_uncompressed = UNZ_UNKNOWN_SIZE;
+    }
+  }
+
+  ZSTAT_ADD(s->file->stats->items, 1);
+
+  return UNZ_OK;
+}
+
+//  Frees what unzlocal_OpenFileInfo made, but not pfile_in_zip_read_info
+//  itself.
+void unzlocal_FreeFileInfo(unz_s *s,
+                           file_in_zip_read_info_s *pfile_in_zip_read_info) {
+  if (pfile_in_zip_read_info->stream_initialised)
+    inflateEnd(&pfile_in_zip_read_info->stream);
+
+  pfile_in_zip_read_info->stream_initialised = 0;
+
+  zafree(s->alloc, pfile_in_zip_read_info->read_buffer);
+  pfile_in_zip_read_info->read_buffer = nullptr;
+}
+
+//  Open for reading data the current file in the zipfile.
+//  If there is no error and the file is opened, the return value is UNZ_OK.
+int unzOpenCurrentFile(unzFile file, const char *password) {
+  if (file == nullptr) return UNZ_PARAMERROR;
+
+  unz_s *s{file};
+  if (!s->current_file_ok) return UNZ_PARAMERROR;
+
+  if (s->pfile_in_zip_read != nullptr) unzCloseCurrentFile(file);
+
+  // a streamed file's local header and data can't be read again
+  if (s->streaming && s->stream_state != STREAM_FRESH) return UNZ_PARAMERROR;
+
+  file_in_zip_read_info_s *pfile_in_zip_read_info{s->pfile_in_zip_read_pool};
+  if (pfile_in_zip_read_info == nullptr) {
+    pfile_in_zip_read_info = static_cast<file_in_zip_read_info_s *>(
+        zaalloc(s->alloc, sizeof(file_in_zip_read_info_s)));
+    if (pfile_in_zip_read_info == nullptr) return UNZ_INTERNALERROR;
+
+    pfile_in_zip_read_info->read_buffer = nullptr;
+    pfile_in_zip_read_info->stream_initialised = 0;
+    s->pfile_in_zip_read_pool = pfile_in_zip_read_info;
+  }
+
+  const int err{unzlocal_OpenFileInfo(s, pfile_in_zip_read_info, password)};
+  if (err != UNZ_OK) return err;
+
+  if (s->streaming) s->stream_state = STREAM_READING;
+
   s->pfile_in_zip_read = pfile_in_zip_read_info;
 
   return UNZ_OK;
 }
 
-//  Read bytes from the current file.
+//  Finishes the current file of a streamed zip once its data has been read
+//  (or skipped, if info is nullptr): leaves the stream at the next local
+//  header, having read the data descriptor if there is one.
+int unzlocal_StreamEndOfFile(unz_s *s, file_in_zip_read_info_s *info) {
+  if (s->stream_state == STREAM_DONE) return UNZ_OK;
+
+  s->stream_state = STREAM_DONE;
+
+  if (s->stream_sizes_unknown) {
+    if (info == nullptr) return UNZ_PARAMERROR;
+
+    // inflate stopped at the end of the deflated data, so the rest of the
+    // buffer is whatever follows it and goes back to the stream.  If it was
+    // decrypted with the data, bring the keys up to where it starts and
+    // encrypt it again.
+    char *left{(char *)info->stream.next_in};
+    const uInt leftlen{info->stream.avail_in};
+
+    if (info->encrypted && leftlen > 0) {
+      unsigned long keys[3];
+      memcpy(keys, info->chunkkeys, sizeof(keys));
+
+      for (const char *c{info->read_buffer}; c < left; ++c)
+        Uupdate_keys(keys, *c);
+
+      for (uInt i{0}; i < leftlen; ++i) {
+        const char plain{left[i]};
+        left[i] = plain ^ Udecrypt_byte(keys);
+        Uupdate_keys(keys, plain);
+      }
+    }
+
+    if (lufunread(left, leftlen, s->file) != 0) return UNZ_ERRNO;
+
+    s->cur_file_info.compressed_size = info->pos_in_zipfile - leftlen;
+    s->cur_file_info.uncompressed_size = info->stream.total_out;
+  } else {
+    // we know where the data ends, but may not have read up to it
+    const uLong rest{info != nullptr ? info->rest_read_compressed
+                                     : s->cur_file_info.compressed_size};
+    if (unzlocal_StreamDiscard(s->file, rest) != UNZ_OK) return UNZ_ERRNO;
+  }
+
+  if (info != nullptr) {
+    info->stream.avail_in = 0;
+    info->rest_read_compressed = 0;
+    info->rest_read_uncompressed = 0;
+  }
+
+  if (s->cur_file_info.flag & 8) {
+    // data descriptor: crc and sizes, after an optional signature
+    uLong crc, csize, usize;
+    if (unzlocal_getLong(s->file, &crc) != UNZ_OK) return UNZ_ERRNO;
+    if (crc == 0x08074b50 && unzlocal_getLong(s->file, &crc) != UNZ_OK)
+      return UNZ_ERRNO;
+    if (unzlocal_getLong(s->file, &csize) != UNZ_OK) return UNZ_ERRNO;
+    if (unzlocal_getLong(s->file, &usize) != UNZ_OK) return UNZ_ERRNO;
+
+    if (s->stream_sizes_unknown &&
+        (csize != s->cur_file_info.compressed_size ||
+         usize != s->cur_file_info.uncompressed_size))
+      return UNZ_BADZIPFILE;
+
+    s->cur_file_info.crc = crc;
+    s->cur_file_info.compressed_size = csize;
+    s->cur_file_info.uncompressed_size = usize;
+
+    if (info != nullptr) info->crc32_wait = crc;
+  }
+
+  s->stream_sizes_unknown = false;
+
+  return UNZ_OK;
+}
+
+//  Read bytes from the file set up in pfile_in_zip_read_info.
 //  buf contain buffer where data must be copied
 //  len the size of buf.
 //  return the number of byte copied if somes bytes are copied (and also sets
@@ -3400,18 +4043,14 @@ int unzOpenCurrentFile(unzFile file, const char *password) {
 //  *reached_eof). return <0 with error code if there is an error. (in which
 //  case *reached_eof is meaningless)
 //    (UNZ_ERRNO for IO error, or zLib error for uncompress error)
-int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
-                       bool *reached_eof) {
+int unzlocal_ReadFileInfo(unz_s *s,
+                          file_in_zip_read_info_s *pfile_in_zip_read_info,
+                          voidp buf, unsigned len, bool *reached_eof) {
   int err{UNZ_OK};
   uInt iRead{0};
 
   if (reached_eof != 0) *reached_eof = false;
 
-  unz_s *s{file};
-  if (s == nullptr) return UNZ_PARAMERROR;
-
-  file_in_zip_read_info_s *pfile_in_zip_read_info = s->pfile_in_zip_read;
-  if (pfile_in_zip_read_info == nullptr) return UNZ_PARAMERROR;
   if (pfile_in_zip_read_info->read_buffer == nullptr) {
     return UNZ_END_OF_LIST_OF_FILE;
   }
@@ -3438,15 +4077,22 @@ int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
         return UNZ_EOF;
       }
 
-      if (lufseek(pfile_in_zip_read_info->file,
-                  pfile_in_zip_read_info->pos_in_zipfile +
-                      pfile_in_zip_read_info->byte_before_the_zipfile,
-                  SEEK_SET) != 0)
-        return UNZ_ERRNO;
-
-      if (lufread(pfile_in_zip_read_info->read_buffer, uReadThis, 1,
-                  pfile_in_zip_read_info->file) != 1)
-        return UNZ_ERRNO;
+      if (s->streaming) {
+        // no seeking, and a pipe may give us less than we asked for
+        uReadThis = (uInt)lufread(pfile_in_zip_read_info->read_buffer, 1,
+                                  uReadThis, pfile_in_zip_read_info->file);
+        if (uReadThis == 0) return UNZ_ERRNO;
+      } else {
+        if (lufseek(pfile_in_zip_read_info->file,
+                    pfile_in_zip_read_info->pos_in_zipfile +
+                        pfile_in_zip_read_info->byte_before_the_zipfile,
+                    SEEK_SET) != 0)
+          return UNZ_ERRNO;
+
+        if (lufread(pfile_in_zip_read_info->read_buffer, uReadThis, 1,
+                    pfile_in_zip_read_info->file) != 1)
+          return UNZ_ERRNO;
+      }
 
       pfile_in_zip_read_info->pos_in_zipfile += uReadThis;
       pfile_in_zip_read_info->rest_read_compressed -= uReadThis;
@@ -3456,6 +4102,9 @@ int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
 
       //
       if (pfile_in_zip_read_info->encrypted) {
+        memcpy(pfile_in_zip_read_info->chunkkeys, pfile_in_zip_read_info->keys,
+               sizeof(pfile_in_zip_read_info->chunkkeys));
+
         char *nbuf = (char *)pfile_in_zip_read_info->stream.next_in;
         for (unsigned int i = 0; i < uReadThis; i++)
           nbuf[i] = zdecode(pfile_in_zip_read_info->keys, nbuf[i]);
@@ -3467,7 +4116,6 @@ int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
       uDoEncHead = pfile_in_zip_read_info->stream.avail_in;
     if (uDoEncHead > 0) {
       char bufcrc = pfile_in_zip_read_info->stream.next_in[uDoEncHead - 1];
-      pfile_in_zip_read_info->rest_read_uncompressed -= uDoEncHead;
       pfile_in_zip_read_info->stream.avail_in -= uDoEncHead;
       pfile_in_zip_read_info->stream.next_in += uDoEncHead;
       pfile_in_zip_read_info->encheadleft -= uDoEncHead;
@@ -3489,9 +4137,13 @@ int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
       for (i = 0; i < uDoCopy; i++)
         *(pfile_in_zip_read_info->stream.next_out + i) =
             *(pfile_in_zip_read_info->stream.next_in + i);
-      pfile_in_zip_read_info->crc32 =
-          ucrc32(pfile_in_zip_read_info->crc32,
-                 pfile_in_zip_read_info->stream.next_out, uDoCopy);
+      {
+        ZSTAT_TIME(s->file->stats->crc_ns);
+        pfile_in_zip_read_info->crc32 =
+            ucrc32(pfile_in_zip_read_info->crc32,
+                   pfile_in_zip_read_info->stream.next_out, uDoCopy);
+      }
+      ZSTAT_ADD(s->file->stats->bytes_out, uDoCopy);
       pfile_in_zip_read_info->rest_read_uncompressed -= uDoCopy;
       pfile_in_zip_read_info->stream.avail_in -= uDoCopy;
       pfile_in_zip_read_info->stream.avail_out -= uDoCopy;
@@ -3502,23 +4154,40 @@ int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
 
       if (pfile_in_zip_read_info->rest_read_uncompressed == 0) {
         if (reached_eof != 0) *reached_eof = true;
+
+        if (s->streaming) {
+          const int e{unzlocal_StreamEndOfFile(s, pfile_in_zip_read_info)};
+          if (e != UNZ_OK) return e;
+        }
       }
     } else {
       int flush{Z_SYNC_FLUSH};
       uLong uTotalOutBefore = pfile_in_zip_read_info->stream.total_out;
       const Byte *bufBefore = pfile_in_zip_read_info->stream.next_out;
-      //
-      err = inflate(&pfile_in_zip_read_info->stream, flush);
-      //
+      {
+        ZTRACE_SCOPE("inflate");
+        ZSTAT_TIME(s->file->stats->inflate_ns);
+        err = inflate(&pfile_in_zip_read_info->stream, flush);
+      }
       uLong uTotalOutAfter = pfile_in_zip_read_info->stream.total_out;
       uLong uOutThis = uTotalOutAfter - uTotalOutBefore;
-      pfile_in_zip_read_info->crc32 =
-          ucrc32(pfile_in_zip_read_info->crc32, bufBefore, (uInt)(uOutThis));
+      {
+        ZSTAT_TIME(s->file->stats->crc_ns);
+        pfile_in_zip_read_info->crc32 =
+            ucrc32(pfile_in_zip_read_info->crc32, bufBefore, (uInt)(uOutThis));
+      }
+      ZSTAT_ADD(s->file->stats->bytes_out, uOutThis);
       pfile_in_zip_read_info->rest_read_uncompressed -= uOutThis;
       iRead += (uInt)(uTotalOutAfter - uTotalOutBefore);
       if (err == Z_STREAM_END ||
           pfile_in_zip_read_info->rest_read_uncompressed == 0) {
         if (reached_eof != 0) *reached_eof = true;
+
+        if (s->streaming) {
+          const int e{unzlocal_StreamEndOfFile(s, pfile_in_zip_read_info)};
+          if (e != UNZ_OK) return e;
+        }
+
         return iRead;
       }
       if (err != Z_OK) break;
@@ -3529,6 +4198,21 @@ int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
   return err;
 }
 
+//  Read bytes from the current file, as unzlocal_ReadFileInfo.
+int unzReadCurrentFile(unzFile file, voidp buf, unsigned len,
+                       bool *reached_eof) {
+  if (reached_eof != 0) *reached_eof = false;
+
+  unz_s *s{file};
+  if (s == nullptr) return UNZ_PARAMERROR;
+
+  file_in_zip_read_info_s *pfile_in_zip_read_info = s->pfile_in_zip_read;
+  if (pfile_in_zip_read_info == nullptr) return UNZ_PARAMERROR;
+
+  return unzlocal_ReadFileInfo(s, pfile_in_zip_read_info, buf, len,
+                               reached_eof);
+}
+
 //  Close the file in zip opened with unzipOpenCurrentFile
 //  Return UNZ_CRCERROR if all the file was read but the CRC is not good
 int unzCloseCurrentFile(unzFile file) {
@@ -3546,45 +4230,187 @@ int unzCloseCurrentFile(unzFile file) {
       err = UNZ_CRCERROR;
   }
 
-  if (pfile_in_zip_read_info->read_buffer != 0) {
-    void *buf = pfile_in_zip_read_info->read_buffer;
-    zfree(buf);
+  // The read info stays in s->pfile_in_zip_read_pool for the next file and is
+  // only freed by unzClose.
+  s->pfile_in_zip_read = nullptr;
 
-    pfile_in_zip_read_info->read_buffer = 0;
+  return err;
+}
+
+//  Moves a streamed zip past the data of its current file, ready for
+//  unzGoToNextFile.  Whatever of the data hasn't been read yet is skipped if
+//  its size is known, and otherwise inflated (and discarded) to find its end.
+int unzStreamSkipCurrentFile(unzFile file, const char *password) {
+  if (file == nullptr) return UNZ_PARAMERROR;
+
+  unz_s *s{file};
+  if (!s->streaming || !s->current_file_ok) return UNZ_PARAMERROR;
+  if (s->stream_state == STREAM_DONE) return UNZ_OK;
+
+  file_in_zip_read_info_s *info{
+      s->stream_state == STREAM_READING ? s->pfile_in_zip_read_pool : nullptr};
+  if (!s->stream_sizes_unknown) return unzlocal_StreamEndOfFile(s, info);
+
+  if (info == nullptr) {
+    const int err{unzOpenCurrentFile(file, password)};
+    if (err != UNZ_OK) return err;
+  } else {
+    s->pfile_in_zip_read = info;
   }
 
-  pfile_in_zip_read_info->read_buffer = nullptr;
-  if (pfile_in_zip_read_info->stream_initialised)
-    inflateEnd(&pfile_in_zip_read_info->stream);
+  char buf[4096];
+  bool reached_eof{false};
+  int res;
 
-  pfile_in_zip_read_info->stream_initialised = 0;
-  if (pfile_in_zip_read_info != 0)
-    zfree(pfile_in_zip_read_info);  // unused pfile_in_zip_read_info=0;
+  do {
+    res = unzReadCurrentFile(file, buf, sizeof(buf), &reached_eof);
+  } while (res > 0 && !reached_eof);
 
-  s->pfile_in_zip_read = nullptr;
+  unzCloseCurrentFile(file);
 
-  return err;
+  if (res < 0) return res;
+
+  return s->stream_state == STREAM_DONE ? UNZ_OK : UNZ_BADZIPFILE;
 }
 
 int unzOpenCurrentFile(unzFile file, const char *password);
 int unzCloseCurrentFile(unzFile file);
 
+// A set of directory paths, used to remember which directories are already
+// known to exist.  It is only a cache, so if memory for a new path can't be
+// had the path simply isn't remembered.
+class TDirCache {
+ public:
+  explicit TDirCache(const ZALLOCATOR &allocator) noexcept
+      : alloc(allocator), buckets(nullptr), nbuckets(0), count(0) {}
+  ~TDirCache() noexcept {
+    Clear();
+    zafree(alloc, buckets);
+  }
+
+  TDirCache(const TDirCache &) = delete;
+  TDirCache &operator=(const TDirCache &) = delete;
+
+  [[nodiscard]] bool Contains(const TCHAR *path) const {
+    if (nbuckets == 0) return false;
+
+    const size_t hash{Hash(path)};
+    for (const Node *n{buckets[hash & (nbuckets - 1)]}; n; n = n->next) {
+      if (n->hash == hash && _tcscmp(n->path, path) == 0) return true;
+    }
+
+    return false;
+  }
+
+  void Add(const TCHAR *path) {
+    if (count >= nbuckets) Grow();
+    if (nbuckets == 0) return;
+
+    const size_t len{_tcslen(path)};
+    auto *n = static_cast<Node *>(
+        zaalloc(alloc, sizeof(Node) + len * sizeof(TCHAR)));
+    if (!n) return;
+
+    n->hash = Hash(path);
+    memcpy(n->path, path, (len + 1) * sizeof(TCHAR));
+
+    Node *&head{buckets[n->hash & (nbuckets - 1)]};
+    n->next = head;
+    head = n;
+    ++count;
+  }
+
+  void Clear() {
+    for (size_t i{0}; i < nbuckets; ++i) {
+      for (Node *n{buckets[i]}; n;) {
+        Node *next{n->next};
+        zafree(alloc, n);
+        n = next;
+      }
+
+      buckets[i] = nullptr;
+    }
+
+    count = 0;
+  }
+
+ private:
+  struct Node {
+    Node *next;
+    size_t hash;
+    TCHAR path[1];  // really as long as the path
+  };
+
+  // FNV-1a
+  static size_t Hash(const TCHAR *path) {
+    size_t h{static_cast<size_t>(2166136261U)};
+    for (; *path; ++path) {
+      h ^= static_cast<size_t>(*path);
+      h *= 16777619U;
+    }
+    return h;
+  }
+
+  // Doubles the bucket array.  If that fails we keep the old one, which is
+  // still correct, just slower.
+  void Grow() {
+    const size_t newcount{nbuckets ? nbuckets * 2 : 64};
+    auto **newbuckets =
+        static_cast<Node **>(zaalloc(alloc, newcount * sizeof(Node *)));
+    if (!newbuckets) return;
+
+    memset(newbuckets, 0, newcount * sizeof(Node *));
+
+    for (size_t i{0}; i < nbuckets; ++i) {
+      for (Node *n{buckets[i]}; n;) {
+        Node *next{n->next};
+        Node *&head{newbuckets[n->hash & (newcount - 1)]};
+        n->next = head;
+        head = n;
+        n = next;
+      }
+    }
+
+    zafree(alloc, buckets);
+    buckets = newbuckets;
+    nbuckets = newcount;
+  }
+
+  ZALLOCATOR alloc;
+  Node **buckets;
+  size_t nbuckets;  // always a power of two
+  size_t count;
+};
+
+struct TUnzipItem;
+
 class TUnzip {
  public:
-  explicit TUnzip(const char *pwd) noexcept
-      : uf(nullptr),
+  TUnzip(const char *pwd, const ZALLOCATOR &allocator) noexcept
+#ifdef ZU_STATS
+      : alloc{StatAllocate, StatDeallocate, this},
+        stats{},
+#else
+      : alloc(allocator),
+#endif
+        ualloc(allocator),
+        uf(nullptr),
         oerr(ZR_OK),
         currentfile(-1),
         czei(-1),
         password(nullptr),
-        unzbuf(nullptr) {
+        unzbuf(nullptr),
+        extrabuf(nullptr),
+        extrabufsize(0),
+        ensureddirs(alloc),
+        items(nullptr) {
     memset(&cze, 0, sizeof(cze));
     memset(&rootdir, 0, sizeof(rootdir));
 
     if (pwd != nullptr) {
       const size_t pwdsize = strlen(pwd) + 1;
 
-      password = new (std::nothrow) char[pwdsize];
+      password = static_cast<char *>(zaalloc(alloc, pwdsize));
       if (password) {
         strcpy(password, pwd);
       } else {
@@ -3594,10 +4420,21 @@ class TUnzip {
   }
 
   ~TUnzip() noexcept {
-    delete[] password;
-    delete[] unzbuf;
+    zafree(alloc, password);
+    zafree(alloc, unzbuf);
+    zafree(alloc, extrabuf);
   }
 
+  // All our memory comes from here.  It's the caller's ualloc, counted when
+  // there are statistics; the TUnzip itself comes straight from ualloc.
+  ZALLOCATOR alloc;
+#ifdef ZU_STATS
+  static void *StatAllocate(void *opaque, size_t size);
+  static void StatDeallocate(void *opaque, void *ptr);
+
+  UNZIPSTATS stats;  // for UnzipGetStats
+#endif
+  ZALLOCATOR ualloc;
   unzFile uf;
   ZRESULT oerr;
   int currentfile;
@@ -3605,7 +4442,13 @@ class TUnzip {
   int czei;
   char *password;
   char *unzbuf;             // lazily created and destroyed, used by Unzip
+  unsigned char *extrabuf;  // local extra field, grown as needed by Get
+  unsigned int extrabufsize;
   TCHAR rootdir[MAX_PATH];  // includes a trailing slash
+  // Directories already known to exist, so that extracting many files into
+  // the same tree doesn't stat/mkdir every path component again.
+  TDirCache ensureddirs;
+  TUnzipItem *items;  // open through OpenItem, each reading on its own
 
   [[nodiscard]] ZRESULT Open(void *z, unsigned int len, ZipMode flags);
   [[nodiscard]] ZRESULT Get(int index, ZIPENTRY *ze);
@@ -3614,10 +4457,53 @@ class TUnzip {
   [[nodiscard]] ZRESULT Unzip(int index, void *dst, unsigned int len,
                               ZipMode flags);
   [[nodiscard]] ZRESULT SetUnzipBaseDir(const TCHAR *dir);
+  [[nodiscard]] ZRESULT OpenItem(int index, TUnzipItem **item);
+  [[nodiscard]] ZRESULT OpenItemRaw(int index, ZIPRAWITEM *raw,
+                                    TUnzipItem **item);
+  [[nodiscard]] ZRESULT ReadItem(TUnzipItem *item, void *buf, unsigned int len,
+                                 unsigned int *read);
+  ZRESULT CloseItem(TUnzipItem *item);
   ZRESULT Close();
+
+ private:
+  [[nodiscard]] ZRESULT EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir);
+  [[nodiscard]] ZRESULT GoTo(int index);
+};
+
+#ifdef ZU_STATS
+void *TUnzip::StatAllocate(void *opaque, size_t size) {
+  auto *unz = static_cast<TUnzip *>(opaque);
+
+  void *ptr{zaalloc(unz->ualloc, size)};
+  if (ptr) {
+    ++unz->stats.allocations;
+    unz->stats.allocated += size;
+  }
+
+  return ptr;
+}
+
+void TUnzip::StatDeallocate(void *opaque, void *ptr) {
+  zafree(static_cast<TUnzip *>(opaque)->ualloc, ptr);
+}
+#endif
+
+// An item opened with OpenZipItem.  It has its own read buffer, inflate state
+// and position in the zip, so any number can be read at once, interleaved
+// with each other and with UnzipItem.
+struct TUnzipItem {
+  DWORD flag;  // 3, to tell it from the HZIP handles
+  TUnzip *unz;
+  file_in_zip_read_info_s info;
+  bool eof;
+  bool raw;              // opened by OpenItemRaw: read as stored
+  unsigned char *extra;  // for raw items, the local then the central extra
+  TUnzipItem *prev, *next;
 };
 
 ZRESULT TUnzip::Open(void *z, unsigned int len, ZipMode flags) {
+  ZTRACE_SCOPE("unzip_open");
+
   if (uf != 0 || currentfile != -1) return ZR_NOTINITED;
 
 #ifdef ZIP_STD
@@ -3641,19 +4527,17 @@ ZRESULT TUnzip::Open(void *z, unsigned int len, ZipMode flags) {
     lastchar[2] = 0;
   }
 
-  // test if we can seek on it. We can't use GetFileType(h) == FILE_TYPE_DISK
-  // since it's not on CE.
-  if (flags == ZIP_HANDLE) {
-    const DWORD pos = GetFilePosU((HANDLE)z);
-    bool canseek = pos != INVALID_SET_FILE_POINTER;
-    if (!canseek) return ZR_SEEK;
-  }
-
   ZRESULT e;
-  LUFILE *f = lufopen(z, len, flags, &e);
+  LUFILE *f = lufopen(z, len, flags, alloc, &e);
   if (f == nullptr) return e;
 
-  uf = unzOpenInternal(f);
+#ifdef ZU_STATS
+  f->stats = &stats;
+#endif
+
+  // Pipes and the like can't reach the central directory at the end, so
+  // their files are read in order, as the local headers come.
+  uf = f->canseek ? unzOpenInternal(f) : unzOpenStreamInternal(f);
   if (uf == 0) return ZR_NOFILE;
 
   return ZR_OK;
@@ -3671,14 +4555,61 @@ ZRESULT TUnzip::SetUnzipBaseDir(const TCHAR *dir) {
     lastchar[2] = 0;
   }
 
+  // relative directories ensured so far were under the old root
+  ensureddirs.Clear();
+
   return ZR_OK;
 }
 
+// Makes index the current file of uf.  A streamed zip can only go forward,
+// skipping the data of the files it passes.
+ZRESULT TUnzip::GoTo(int index) {
+  ZTRACE_SCOPE("central_dir_walk");
+
+  if (!uf->streaming) {
+    if (index < 0 || index >= (int)uf->gi.number_entry) return ZR_ARGS;
+    if (index < (int)uf->num_file) unzGoToFirstFile(uf);
+
+    while ((int)uf->num_file < index) unzGoToNextFile(uf);
+
+    return ZR_OK;
+  }
+
+  if (index < (int)uf->num_file) return ZR_SEEK;
+
+  while ((int)uf->num_file < index && uf->current_file_ok) {
+    if (currentfile != -1) {
+      unzCloseCurrentFile(uf);
+      currentfile = -1;
+    }
+
+    int res{unzStreamSkipCurrentFile(uf, password)};
+    if (res == UNZ_PASSWORD) return ZR_PASSWORD;
+    if (res == UNZ_ERRNO) return ZR_READ;
+    if (res != UNZ_OK) return ZR_CORRUPT;
+
+    res = unzGoToNextFile(uf);
+    if (res == UNZ_ERRNO) return ZR_READ;
+    if (res != UNZ_OK && res != UNZ_END_OF_LIST_OF_FILE) return ZR_CORRUPT;
+  }
+
+  // past the last file
+  return uf->current_file_ok ? ZR_OK : ZR_ARGS;
+}
+
 ZRESULT TUnzip::Get(int index, ZIPENTRY *ze) {
-  if (index < -1 || index >= (int)uf->gi.number_entry) return ZR_ARGS;
-  if (currentfile != -1) unzCloseCurrentFile(uf);
-  currentfile = -1;
-  if (index == czei && index != -1) {
+  if (index < -1) return ZR_ARGS;
+  if (!uf->streaming && index >= (int)uf->gi.number_entry) return ZR_ARGS;
+  // a streamed zip doesn't know how many files it has, and can't go back
+  if (uf->streaming && index < (int)uf->num_file) return ZR_SEEK;
+
+  // the file being streamed stays open, so it can be asked about mid-way
+  if (currentfile != -1 && !(uf->streaming && index == currentfile)) {
+    unzCloseCurrentFile(uf);
+    currentfile = -1;
+  }
+
+  if (index == czei && index != -1 && !uf->streaming) {
     memcpy(ze, &cze, sizeof(ZIPENTRY));
     return ZR_OK;
   }
@@ -3702,26 +4633,45 @@ ZRESULT TUnzip::Get(int index, ZIPENTRY *ze) {
     ze->unc_size = 0;
     return ZR_OK;
   }
-  if (index < (int)uf->num_file) unzGoToFirstFile(uf);
-  while ((int)uf->num_file < index) unzGoToNextFile(uf);
+  const ZRESULT grc{GoTo(index)};
+  if (grc != ZR_OK) return grc;
+
   unz_file_info ufi;
   char fn[MAX_PATH];
   unzGetCurrentFileInfo(uf, &ufi, fn, MAX_PATH, nullptr, 0, nullptr, 0);
-  // now get the extra header. We do this ourselves, instead of
-  // calling unzOpenCurrentFile &c., to avoid allocating more than necessary.
-  unsigned int extralen, iSizeVar;
-  unsigned long offset;
-  int res = unzlocal_CheckCurrentFileCoherencyHeader(uf, &iSizeVar, &offset,
-                                                     &extralen);
-  if (res != UNZ_OK) return ZR_CORRUPT;
-  if (lufseek(uf->file, offset, SEEK_SET) != 0) return ZR_READ;
 
-  unsigned char *extra = new (std::nothrow) unsigned char[extralen];
-  if (!extra) return ZR_NOALLOC;
+  unsigned int extralen;
+  const unsigned char *extra;
+
+  if (uf->streaming) {
+    // which was read along with the local header
+    extralen = ufi.size_file_extra;
+    extra = uf->stream_extra;
+  } else {
+    // now get the extra header. We do this ourselves, instead of
+    // calling unzOpenCurrentFile &c., to avoid allocating more than necessary.
+    unsigned int iSizeVar;
+    unsigned long offset;
+    int res = unzlocal_CheckCurrentFileCoherencyHeader(uf, &iSizeVar, &offset,
+                                                       &extralen);
+    if (res != UNZ_OK) return ZR_CORRUPT;
+    if (lufseek(uf->file, offset, SEEK_SET) != 0) return ZR_READ;
+
+    if (extralen > extrabufsize) {
+      zafree(alloc, extrabuf);
+      extrabufsize = 0;
+
+      extrabuf = static_cast<unsigned char *>(zaalloc(alloc, extralen));
+      if (!extrabuf) return ZR_NOALLOC;
+
+      extrabufsize = extralen;
+    }
+
+    if (lufread(extrabuf, 1, (uInt)extralen, uf->file) != extralen) {
+      return ZR_READ;
+    }
 
-  if (lufread(extra, 1, (uInt)extralen, uf->file) != extralen) {
-    delete[] extra;
-    return ZR_READ;
+    extra = extrabuf;
   }
   //
   ze->index = uf->num_file;
@@ -3816,6 +4766,12 @@ ZRESULT TUnzip::Get(int index, ZIPENTRY *ze) {
   ze->comp_size = ufi.compressed_size;
   ze->unc_size = ufi.uncompressed_size;
 
+  // not known until the data descriptor after the data has been read
+  if (uf->streaming && uf->stream_sizes_unknown) {
+    ze->comp_size = -1;
+    ze->unc_size = -1;
+  }
+
   WORD dostime = (WORD)(ufi.dosDate & 0xFFFF);
   WORD dosdate = (WORD)((ufi.dosDate >> 16) & 0xFFFF);
 
@@ -3880,7 +4836,6 @@ ZRESULT TUnzip::Get(int index, ZIPENTRY *ze) {
     break;
   }
 
-  delete[] extra;
   memcpy(&cze, ze, sizeof(ZIPENTRY));
 
   czei = index;
@@ -3888,6 +4843,8 @@ ZRESULT TUnzip::Get(int index, ZIPENTRY *ze) {
 }
 
 ZRESULT TUnzip::Find(const TCHAR *tname, bool ic, int *index, ZIPENTRY *ze) {
+  ZTRACE_SCOPE("find");
+
   char name[MAX_PATH];
 
 #ifdef UNICODE
@@ -3897,8 +4854,24 @@ ZRESULT TUnzip::Find(const TCHAR *tname, bool ic, int *index, ZIPENTRY *ze) {
   name[std::size(name) - 1] = '\0';
 #endif
 
-  const int res{
-      unzLocateFile(uf, name, ic ? CASE_INSENSITIVE : CASE_SENSITIVE)};
+  int res{UNZ_END_OF_LIST_OF_FILE};
+
+  if (!uf->streaming) {
+    res = unzLocateFile(uf, name, ic ? CASE_INSENSITIVE : CASE_SENSITIVE);
+  } else {
+    // a streamed zip can only be searched forward from the current file
+    while (uf->current_file_ok) {
+      if (unzStringFileNameCompare(uf->stream_name, name,
+                                   ic ? CASE_INSENSITIVE : CASE_SENSITIVE) ==
+          0) {
+        res = UNZ_OK;
+        break;
+      }
+
+      if (GoTo((int)uf->num_file + 1) != ZR_OK) break;
+    }
+  }
+
   if (res != UNZ_OK) {
     if (index) *index = -1;
     if (ze) {
@@ -3927,8 +4900,11 @@ ZRESULT TUnzip::Find(const TCHAR *tname, bool ic, int *index, ZIPENTRY *ze) {
   return ZR_OK;
 }
 
-// first check that rootdir exists. nb. rootdir has a trailing slash
-ZRESULT EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir) {
+// first check that rootdir exists. nb. rootdir has a trailing slash.
+// Directories which were found or created are remembered in ensureddirs, so
+// later files in the same directory cost a lookup instead of a syscall per
+// path component.
+ZRESULT TUnzip::EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir) {
   if (rootdir) {
     TCHAR rd[MAX_PATH];
     _tcsncpy(rd, rootdir, std::size(rd) - 1);
@@ -3939,7 +4915,7 @@ ZRESULT EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir) {
       rd[len - 1] = 0;
     }
 
-    if (*rd) {
+    if (*rd && !ensureddirs.Contains(rd)) {
 #ifdef ZIP_STD
       if (!FileExists(rd) && lumkdir(rd)) {
         return ZR_MKDIR;
@@ -3949,11 +4925,24 @@ ZRESULT EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir) {
         return ZR_MKDIR;
       }
 #endif
+      ensureddirs.Add(rd);
     }
   }
 
   if (*dir == 0) return ZR_OK;
 
+  TCHAR cd[MAX_PATH];
+  *cd = 0;
+
+  if (rootdir != 0) _tcsncpy(cd, rootdir, std::size(cd) - 1);
+  cd[std::size(cd) - 1] = 0;
+
+  const size_t len{_tcslen(cd)};
+  _tcsncpy(cd + len, dir, std::size(cd) - 1 - len);
+  cd[std::size(cd) - 1] = 0;
+
+  if (ensureddirs.Contains(cd)) return ZR_OK;
+
   const TCHAR *lastslash{dir}, *c{lastslash};
   while (*c) {
     if (*c == '/' || *c == '\\') lastslash = c;
@@ -3970,16 +4959,6 @@ ZRESULT EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir) {
     if (rc != ZR_OK) return rc;
   }
 
-  TCHAR cd[MAX_PATH];
-  *cd = 0;
-
-  if (rootdir != 0) _tcsncpy(cd, rootdir, std::size(cd) - 1);
-  cd[std::size(cd) - 1] = 0;
-
-  const size_t len{_tcslen(cd)};
-  _tcsncpy(cd + len, dir, std::size(cd) - 1 - len);
-  cd[std::size(cd) - 1] = 0;
-
 #ifdef ZIP_STD
   if (!FileExists(cd) && lumkdir(cd)) {
     return ZR_MKDIR;
@@ -3990,10 +4969,14 @@ ZRESULT EnsureDirectory(const TCHAR *rootdir, const TCHAR *dir) {
   }
 #endif
 
+  ensureddirs.Add(cd);
+
   return ZR_OK;
 }
 
 ZRESULT TUnzip::Unzip(int index, void *dst, unsigned int len, ZipMode flags) {
+  ZTRACE_SCOPE("unzip_item");
+
   if (flags != ZIP_MEMORY && flags != ZIP_FILENAME && flags != ZIP_HANDLE) {
     return ZR_ARGS;
   }
@@ -4005,10 +4988,11 @@ ZRESULT TUnzip::Unzip(int index, void *dst, unsigned int len, ZipMode flags) {
         currentfile = -1;
       }
 
-      if (index >= (int)uf->gi.number_entry) return ZR_ARGS;
-      if (index < (int)uf->num_file) unzGoToFirstFile(uf);
+      const ZRESULT grc{GoTo(index)};
+      if (grc != ZR_OK) return grc;
 
-      while ((int)uf->num_file < index) unzGoToNextFile(uf);
+      // a streamed file's data can only be read once
+      if (uf->streaming && uf->stream_state != STREAM_FRESH) return ZR_SEEK;
 
       unzOpenCurrentFile(uf, password);
       currentfile = index;
@@ -4034,15 +5018,12 @@ ZRESULT TUnzip::Unzip(int index, void *dst, unsigned int len, ZipMode flags) {
     currentfile = -1;
   }
 
-  if (index >= (int)uf->gi.number_entry) return ZR_ARGS;
-  if (index < (int)uf->num_file) unzGoToFirstFile(uf);
-
-  while ((int)uf->num_file < index) unzGoToNextFile(uf);
-
   ZIPENTRY ze;
   ZRESULT grc{Get(index, &ze)};
   if (grc != ZR_OK) return grc;
 
+  if (uf->streaming && uf->stream_state != STREAM_FRESH) return ZR_SEEK;
+
     // zipentry=directory is handled specially
 #ifdef ZIP_STD
   const bool isdir{S_ISDIR(ze.attr)};
@@ -4108,15 +5089,25 @@ ZRESULT TUnzip::Unzip(int index, void *dst, unsigned int len, ZipMode flags) {
       fn[std::size(fn) - 1] = 0;
     }
 
-    const ZRESULT rc{EnsureDirectory(isabsolute ? nullptr : rootdir, dir)};
+    ZRESULT rc{EnsureDirectory(isabsolute ? nullptr : rootdir, dir)};
     if (rc != ZR_OK) return rc;
 
+    // Second attempt is for the case where someone removed a directory we
+    // had remembered as ensured: forget them all and create them again.
+    for (int attempt{0}; attempt < 2; ++attempt) {
 #ifdef ZIP_STD
-    h = fopen(fn, "wb");
+      h = fopen(fn, "wb");
 #else
-    h = CreateFile(fn, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
-                   ze.attr | FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+      h = CreateFile(fn, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                     ze.attr | FILE_FLAG_BACKUP_SEMANTICS, nullptr);
 #endif
+      if (h != INVALID_HANDLE_VALUE || attempt != 0) break;
+
+      ensureddirs.Clear();
+
+      rc = EnsureDirectory(isabsolute ? nullptr : rootdir, dir);
+      if (rc != ZR_OK) return rc;
+    }
   }
 
   if (h == INVALID_HANDLE_VALUE) return ZR_NOFILE;
@@ -4125,7 +5116,7 @@ ZRESULT TUnzip::Unzip(int index, void *dst, unsigned int len, ZipMode flags) {
 
   ZRESULT haderr{ZR_OK};
   if (!unzbuf) {
-    unzbuf = new (std::nothrow) char[16384];
+    unzbuf = static_cast<char *>(zaalloc(alloc, 16384));
     haderr = unzbuf != nullptr ? ZR_OK : ZR_NOALLOC;
   }
 
@@ -4208,7 +5199,194 @@ ZRESULT TUnzip::Unzip(int index, void *dst, unsigned int len, ZipMode flags) {
   return haderr;
 }
 
+ZRESULT TUnzip::OpenItem(int index, TUnzipItem **item) {
+  ZTRACE_SCOPE("open_item");
+
+  // a streamed zip only ever has the one place to read from
+  if (uf->streaming) return ZR_SEEK;
+
+  const ZRESULT rc{GoTo(index)};
+  if (rc != ZR_OK) return rc;
+
+  auto *it = zanew<TUnzipItem>(alloc);
+  if (!it) return ZR_NOALLOC;
+
+  it->flag = 3;
+  it->unz = this;
+
+  const int res{unzlocal_OpenFileInfo(uf, &it->info, password)};
+  if (res != UNZ_OK) {
+    unzlocal_FreeFileInfo(uf, &it->info);
+    zadelete(alloc, it);
+
+    return res == UNZ_INTERNALERROR ? ZR_NOALLOC : ZR_CORRUPT;
+  }
+
+  it->next = items;
+  if (items) items->prev = it;
+  items = it;
+
+  *item = it;
+
+  return ZR_OK;
+}
+
+// Opens an item to be read as it lies in the zip, with nothing inflated,
+// decrypted or checked; only where it starts and how long it is are needed.
+ZRESULT TUnzip::OpenItemRaw(int index, ZIPRAWITEM *raw, TUnzipItem **item) {
+  ZTRACE_SCOPE("open_item_raw");
+
+  if (uf->streaming) return ZR_SEEK;
+
+  const ZRESULT rc{GoTo(index)};
+  if (rc != ZR_OK) return rc;
+
+  unz_file_info ufi;
+  memset(raw, 0, sizeof(*raw));
+  unzGetCurrentFileInfo(uf, &ufi, raw->name, std::size(raw->name), nullptr, 0,
+                        nullptr, 0);
+
+  unsigned int iSizeVar;
+  unsigned long offset;
+  unsigned int extralen;
+  if (unzlocal_CheckCurrentFileCoherencyHeader(uf, &iSizeVar, &offset,
+                                               &extralen) != UNZ_OK)
+    return ZR_CORRUPT;
+
+  const unsigned int cextralen{static_cast<unsigned int>(ufi.size_file_extra)};
+
+  auto *it = zanew<TUnzipItem>(alloc);
+  if (!it) return ZR_NOALLOC;
+
+  if (extralen + cextralen != 0) {
+    it->extra =
+        static_cast<unsigned char *>(zaalloc(alloc, extralen + cextralen));
+    if (!it->extra) {
+      zadelete(alloc, it);
+      return ZR_NOALLOC;
+    }
+  }
+
+  ZRESULT res{ZR_OK};
+  if (lufseek(uf->file, offset + uf->byte_before_the_zipfile, SEEK_SET) != 0 ||
+      (extralen != 0 &&
+       lufread(it->extra, 1, extralen, uf->file) != extralen)) {
+    res = ZR_READ;
+  } else if (unzGetCurrentFileInfo(uf, nullptr, nullptr, 0,
+                                   it->extra + extralen, cextralen, nullptr,
+                                   0) != UNZ_OK) {
+    res = ZR_CORRUPT;
+  }
+
+  if (res != ZR_OK) {
+    zafree(alloc, it->extra);
+    zadelete(alloc, it);
+    return res;
+  }
+
+  it->flag = 3;
+  it->unz = this;
+  it->raw = true;
+  ZSTAT_ADD(stats.items, 1);
+  it->info.file = uf->file;
+  it->info.byte_before_the_zipfile = uf->byte_before_the_zipfile;
+  it->info.pos_in_zipfile =
+      uf->cur_file_info_internal.offset_curfile + SIZEZIPLOCALHEADER + iSizeVar;
+  it->info.rest_read_compressed = ufi.compressed_size;
+
+  raw->version = static_cast<unsigned short>(ufi.version);
+  raw->version_needed = static_cast<unsigned short>(ufi.version_needed);
+  raw->flag = static_cast<unsigned short>(ufi.flag);
+  raw->method = static_cast<unsigned short>(ufi.compression_method);
+  raw->dos_time = ufi.dosDate;
+  raw->crc = ufi.crc;
+  raw->comp_size = ufi.compressed_size;
+  raw->unc_size = ufi.uncompressed_size;
+  raw->internal_attr = static_cast<unsigned short>(ufi.internal_fa);
+  raw->external_attr = ufi.external_fa;
+  raw->extra = extralen ? it->extra : nullptr;
+  raw->extra_len = extralen;
+  raw->cextra = cextralen ? it->extra + extralen : nullptr;
+  raw->cextra_len = cextralen;
+
+  it->next = items;
+  if (items) items->prev = it;
+  items = it;
+
+  *item = it;
+
+  return ZR_OK;
+}
+
+ZRESULT TUnzip::ReadItem(TUnzipItem *item, void *buf, unsigned int len,
+                         unsigned int *read) {
+  ZTRACE_SCOPE("read_item");
+
+  *read = 0;
+
+  if (item->eof) return ZR_OK;
+  if (len == 0) return ZR_MORE;
+
+  if (item->raw) {
+    file_in_zip_read_info_s &info{item->info};
+
+    if (len > info.rest_read_compressed)
+      len = static_cast<unsigned int>(info.rest_read_compressed);
+
+    if (len != 0 &&
+        (lufseek(info.file, info.pos_in_zipfile + info.byte_before_the_zipfile,
+                 SEEK_SET) != 0 ||
+         lufread(buf, 1, len, info.file) != len))
+      return ZR_READ;
+
+    info.pos_in_zipfile += len;
+    info.rest_read_compressed -= len;
+    *read = len;
+
+    if (info.rest_read_compressed != 0) return ZR_MORE;
+
+    item->eof = true;
+    return ZR_OK;
+  }
+
+  bool reached_eof;
+  const int res{unzlocal_ReadFileInfo(uf, &item->info, buf, len, &reached_eof)};
+  if (res == UNZ_PASSWORD) return ZR_PASSWORD;
+  if (res == UNZ_ERRNO) return ZR_READ;
+  if (res < 0) return ZR_FLATE;
+
+  *read = static_cast<unsigned int>(res);
+
+  // nb. an empty item reads nothing, and never gets as far as saying so
+  if (!reached_eof && item->info.rest_read_uncompressed != 0) {
+    return res > 0 ? ZR_MORE : ZR_FLATE;
+  }
+
+  item->eof = true;
+
+  return item->info.crc32 == item->info.crc32_wait ? ZR_OK : ZR_CORRUPT;
+}
+
+ZRESULT TUnzip::CloseItem(TUnzipItem *item) {
+  if (item->prev)
+    item->prev->next = item->next;
+  else
+    items = item->next;
+
+  if (item->next) item->next->prev = item->prev;
+
+  unzlocal_FreeFileInfo(uf, &item->info);
+  zafree(alloc, item->extra);
+  zadelete(alloc, item);
+
+  return ZR_OK;
+}
+
 ZRESULT TUnzip::Close() {
+  ZTRACE_SCOPE("unzip_close");
+
+  while (items) CloseItem(items);
+
   if (currentfile != -1) {
     unzCloseCurrentFile(uf);
     currentfile = -1;
@@ -4230,8 +5408,16 @@ struct TUnzipHandleData {
 };
 
 HZIP OpenZipInternal(void *z, unsigned int len, ZipMode flags,
-                     const char *password) {
-  auto *unz = new (std::nothrow) TUnzip(password);
+                     const char *password, const ZALLOCATOR *allocator) {
+  if (allocator &&
+      (allocator->allocate == nullptr || allocator->deallocate == nullptr)) {
+    lasterrorU = ZR_ARGS;
+    return nullptr;
+  }
+
+  const ZALLOCATOR &alloc{allocator ? *allocator : default_allocator};
+
+  auto *unz = zanew<TUnzip>(alloc, password, alloc);
   if (!unz) {
     lasterrorU = ZR_NOALLOC;
     return nullptr;
@@ -4239,21 +5425,22 @@ HZIP OpenZipInternal(void *z, unsigned int len, ZipMode flags,
 
   ZRESULT rc{unz->oerr};
   if (rc != ZR_OK) {
-    delete unz;
+    zadelete(alloc, unz);
     lasterrorU = rc;
     return nullptr;
   }
 
   rc = unz->Open(z, len, flags);
   if (rc != ZR_OK) {
-    delete unz;
+    zadelete(alloc, unz);
     lasterrorU = rc;
     return nullptr;
   }
 
-  auto *han = new (std::nothrow) TUnzipHandleData;
+  auto *han = zanew<TUnzipHandleData>(alloc);
   if (!han) {
-    delete unz;
+    unz->Close();
+    zadelete(alloc, unz);
     lasterrorU = ZR_NOALLOC;
     return nullptr;
   }
@@ -4376,14 +5563,22 @@ size_t FormatZipMessageU(ZRESULT code, TCHAR *buf, size_t len) {
   return mlen;
 }
 
-HZIP OpenZipHandle(HANDLE h, const char *password) {
-  return OpenZipInternal(h, 0, ZIP_HANDLE, password);
+HZIP OpenZipHandle(HANDLE h, const char *password,
+                   const ZALLOCATOR *allocator) {
+  return OpenZipInternal(h, 0, ZIP_HANDLE, password, allocator);
+}
+HZIP OpenZip(const TCHAR *fn, const char *password,
+             const ZALLOCATOR *allocator) {
+  return OpenZipInternal((void *)fn, 0, ZIP_FILENAME, password, allocator);
 }
-HZIP OpenZip(const TCHAR *fn, const char *password) {
-  return OpenZipInternal((void *)fn, 0, ZIP_FILENAME, password);
+HZIP OpenZip(void *z, unsigned int len, const char *password,
+             const ZALLOCATOR *allocator) {
+  return OpenZipInternal(z, len, ZIP_MEMORY, password, allocator);
 }
-HZIP OpenZip(void *z, unsigned int len, const char *password) {
-  return OpenZipInternal(z, len, ZIP_MEMORY, password);
+HZIP OpenZipReader(const ZREADER *reader, const char *password,
+                   const ZALLOCATOR *allocator) {
+  return OpenZipInternal(const_cast<ZREADER *>(reader), 0, ZIP_READER,
+                         password, allocator);
 }
 
 ZRESULT GetZipItem(HZIP hz, int index, ZIPENTRY *ze) {
@@ -4427,6 +5622,67 @@ ZRESULT UnzipItem(HZIP hz, int index, void *z, unsigned int len) {
   return UnzipItemInternal(hz, index, z, len, ZIP_MEMORY);
 }
 
+ZRESULT OpenZipItem(HZIP hz, int index, HZIPITEM *item) {
+  if (item != nullptr) *item = nullptr;
+
+  if (hz == nullptr || item == nullptr) return (lasterrorU = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TUnzipHandleData *>(hz);
+  if (han->flag != 1) return (lasterrorU = ZR_ZMODE);
+
+  TUnzip *unz{han->unz};
+  TUnzipItem *it{nullptr};
+  const ZRESULT rc{unz->OpenItem(index, &it)};
+
+  if (rc == ZR_OK) *item = reinterpret_cast<HZIPITEM>(it);
+
+  return (lasterrorU = rc);
+}
+
+ZRESULT OpenZipItemRaw(HZIP hz, int index, ZIPRAWITEM *raw, HZIPITEM *item) {
+  if (item != nullptr) *item = nullptr;
+
+  if (hz == nullptr || raw == nullptr || item == nullptr)
+    return (lasterrorU = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TUnzipHandleData *>(hz);
+  if (han->flag != 1) return (lasterrorU = ZR_ZMODE);
+
+  TUnzip *unz{han->unz};
+  TUnzipItem *it{nullptr};
+  const ZRESULT rc{unz->OpenItemRaw(index, raw, &it)};
+
+  if (rc == ZR_OK) *item = reinterpret_cast<HZIPITEM>(it);
+
+  return (lasterrorU = rc);
+}
+
+ZRESULT ReadZipItem(HZIPITEM item, void *buf, unsigned int len,
+                    unsigned int *read) {
+  if (read != nullptr) *read = 0;
+
+  if (item == nullptr || buf == nullptr || read == nullptr)
+    return (lasterrorU = ZR_ARGS);
+
+  auto *it = reinterpret_cast<TUnzipItem *>(item);
+  if (it->flag != 3) return (lasterrorU = ZR_ZMODE);
+
+  const ZRESULT rc{it->unz->ReadItem(it, buf, len, read)};
+
+  return (lasterrorU = rc);
+}
+
+ZRESULT CloseZipItem(HZIPITEM item) {
+  if (item == nullptr) return (lasterrorU = ZR_ARGS);
+
+  auto *it = reinterpret_cast<TUnzipItem *>(item);
+  if (it->flag != 3) return (lasterrorU = ZR_ZMODE);
+
+  const ZRESULT rc{it->unz->CloseItem(it)};
+
+  return (lasterrorU = rc);
+}
+
 ZRESULT SetUnzipBaseDir(HZIP hz, const TCHAR *dir) {
   if (hz == nullptr) return (lasterrorU = ZR_ARGS);
 
@@ -4439,6 +5695,21 @@ ZRESULT SetUnzipBaseDir(HZIP hz, const TCHAR *dir) {
   return (lasterrorU = rc);
 }
 
+ZRESULT UnzipGetStats(HZIP hz, UNZIPSTATS *stats) {
+  if (hz == nullptr || stats == nullptr) return (lasterrorU = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TUnzipHandleData *>(hz);
+  if (han->flag != 1) return (lasterrorU = ZR_ZMODE);
+
+#ifdef ZU_STATS
+  *stats = han->unz->stats;
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+
+  return (lasterrorU = ZR_OK);
+}
+
 ZRESULT CloseZipU(HZIP hz) {
   if (hz == nullptr) return (lasterrorU = ZR_ARGS);
 
@@ -4448,8 +5719,11 @@ ZRESULT CloseZipU(HZIP hz) {
   TUnzip *unz{han->unz};
   const ZRESULT rc{unz->Close()};
 
-  delete unz;
-  delete han;
+  // copy, since the allocator lives inside the unzip we're about to free
+  const ZALLOCATOR alloc{unz->ualloc};
+
+  zadelete(alloc, unz);
+  zadelete(alloc, han);
 
   return (lasterrorU = rc);
 }
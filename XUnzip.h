@@ -118,6 +118,7 @@ struct ZIP_FILETIME {
 
 #include <cstddef>  // size_t
 
+#include "XZalloc.h"
 #include "XZresult.h"
 
 #if defined(_MSC_VER)
@@ -180,6 +181,22 @@ struct ZIPENTRY {
   long unc_size;   // may be -1 if not yet known (e.g. being streamed in)
 };
 
+// ZREADER - lets OpenZipReader read a zip from anywhere that can fetch a byte
+// range: a blob store, a cache, a file you already have mapped.
+//
+// read_at copies up to len bytes starting at offset into buf and returns how
+// many it copied, 0 at the end, or -1 on error.  It may return fewer than asked
+// for; it is simply called again for the rest.  size returns the total length.
+// Reads always say where they are from, so nothing relies on a current
+// position.  The structure is copied, but opaque must stay valid until
+// CloseZip.
+struct ZREADER {
+  long (*read_at)(void *opaque, unsigned long offset, void *buf,
+                  unsigned int len);
+  unsigned long (*size)(void *opaque);
+  void *opaque;
+};
+
 // OpenZip - opens a zip file and returns a handle with which you can
 // subsequently examine its contents.
 //
@@ -188,23 +205,34 @@ struct ZIPENTRY {
 // from a file (by handle): OpenZipHandle(hfile,0);
 // from a file (by name):   OpenZip("c:\\test.zip","password");
 // from a memory block:     OpenZip(bufstart, buflen,0);
+// from anything else:      OpenZipReader(&reader,0);
 //
 // If the file is opened through a pipe, then items may only be accessed in
 // increasing order, and an item may only be unzipped once, although GetZipItem
 // can be called immediately before and after unzipping it.  If it's opened in
-// any other way, then full random access is possible.
+// any other way, then full random access is possible.  Going back to an
+// earlier item, or unzipping one a second time, fails with ZR_SEEK.  Skipping
+// over items you don't unzip is fine; the ones whose size isn't known ahead
+// are inflated along the way to find their end.  Either way only the inflate
+// window and a read buffer are kept in memory.
 //
-// NOTE: pipe input is not yet implemented.
 // NOTE: zip passwords are ascii, not unicode.
 // NOTE: for windows-ce, you cannot close the handle until after CloseZip.  But
 // for real windows, the zip makes its own copy of your handle, so you can close
 // yours anytime.
-ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZip(const TCHAR *fn,
-                                                     const char *password);
-ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZip(void *z, unsigned int len,
-                                                     const char *password);
+//
+// allocator, if given, supplies all the memory the unzip uses; see XZalloc.h.
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZip(
+    const TCHAR *fn, const char *password,
+    const ZALLOCATOR *allocator = nullptr);
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZip(
+    void *z, unsigned int len, const char *password,
+    const ZALLOCATOR *allocator = nullptr);
 ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZipHandle(
-    HANDLE h, const char *password);
+    HANDLE h, const char *password, const ZALLOCATOR *allocator = nullptr);
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZipReader(
+    const ZREADER *reader, const char *password,
+    const ZALLOCATOR *allocator = nullptr);
 
 // GetZipItem - call this to get information about an item in the zip.
 //
@@ -220,7 +248,9 @@ ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZipHandle(
 // until eventually the call fails.  Also, in the event that you are opening
 // through a pipe and the zip was itself created into a pipe, then then
 // comp_size and sometimes unc_size as well may not be known until after the
-// item has been unzipped.
+// item has been unzipped: they're -1 until then.  The attributes of items read
+// through a pipe are only a guess (a plain file, or a directory if the name
+// ends in a slash), since the real ones are kept at the end of the zip.
 ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT GetZipItem(HZIP hz, int index,
                                                            ZIPENTRY *ze);
 
@@ -262,11 +292,105 @@ ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT UnzipItemHandle(HZIP hz,
                                                                 int index,
                                                                 HANDLE h);
 
+using HZIPITEM__ = struct HZIPITEM__;
+/**
+ * @brief An HZIPITEM identifies an item of an open zip being read.
+ */
+using HZIPITEM = struct HZIPITEM__ *;
+
+// OpenZipItem - opens an item for reading a piece at a time.
+//
+// Unlike UnzipItem to a memory block, each HZIPITEM keeps its own place in the
+// item and its own decompression state, so several can be open at once on the
+// same zip and read in any order, interleaved with each other and with
+// GetZipItem/UnzipItem, without starting again from the beginning.
+//
+// ReadZipItem fills buf with up to len bytes and sets *read to how many it
+// got.  It returns ZR_MORE while there's more to come, and ZR_OK once the item
+// is finished (ZR_CORRUPT if its crc turned out wrong).  Reading after that
+// gets 0 bytes and ZR_OK.
+//
+// Every item must be closed with CloseZipItem.  CloseZip closes any which are
+// still open, after which their HZIPITEMs mustn't be used.
+//
+// NOTE: not possible for a zip opened through a pipe (ZR_SEEK), which can only
+// be read in order; use UnzipItem there.
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT OpenZipItem(HZIP hz, int index,
+                                                            HZIPITEM *item);
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ReadZipItem(HZIPITEM item,
+                                                            void *buf,
+                                                            unsigned int len,
+                                                            unsigned int *read);
+ZU_UNZIP_ATTRIBUTE_SHARED ZRESULT CloseZipItem(HZIPITEM item);
+
+// ZIPRAWITEM - an item as it is stored, from its local and central headers.
+struct ZIPRAWITEM {
+  char name[MAX_PATH];            // as stored, not converted to TCHAR
+  unsigned short version;         // version made by
+  unsigned short version_needed;  // version needed to extract
+  unsigned short flag;            // general purpose flags; 1 means encrypted
+  unsigned short method;          // 0 stored, 8 deflated
+  unsigned long dos_time;         // dos date in the high word, time in the low
+  unsigned long crc;
+  unsigned long comp_size;  // as stored, so with any encryption header
+  unsigned long unc_size;
+  unsigned short internal_attr;
+  unsigned long external_attr;
+  const unsigned char *extra;  // the local header's extra field
+  unsigned int extra_len;
+  const unsigned char *cextra;  // the central directory's extra field
+  unsigned int cextra_len;
+};
+
+// OpenZipItemRaw - opens an item for reading the bytes stored for it, still
+// compressed and (with their 12 byte header) still encrypted.
+//
+// ReadZipItem then gives exactly raw->comp_size bytes, returning ZR_OK with the
+// last of them, and CloseZipItem closes it as usual.  Nothing is checked or
+// decrypted, so no password is needed.  raw->extra and raw->cextra point into
+// the item and stay valid until it's closed.  ZipAddRawFromZip uses this to
+// copy items between zips without inflating and deflating them again.
+//
+// NOTE: like OpenZipItem, not possible for a zip opened through a pipe.
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT OpenZipItemRaw(HZIP hz,
+                                                               int index,
+                                                               ZIPRAWITEM *raw,
+                                                               HZIPITEM *item);
+
 // If unzipping to a filename, and it's a relative filename, then it will be
 // relative to here.  (defaults to current-directory).
 ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT SetUnzipBaseDir(
     HZIP hz, const TCHAR *dir);
 
+// UNZIPSTATS - what an unzip handle has done so far, from UnzipGetStats.
+//
+// Counts run from OpenZip and are never reset.  Times are in nanoseconds of
+// wall clock, and each leaves out the others: inflate_ns is decompressing
+// only, not reading the compressed data or checking the CRC.
+struct UNZIPSTATS {
+  unsigned long long items;      // entries opened to read, raw included
+  unsigned long long bytes_in;   // bytes read from the zip, headers included
+  unsigned long long bytes_out;  // uncompressed bytes produced
+  unsigned long long reads;      // reads from the file, handle or ZREADER
+  unsigned long long seeks;      // moves to somewhere else in the zip
+  // Deflate blocks by type, as inflate met them.
+  unsigned long long blocks_stored;
+  unsigned long long blocks_fixed;
+  unsigned long long blocks_dynamic;
+  unsigned long long inflate_ns;
+  unsigned long long crc_ns;
+  unsigned long long read_ns;
+  unsigned long long allocations;  // calls to the allocator, handle excluded
+  unsigned long long allocated;    // bytes they asked for
+};
+
+// UnzipGetStats - fills stats in with what the zip has done so far.
+//
+// Cheap enough to call between items.  If the library was built without
+// ZU_ENABLE_STATS every count is 0.
+ZU_UNZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT UnzipGetStats(
+    HZIP hz, UNZIPSTATS *stats);
+
 // Now we indulge in a little skullduggery so that the code works whether the
 // user has included just zip or both zip and unzip.
 //
@@ -0,0 +1,26 @@
+// Memory allocator hook shared by the zip and unzip functions.
+
+#ifndef ZIP_UTILS_XZALLOC_H_
+#define ZIP_UTILS_XZALLOC_H_
+
+#include <cstddef>  // size_t
+
+// ZALLOCATOR - lets the caller supply the memory used by a zip handle.
+//
+// Pass one to CreateZip/OpenZip and every allocation made on behalf of that
+// handle (the handle itself, compression and decompression state, buffers,
+// per-entry bookkeeping) goes through allocate/deallocate with the given
+// opaque pointer.  The structure is copied, so it needn't outlive the call,
+// but opaque must stay valid until the handle is closed.
+//
+// allocate must return memory aligned as malloc does, or nullptr on failure,
+// which is reported as ZR_NOALLOC.  deallocate is never called with nullptr.
+//
+// Passing nullptr instead of an allocator uses malloc and free.
+struct ZALLOCATOR {
+  void *(*allocate)(void *opaque, size_t size);
+  void (*deallocate)(void *opaque, void *ptr);
+  void *opaque;
+};
+
+#endif  // ZIP_UTILS_XZALLOC_H_
@@ -60,11 +60,23 @@
 #ifdef ZIP_STD
 #include "XZip.h"
 //
+#include "XUnzip.h"  // OpenZipItemRaw, for ZipAddRawFromZip
+#ifdef ZU_TRACE
+#include "XZtrace.h"
+#endif
+//
 #include <memory.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#if !defined(_MSC_VER) && !defined(__BORLANDC__) && !defined(__MINGW32__)
+#include <sys/mman.h>  // mmap
+#include <unistd.h>    // pwrite, ftruncate, fsync
+#else
+#include <io.h>  // _chsize_s, _commit
+#endif
 
 #include <cctype>
+#include <cerrno>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
@@ -92,6 +104,11 @@ typedef unsigned short WORD;
 #else
 #include "XZip.h"
 //
+#include "XUnzip.h"  // OpenZipItemRaw, for ZipAddRawFromZip
+#ifdef ZU_TRACE
+#include "XZtrace.h"
+#endif
+//
 #include <tchar.h>
 #include <windows.h>
 
@@ -100,7 +117,14 @@ typedef unsigned short WORD;
 #include <string_view>
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
 #include <new>
+#include <thread>
+#include <utility>
 
 typedef unsigned char uch;   // unsigned 8-bit value
 typedef unsigned short ush;  // unsigned 16-bit value
@@ -207,11 +231,25 @@ typedef unsigned IPos;  // A Pos is an index in the character window. Pos is
 // distances are limited to MAX_DIST instead of WSIZE.
 //
 
+#define WINDOW_SIZE (32 * WSIZE)
+// Size of the input buffer, 1M. Matches still only reach back WSIZE, but the
+// buffer slides down by WSLIDE at a time, keeping the last WSIZE bytes as
+// history, so the window is copied and head[] and prev[] rebased once a
+// megabyte rather than every 32K, and input is read in bigger pieces.
+//
+
+#define WSLIDE (WINDOW_SIZE - WSIZE)
+// How far the window slides. A multiple of WSIZE, so that prev[] indices
+// (positions & WMASK) are unchanged by sliding.
+//
+
 enum ZipMode {
   ZIP_HANDLE = 1,
   ZIP_FILENAME = 2,
   ZIP_MEMORY = 3,
-  ZIP_FOLDER = 4
+  ZIP_FOLDER = 4,
+  ZIP_PUSH = 5,
+  ZIP_APPEND = 6
 };
 
 // ===========================================================================
@@ -286,9 +324,22 @@ enum ZipMode {
 // Local data used by the "bit string" routines.
 //
 
-#define Buf_size (8 * 2 * sizeof(char))
-// Number of bits used within bi_buf. (bi_buf may be implemented on
-// more than 16 bits on some systems.)
+#define Buf_size (8 * sizeof(unsigned long long))
+// Number of bits used within bi_buf.
+
+// Output the whole of bi_buf, lower (oldest) byte first
+#define PUTBIBUF(state)                                                        \
+  {                                                                            \
+    if (state.bs.out_offset >= state.bs.out_size - 7)                          \
+      state.flush_outbuf(state.param, state.bs.out_buf, &state.bs.out_offset); \
+    char *out = state.bs.out_buf + state.bs.out_offset;                        \
+    const unsigned long long b = state.bs.bi_buf;                              \
+    out[0] = (char)b, out[1] = (char)(b >> 8);                                 \
+    out[2] = (char)(b >> 16), out[3] = (char)(b >> 24);                        \
+    out[4] = (char)(b >> 32), out[5] = (char)(b >> 40);                        \
+    out[6] = (char)(b >> 48), out[7] = (char)(b >> 56);                        \
+    state.bs.out_offset += 8;                                                  \
+  }
 
 // Output a 16 bit value to the bit stream, lower (oldest) byte first
 #define PUTSHORT(state, w)                                                     \
@@ -316,6 +367,10 @@ enum ZipMode {
 #define WMASK (WSIZE - 1)
 // HASH_SIZE and WSIZE must be powers of two
 
+#define LAZY_CLEAR_MAX (WSIZE / 16)
+// Files shorter than this have their own hash heads cleared after them, not
+// the whole table (see lm_init)
+
 #define NIL 0
 // Tail of hash chains
 
@@ -338,11 +393,6 @@ enum ZipMode {
 // byte no longer takes part in the hash key, that is:
 //   H_SHIFT * MIN_MATCH >= HASH_BITS
 
-#define max_insert_length max_lazy_match
-// Insert new strings in the hash table only if the match length
-// is not greater than this length. This saves time but degrades compression.
-// max_insert_length is used only for compression levels <= 3.
-
 namespace {
 
 constexpr int extra_lbits[LENGTH_CODES]  // extra bits for each length code
@@ -368,7 +418,7 @@ typedef struct config {
   ush max_chain;
 } config;
 
-// Values for max_lazy_match, good_match, nice_match and max_chain_length,
+// Values for the lazy, good and nice match lengths and the chain length,
 // depending on the desired pack level (0..9). The values given below have
 // been tuned to exclude worst case performance for pathological files.
 // Better values may be found for specific files.
@@ -377,7 +427,7 @@ typedef struct config {
 constexpr config configuration_table[10] = {
     //  good lazy nice chain
     {0, 0, 0, 0},           // 0 store only
-    {4, 4, 8, 4},           // 1 maximum speed, no lazy matches
+    {4, 4, 8, 4},           // 1 maximum speed (deflate_fastest ignores these)
     {4, 5, 16, 8},          // 2
     {4, 6, 32, 32},         // 3
     {4, 4, 16, 16},         // 4 lazy matches */
@@ -390,6 +440,8 @@ constexpr config configuration_table[10] = {
 // Note: the deflate() code requires max_lazy >= MIN_MATCH and max_chain >= 4
 // For deflate_fast() (levels <= 3) good is ignored and lazy has a different
 // meaning.
+// Each level has its own deflate_fast() or deflate_slow() and longest_match(),
+// with these values compiled in; deflate() picks one per file.
 
 // Data structure describing a single value and its code string.
 typedef struct ct_data {
@@ -403,6 +455,13 @@ typedef struct ct_data {
   } dl;
 } ct_data;
 
+// Code and extra bits of a match length or distance.
+typedef struct code_data {
+  uch code;   // length or distance code
+  uch extra;  // number of extra bits
+  ush base;   // first normalized length or distance with this code
+} code_data;
+
 typedef struct tree_desc {
   ct_data *dyn_tree;      // the dynamic tree
   ct_data *static_tree;   // corresponding static tree or nullptr
@@ -443,20 +502,16 @@ class TTreeState {
   uch depth[2 * L_CODES + 1];
   // Depth of each subtree used as tie breaker for trees of equal frequency
 
-  uch length_code[MAX_MATCH - MIN_MATCH + 1];
-  // length code for each normalized match length (0 == MIN_MATCH)
+  code_data length_code[MAX_MATCH - MIN_MATCH + 1];
+  // length code, its extra bits and first normalized length (0 ==
+  // MIN_MATCH) for each normalized match length
 
-  uch dist_code[512];
-  // distance codes. The first 256 values correspond to the distances
+  code_data dist_code[512];
+  // distance codes, their extra bits and first normalized distance (0 =
+  // distance of 1). The first 256 values correspond to the distances
   // 3 .. 258, the last 256 values correspond to the top 8 bits of
   // the 15 bit distances.
 
-  int base_length[LENGTH_CODES];
-  // First normalized length for each code (0 = MIN_MATCH)
-
-  int base_dist[D_CODES];
-  // First normalized distance for each code (0 = distance of 1)
-
   uch l_buf[LIT_BUFSIZE];   // buffer for literals/lengths
   ush d_buf[DIST_BUFSIZE];  // buffer for distances
 
@@ -505,9 +560,9 @@ class TBitState {
  public:
   int flush_flg;
   //
-  unsigned bi_buf;
+  unsigned long long bi_buf;
   // Output buffer. bits are inserted starting at the bottom (least significant
-  // bits). The width of bi_buf must be at least 16 bits.
+  // bits), and written out 8 bytes at a time as it fills.
   int bi_valid;
   // Number of valid bits in bi_buf.  All bits above the last valid bit
   // are always zero.
@@ -530,15 +585,11 @@ class TDeflateState {
     window_size = 0;
   }
 
-  uch window[2L * WSIZE];
-  // Sliding window. Input bytes are read into the second half of the window,
-  // and move to the first half later to keep a dictionary of at least WSIZE
-  // bytes. With this organization, matches are limited to a distance of
-  // WSIZE-MAX_MATCH bytes, but this ensures that IO is always
-  // performed with a length multiple of the block size. Also, it limits
-  // the window size to 64K, which is quite useful on MSDOS.
-  // To do: limit the window size to WSIZE+CBSZ if SMALL_MEM (the code would
-  // be less efficient since the data would have to be copied WSIZE/CBSZ times)
+  uch window[WINDOW_SIZE];
+  // Sliding window. Input bytes are read in after the history, and the last
+  // WSIZE bytes move to the start of the window when it fills, to keep a
+  // dictionary of at least WSIZE bytes. With this organization, matches are
+  // limited to a distance of WSIZE-MAX_MATCH bytes.
   Pos prev[WSIZE];
   // Link to older string with same hash index. To limit the size of this
   // array to 64K, this link is maintained only for the last 32K strings.
@@ -548,7 +599,7 @@ class TDeflateState {
   // HASH_SIZE is a dynamic value, recompile with -DDYN_ALLOC.
 
   ulg window_size;
-  // window size, 2*WSIZE except for MMAP or BIG_MEM, where it is the
+  // window size, WINDOW_SIZE except for MMAP or BIG_MEM, where it is the
   // input file length plus MIN_LOOKAHEAD.
 
   long block_start;
@@ -558,6 +609,14 @@ class TDeflateState {
   int sliding;
   // Set to false when the input file is already in memory
 
+  int slid;
+  // Set once the window has slid during the current file, after which any
+  // head[] entry may be in use.
+
+  int fastest;
+  // Set when head[] was filled by deflate_fastest(), keyed by hash4() rather
+  // than ins_h.
+
   unsigned ins_h;  // hash index of string to be inserted
 
   unsigned prev_length;
@@ -569,19 +628,15 @@ class TDeflateState {
   int eofile;            // flag set at end of input file
   unsigned lookahead;    // number of valid bytes ahead in window
 
-  unsigned max_chain_length;
-  // To speed up deflation, hash chains are never searched beyond this length.
-  // A higher limit improves compression ratio but degrades the speed.
-
-  unsigned max_lazy_match;
-  // Attempt to find a better match only when the current match is strictly
-  // smaller than this value. This mechanism is used only for compression
-  // levels >= 4.
-
-  unsigned good_match;
-  // Use a faster search when the previous match is longer than this
+  int pushing;
+  // Set while input is pushed in by ZipEntryWrite rather than pulled through
+  // readfunc: running out of input then means "wait for more", not eof.
 
-  int nice_match;  // Stop searching when current match exceeds this
+  IPos hash_head;
+  unsigned match_length;
+  int match_available;
+  // Loop state of deflate()/deflate_fast(), kept here while a pushed entry
+  // waits for its next piece of input.
 };
 
 typedef long lutime_t;  // define it ourselves since we don't include time.h
@@ -609,6 +664,78 @@ typedef struct zlist {
   struct zlist *nxt;     // Pointer to next header in list
 } TZipFileInfo;
 
+// Counting for ZipGetStats.  Without ZU_STATS it all compiles away: the
+// macros expand to nothing and neither TState nor TZip keep any counts.
+#ifdef ZU_STATS
+// Adds the nanoseconds it lives for to ns (and to also, if given), less
+// whatever was added to *less meanwhile.
+class TStatTimer {
+ public:
+  explicit TStatTimer(unsigned long long &ns,
+                      unsigned long long *also = nullptr,
+                      const unsigned long long *less = nullptr) noexcept
+      : ns_{ns},
+        also_{also},
+        less_{less},
+        less0_{less ? *less : 0},
+        start_{std::chrono::steady_clock::now()} {}
+  ~TStatTimer() noexcept {
+    const auto took{std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_)};
+    const auto ns{static_cast<unsigned long long>(took.count())};
+
+    ns_ += ns - (less_ ? *less_ - less0_ : 0);
+    if (also_) *also_ += ns;
+  }
+
+  TStatTimer(const TStatTimer &) = delete;
+  TStatTimer &operator=(const TStatTimer &) = delete;
+
+ private:
+  unsigned long long &ns_;
+  unsigned long long *also_;
+  const unsigned long long *less_;
+  const unsigned long long less0_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+#define ZSTAT_ADD(count, n) ((count) += (n))
+#define ZSTAT_TIME(ns) const TStatTimer stattimer{ns}
+#define ZSTAT_TIME2(ns, also) const TStatTimer stattimer{ns, &(also)}
+#define ZSTAT_TIME_LESS(ns, less) \
+  const TStatTimer stattimer { ns, nullptr, &(less) }
+#else
+#define ZSTAT_ADD(count, n) ((void)0)
+#define ZSTAT_TIME(ns) ((void)0)
+#define ZSTAT_TIME2(ns, also) ((void)0)
+#define ZSTAT_TIME_LESS(ns, less) ((void)0)
+#endif
+
+// Scopes for the timeline of XZtrace.h, which without ZU_TRACE compile away.
+#ifdef ZU_TRACE
+// Reports the time it lives for to the trace sink, if there is one.
+class TTraceScope {
+ public:
+  explicit TTraceScope(const char *name) noexcept
+      : name_{ZipTraceEnabled() ? name : nullptr},
+        start_{name_ ? ZipTraceNow() : 0} {}
+  ~TTraceScope() noexcept {
+    if (name_) ZipTraceScope(name_, start_);
+  }
+
+  TTraceScope(const TTraceScope &) = delete;
+  TTraceScope &operator=(const TTraceScope &) = delete;
+
+ private:
+  const char *const name_;
+  const unsigned long long start_;
+};
+
+#define ZTRACE_SCOPE(name) const TTraceScope tracescope{name}
+#else
+#define ZTRACE_SCOPE(name) ((void)0)
+#endif
+
 struct TState;
 typedef unsigned (*READFUNC)(TState &state, char *buf, unsigned size);
 typedef unsigned (*FLUSHFUNC)(void *param, const char *buf, unsigned *size);
@@ -623,13 +750,27 @@ struct TState {
   TBitState bs;
   TDeflateState ds;
   const char *err;
+#ifdef ZU_STATS
+  ZIPSTATS *stats;  // the zip's, for flush_block to count blocks and symbols
+#endif
 };
 
 // ----------------------------------------------------------------------
 // some windows<->linux portability things
 #ifdef ZIP_STD
 void filetime2dosdatetime(const FILETIME ft, WORD *dosdate, WORD *dostime) {
-  struct tm *st = gmtime(&ft);
+  // gmtime's result is shared between threads, so each zip needs its own
+  struct tm stbuf;
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+  struct tm *st = gmtime_s(&stbuf, &ft) == 0 ? &stbuf : nullptr;
+#else
+  struct tm *st = gmtime_r(&ft, &stbuf);
+#endif
+  if (!st) {
+    *dosdate = *dostime = 0;
+    return;
+  }
+
   *dosdate = (ush)(((st->tm_year + 1900 - 1980) & 0x7f) << 9);
   *dosdate |= (ush)((st->tm_mon & 0xf) << 5);
   *dosdate |= (ush)((st->tm_mday & 0x1f));
@@ -843,7 +984,7 @@ int build_bl_tree(TState &);
 void send_all_trees(TState &state, int lcodes, int dcodes, int blcodes);
 void compress_block(TState &state, ct_data *ltree, ct_data *dtree);
 void set_file_type(TState &);
-void send_bits(TState &state, int value, int length);
+void send_bits(TState &state, unsigned value, int length);
 unsigned bi_reverse(unsigned code, int len);
 void bi_windup(TState &state);
 void copy_block(TState &state, char *buf, unsigned len, int header);
@@ -860,8 +1001,9 @@ void copy_block(TState &state, char *buf, unsigned len, int header);
 #define d_code(dist)                       \
   ((dist) < 256 ? state.ts.dist_code[dist] \
                 : state.ts.dist_code[256 + ((dist) >> 7)])
-// Mapping from a distance to a distance code. dist is the distance - 1 and
-// must not have side effects. dist_code[256] and dist_code[257] are never used.
+// Mapping from a distance to a distance code and its extra bits. dist is the
+// distance - 1 and must not have side effects. dist_code[256] and
+// dist_code[257] are never used.
 
 #define Max(a, b) (a >= b ? a : b)
 /* the arguments must not have side effects */
@@ -883,14 +1025,20 @@ void ct_init(TState &state, ush *attr) {
   state.ts.cmpr_bytelen = state.ts.cmpr_len_bits = 0L;
   state.ts.input_len = 0L;
 
-  if (state.ts.static_dtree[0].dl.len != 0) return; /* ct_init already called */
+  /* The static trees and mapping tables are the same for every file, so
+   * only the first needs them built.
+   */
+  if (state.ts.static_dtree[0].dl.len != 0) {
+    init_block(state);
+    return;
+  }
 
   /* Initialize the mapping length (0..255) -> length code (0..28) */
   length = 0;
   for (code = 0; code < LENGTH_CODES - 1; code++) {
-    state.ts.base_length[code] = length;
+    const code_data c{(uch)code, (uch)extra_lbits[code], (ush)length};
     for (n = 0; n < (1 << extra_lbits[code]); n++) {
-      state.ts.length_code[length++] = (uch)code;
+      state.ts.length_code[length++] = c;
     }
   }
   Assert(state, length == 256, "ct_init: length != 256");
@@ -898,22 +1046,22 @@ void ct_init(TState &state, ush *attr) {
    * in two different ways: code 284 + 5 bits or code 285, so we
    * overwrite length_code[255] to use the best encoding:
    */
-  state.ts.length_code[length - 1] = (uch)code;
+  state.ts.length_code[length - 1] = {(uch)code, 0, (ush)(length - 1)};
 
   /* Initialize the mapping dist (0..32K) -> dist code (0..29) */
   dist = 0;
   for (code = 0; code < 16; code++) {
-    state.ts.base_dist[code] = dist;
+    const code_data c{(uch)code, (uch)extra_dbits[code], (ush)dist};
     for (n = 0; n < (1 << extra_dbits[code]); n++) {
-      state.ts.dist_code[dist++] = (uch)code;
+      state.ts.dist_code[dist++] = c;
     }
   }
   Assert(state, dist == 256, "ct_init: dist != 256");
   dist >>= 7; /* from now on, all distances are divided by 128 */
   for (; code < D_CODES; code++) {
-    state.ts.base_dist[code] = dist << 7;
+    const code_data c{(uch)code, (uch)extra_dbits[code], (ush)(dist << 7)};
     for (n = 0; n < (1 << (extra_dbits[code] - 7)); n++) {
-      state.ts.dist_code[256 + dist++] = (uch)code;
+      state.ts.dist_code[256 + dist++] = c;
     }
   }
   Assert(state, dist == 256, "ct_init: 256+dist != 512");
@@ -1398,6 +1546,8 @@ void send_all_trees(TState &state, int lcodes, int dcodes, int blcodes) {
  * returns the total compressed length (in bytes) for the file so far.
  */
 ulg flush_block(TState &state, char *buf, ulg stored_len, int eof) {
+  ZTRACE_SCOPE("flush_block");
+
   ulg opt_lenb, static_lenb; /* opt_len and static_len in bytes */
   int max_blindex; /* index of last bit length code of non zero freq */
 
@@ -1407,6 +1557,15 @@ ulg flush_block(TState &state, char *buf, ulg stored_len, int eof) {
   /* Check if the file is ascii or binary */
   if (*state.ts.file_type == (ush)UNKNOWN) set_file_type(state);
 
+#ifdef ZU_STATS
+  // build_tree turns the frequencies into codes, so count them first
+  for (int n{0}; n < LITERALS; n++)
+    state.stats->literals += state.ts.dyn_ltree[n].fc.freq;
+  for (int code{0}; code < LENGTH_CODES; code++)
+    state.stats->matches[code] +=
+        state.ts.dyn_ltree[LITERALS + 1 + code].fc.freq;
+#endif
+
   /* Construct the literal and distance trees */
   build_tree(state, (tree_desc *)(&state.ts.l_desc));
   Trace("\nlit data: dyn %ld, stat %ld", state.ts.opt_len, state.ts.static_len);
@@ -1463,6 +1622,7 @@ ulg flush_block(TState &state, char *buf, ulg stored_len, int eof) {
     state.ts.cmpr_len_bits = 0L;
 
     copy_block(state, buf, (unsigned)stored_len, 1); /* with header */
+    ZSTAT_ADD(state.stats->blocks_stored, 1);
   } else if (static_lenb == opt_lenb) {
     send_bits(state, (STATIC_TREES << 1) + eof, 3);
     compress_block(state, (ct_data *)state.ts.static_ltree,
@@ -1470,6 +1630,7 @@ ulg flush_block(TState &state, char *buf, ulg stored_len, int eof) {
     state.ts.cmpr_len_bits += 3 + state.ts.static_len;
     state.ts.cmpr_bytelen += state.ts.cmpr_len_bits >> 3;
     state.ts.cmpr_len_bits &= 7L;
+    ZSTAT_ADD(state.stats->blocks_static, 1);
   } else {
     send_bits(state, (DYN_TREES << 1) + eof, 3);
     send_all_trees(state, state.ts.l_desc.max_code + 1,
@@ -1479,6 +1640,7 @@ ulg flush_block(TState &state, char *buf, ulg stored_len, int eof) {
     state.ts.cmpr_len_bits += 3 + state.ts.opt_len;
     state.ts.cmpr_bytelen += state.ts.cmpr_len_bits >> 3;
     state.ts.cmpr_len_bits &= 7L;
+    ZSTAT_ADD(state.stats->blocks_dynamic, 1);
   }
   Assert(state,
          ((state.ts.cmpr_bytelen << 3) + state.ts.cmpr_len_bits) ==
@@ -1511,11 +1673,11 @@ int ct_tally(TState &state, int dist, int lc) {
     Assert(state,
            (ush)dist < (ush)MAX_DIST &&
                (ush)lc <= (ush)(MAX_MATCH - MIN_MATCH) &&
-               (ush)d_code(dist) < (ush)D_CODES,
+               (ush)d_code(dist).code < (ush)D_CODES,
            "ct_tally: bad match");
 
-    state.ts.dyn_ltree[state.ts.length_code[lc] + LITERALS + 1].fc.freq++;
-    state.ts.dyn_dtree[d_code(dist)].fc.freq++;
+    state.ts.dyn_ltree[state.ts.length_code[lc].code + LITERALS + 1].fc.freq++;
+    state.ts.dyn_dtree[d_code(dist).code].fc.freq++;
 
     state.ts.d_buf[state.ts.last_dist++] = (ush)dist;
     state.ts.flags |= state.ts.flag_bit;
@@ -1554,17 +1716,16 @@ int ct_tally(TState &state, int dist, int lc) {
 }
 
 /* ===========================================================================
- * Send the block data compressed using the given Huffman trees
+ * Send the block data compressed using the given Huffman trees. The code
+ * and extra bits of a length or distance go out together, in one send_bits.
  */
 void compress_block(TState &state, ct_data *ltree, ct_data *dtree) {
   unsigned dist;   /* distance of matched string */
-  int lc;          /* match length or unmatched char (if dist == 0) */
+  unsigned lc;     /* match length or unmatched char (if dist == 0) */
   unsigned lx = 0; /* running index in l_buf */
   unsigned dx = 0; /* running index in d_buf */
   unsigned fx = 0; /* running index in flag_buf */
   uch flag = 0;    /* current flags */
-  unsigned code;   /* the code to send */
-  int extra;       /* number of extra bits to send */
 
   if (state.ts.last_lit != 0) do {
       if ((lx & 7) == 0) flag = state.ts.flag_buf[fx++];
@@ -1573,24 +1734,21 @@ void compress_block(TState &state, ct_data *ltree, ct_data *dtree) {
         send_code(state, lc, ltree); /* send a literal byte */
       } else {
         /* Here, lc is the match length - MIN_MATCH */
-        code = state.ts.length_code[lc];
-        send_code(state, code + LITERALS + 1, ltree); /* send the length code */
-        extra = extra_lbits[code];
-        if (extra != 0) {
-          lc -= state.ts.base_length[code];
-          send_bits(state, lc, extra); /* send the extra length bits */
-        }
+        const code_data &lcode = state.ts.length_code[lc];
+        const ct_data &lt = ltree[lcode.code + LITERALS + 1];
+        /* send the length code and its extra bits */
+        send_bits(state, lt.fc.code | (lc - lcode.base) << lt.dl.len,
+                  lt.dl.len + lcode.extra);
+
         dist = state.ts.d_buf[dx++];
         /* Here, dist is the match distance - 1 */
-        code = d_code(dist);
-        Assert(state, code < D_CODES, "bad d_code");
-
-        send_code(state, code, dtree); /* send the distance code */
-        extra = extra_dbits[code];
-        if (extra != 0) {
-          dist -= state.ts.base_dist[code];
-          send_bits(state, dist, extra); /* send the extra distance bits */
-        }
+        const code_data &dcode = d_code(dist);
+        Assert(state, dcode.code < D_CODES, "bad d_code");
+
+        const ct_data &dt = dtree[dcode.code];
+        /* send the distance code and its extra bits */
+        send_bits(state, dt.fc.code | (dist - dcode.base) << dt.dl.len,
+                  dt.dl.len + dcode.extra);
       } /* literal or match pair ? */
       flag >>= 1;
     } while (lx < state.ts.last_lit);
@@ -1631,22 +1789,25 @@ void bi_init(TState &state, char *tgt_buf, unsigned tgt_size,
 
 /* ===========================================================================
  * Send a value on a given number of bits.
- * IN assertion: length <= 16 and value fits in length bits.
+ * IN assertion: length <= 32 and value fits in length bits.
  */
-void send_bits(TState &state, int value, int length) {
-  Assert(state, length > 0 && length <= 15, "invalid length");
+void send_bits(TState &state, unsigned value, int length) {
+  Assert(state, length > 0 && length <= 32, "invalid length");
   state.bs.bits_sent += (ulg)length;
   /* If not enough room in bi_buf, use (bi_valid) bits from bi_buf and
    * (Buf_size - bi_valid) bits from value to flush the filled bi_buf,
    * then fill in the rest of (value), leaving (length - (Buf_size-bi_valid))
    * unused bits in bi_buf.
    */
-  state.bs.bi_buf |= (value << state.bs.bi_valid);
+  state.bs.bi_buf |= (unsigned long long)value << state.bs.bi_valid;
   state.bs.bi_valid += length;
-  if (state.bs.bi_valid > (int)Buf_size) {
-    PUTSHORT(state, state.bs.bi_buf);
+  if (state.bs.bi_valid >= (int)Buf_size) {
+    PUTBIBUF(state);
     state.bs.bi_valid -= Buf_size;
-    state.bs.bi_buf = (unsigned)value >> (length - state.bs.bi_valid);
+    state.bs.bi_buf = state.bs.bi_valid != 0
+                          ? (unsigned long long)value >>
+                                (length - state.bs.bi_valid)
+                          : 0;
   }
 }
 
@@ -1668,10 +1829,9 @@ unsigned bi_reverse(unsigned code, int len) {
  * Write out any remaining bits in an incomplete byte.
  */
 void bi_windup(TState &state) {
-  if (state.bs.bi_valid > 8) {
-    PUTSHORT(state, state.bs.bi_buf);
-  } else if (state.bs.bi_valid > 0) {
+  for (; state.bs.bi_valid > 0; state.bs.bi_valid -= 8) {
     PUTBYTE(state, state.bs.bi_buf);
+    state.bs.bi_buf >>= 8;
   }
   if (state.bs.flush_flg) {
     state.flush_outbuf(state.param, state.bs.out_buf, &state.bs.out_offset);
@@ -1711,9 +1871,11 @@ void copy_block(TState &state, char *block, unsigned len, int header) {
  */
 
 void fill_window(TState &state);
+template <int pack_level>
 ulg deflate_fast(TState &state);
 
-int longest_match(TState &state, IPos cur_match);
+template <int pack_level>
+int longest_match(TState &state, IPos cur_match, int nice_match);
 
 /* ===========================================================================
  * Update a hash value with the given input byte
@@ -1736,6 +1898,17 @@ int longest_match(TState &state, IPos cur_match);
    state.ds.prev[(s) & WMASK] = match_head = state.ds.head[state.ds.ins_h], \
    state.ds.head[state.ds.ins_h] = (s))
 
+/* ===========================================================================
+ * Hash of the four bytes at p, for deflate_fastest()'s head[]. The bytes are
+ * put together in the same order on every machine, so output doesn't depend
+ * on it.
+ */
+inline unsigned hash4(const uch *p) {
+  const unsigned v{(unsigned)p[0] | (unsigned)p[1] << 8 |
+                   (unsigned)p[2] << 16 | (unsigned)p[3] << 24};
+  return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
 /* ===========================================================================
  * Initialize the "longest match" routines for a new file
  *
@@ -1746,9 +1919,9 @@ int longest_match(TState &state, IPos cur_match);
  *    of window[] when looking for matches towards the end).
  */
 void lm_init(TState &state, int pack_level, ush *flags) {
-  unsigned j;
+  unsigned j, end;
 
-  Assert(state, pack_level >= 1 && pack_level <= 8, "bad pack level");
+  Assert(state, pack_level >= 1 && pack_level <= 9, "bad pack level");
 
   /* Do not slide the window if the whole input is already in memory
    * (window_size > 0)
@@ -1756,22 +1929,35 @@ void lm_init(TState &state, int pack_level, ush *flags) {
   state.ds.sliding = 0;
   if (state.ds.window_size == 0L) {
     state.ds.sliding = 1;
-    state.ds.window_size = (ulg)2L * WSIZE;
+    state.ds.window_size = (ulg)WINDOW_SIZE;
   }
 
-  /* Initialize the hash table (avoiding 64K overflow for 16 bit systems).
-   * prev[] will be initialized on the fly.
+  /* Initialize the hash table. prev[] will be initialized on the fly.
+   * The last file can only have set the heads of the strings it inserted,
+   * all below strstart + lookahead. If it was small and never slid the
+   * window, those strings are still there, so hash them again and clear just
+   * their heads rather than all HASH_SIZE of them.
    */
-  state.ds.head[HASH_SIZE - 1] = NIL;
-  memset((char *)state.ds.head, NIL,
-         (unsigned)(HASH_SIZE - 1) * sizeof(*state.ds.head));
+  end = state.ds.strstart + state.ds.lookahead;
+  if (state.ds.slid || end > LAZY_CLEAR_MAX) {
+    memset((char *)state.ds.head, NIL, HASH_SIZE * sizeof(*state.ds.head));
+  } else if (state.ds.fastest) {
+    for (j = 0; j < end; j++) state.ds.head[hash4(state.ds.window + j)] = NIL;
+  } else {
+    unsigned h{0};
+    UPDATE_HASH(h, state.ds.window[0]);
+    UPDATE_HASH(h, state.ds.window[1]);
+    for (j = 0; j < end; j++) {
+      UPDATE_HASH(h, state.ds.window[j + MIN_MATCH - 1]);
+      state.ds.head[h] = NIL;
+    }
+  }
+  state.ds.slid = 0;
+  state.ds.fastest = pack_level == 1;
 
-  /* Set the default configuration parameters:
+  /* The configuration parameters are compiled into deflate() for each
+   * level.
    */
-  state.ds.max_lazy_match = configuration_table[pack_level].max_lazy;
-  state.ds.good_match = configuration_table[pack_level].good_length;
-  state.ds.nice_match = configuration_table[pack_level].nice_length;
-  state.ds.max_chain_length = configuration_table[pack_level].max_chain;
   if (pack_level <= 2) {
     *flags |= FAST;
   } else if (pack_level >= 8) {
@@ -1782,8 +1968,20 @@ void lm_init(TState &state, int pack_level, ush *flags) {
   state.ds.strstart = 0;
   state.ds.block_start = 0L;
 
-  j = WSIZE;
-  j <<= 1;  // Can read 64K in one step
+  state.ds.prev_length = MIN_MATCH - 1;
+  state.ds.hash_head = NIL;
+  state.ds.match_length = pack_level <= 3 ? 0 : MIN_MATCH - 1;
+  state.ds.match_available = 0;
+
+  if (state.ds.pushing) {
+    // Nothing has been pushed yet, deflate_push() fills the window as the
+    // input arrives.
+    state.ds.lookahead = 0;
+    state.ds.eofile = 0;
+    return;
+  }
+
+  j = WINDOW_SIZE;  // Can fill the window in one step
   state.ds.lookahead = state.readfunc(state, (char *)state.ds.window, j);
 
   if (state.ds.lookahead == 0 || state.ds.lookahead == (unsigned)EOF) {
@@ -1811,14 +2009,18 @@ void lm_init(TState &state, int pack_level, ush *flags) {
  * garbage.
  * IN assertions: cur_match is the head of the hash chain for the current
  *   string (strstart) and its distance is <= MAX_DIST, and prev_length >= 1
+ * The search stops at a match of nice_match bytes, and the chain length and
+ * good match length come from configuration_table[pack_level].
  */
 // For 80x86 and 680x0 and ARM, an optimized version is in match.asm or
 // match.S. The code is functionally equivalent, so you can use the C version
 // if desired. Which I do so desire!
-int longest_match(TState &state, IPos cur_match) {
-  unsigned chain_length = state.ds.max_chain_length; /* max hash chain length */
-  uch *scan = state.ds.window + state.ds.strstart;   /* current string */
-  uch *match;                                        /* matched string */
+template <int pack_level>
+int longest_match(TState &state, IPos cur_match, int nice_match) {
+  constexpr config cfg{configuration_table[pack_level]};
+  unsigned chain_length = cfg.max_chain;           /* max hash chain length */
+  uch *scan = state.ds.window + state.ds.strstart; /* current string */
+  uch *match;                                      /* matched string */
   int len;                             /* length of current match */
   int best_len = state.ds.prev_length; /* best match length so far */
   IPos limit = state.ds.strstart > (IPos)MAX_DIST
@@ -1837,7 +2039,7 @@ int longest_match(TState &state, IPos cur_match) {
   uch scan_end = scan[best_len];
 
   /* Do not waste too much time if we already have a good match: */
-  if (state.ds.prev_length >= state.ds.good_match) {
+  if (state.ds.prev_length >= cfg.good_length) {
     chain_length >>= 2;
   }
 
@@ -1882,7 +2084,7 @@ int longest_match(TState &state, IPos cur_match) {
     if (len > best_len) {
       state.ds.match_start = cur_match;
       best_len = len;
-      if (len >= state.ds.nice_match) break;
+      if (len >= nice_match) break;
       scan_end1 = scan[best_len - 1];
       scan_end = scan[best_len];
     }
@@ -1940,42 +2142,43 @@ void fill_window(TState &state) {
        * we must not perform sliding. We must however call (*read_buf)() in
        * order to compute the crc, update lookahead and possibly set eofile.
        */
-    } else if (state.ds.strstart >= WSIZE + MAX_DIST && state.ds.sliding) {
-      /* By the IN assertion, the window is not empty so we can't confuse
-       * more == 0 with more == 64K on a 16 bit machine.
+    } else if (state.ds.strstart >= WSLIDE + MAX_DIST && state.ds.sliding) {
+      /* Keep the last WSIZE bytes, which hold all of the lookahead and the
+       * MAX_DIST bytes of history behind strstart.
        */
-      memcpy((char *)state.ds.window, (char *)state.ds.window + WSIZE,
+      memcpy((char *)state.ds.window, (char *)state.ds.window + WSLIDE,
              (unsigned)WSIZE);
-      state.ds.match_start -= WSIZE;
-      state.ds.strstart -= WSIZE; /* we now have strstart >= MAX_DIST: */
+      state.ds.match_start -= WSLIDE;
+      state.ds.strstart -= WSLIDE; /* we now have strstart >= MAX_DIST: */
 
-      state.ds.block_start -= (long)WSIZE;
+      state.ds.block_start -= (long)WSLIDE;
+      state.ds.slid = 1;
 
       for (n = 0; n < HASH_SIZE; n++) {
         m = state.ds.head[n];
-        state.ds.head[n] = (Pos)(m >= WSIZE ? m - WSIZE : NIL);
+        state.ds.head[n] = (Pos)(m >= WSLIDE ? m - WSLIDE : NIL);
       }
       for (n = 0; n < WSIZE; n++) {
         m = state.ds.prev[n];
-        state.ds.prev[n] = (Pos)(m >= WSIZE ? m - WSIZE : NIL);
+        state.ds.prev[n] = (Pos)(m >= WSLIDE ? m - WSLIDE : NIL);
         /* If n is not on any hash chain, prev[n] is garbage but
          * its value will never be used.
          */
       }
-      more += WSIZE;
+      more += WSLIDE;
     }
     if (state.ds.eofile) return;
 
     /* If there was no sliding:
-     *    strstart <= WSIZE+MAX_DIST-1 && lookahead <= MIN_LOOKAHEAD - 1 &&
+     *    strstart <= WSLIDE+MAX_DIST-1 && lookahead <= MIN_LOOKAHEAD - 1 &&
      *    more == window_size - lookahead - strstart
-     * => more >= window_size - (MIN_LOOKAHEAD-1 + WSIZE + MAX_DIST-1)
-     * => more >= window_size - 2*WSIZE + 2
+     * => more >= window_size - (MIN_LOOKAHEAD-1 + WSLIDE + MAX_DIST-1)
+     * => more >= window_size - WINDOW_SIZE + 2
      * In the MMAP or BIG_MEM case (not yet supported in gzip),
      *   window_size == input_size + MIN_LOOKAHEAD  &&
      *   strstart + lookahead <= input_size => more >= MIN_LOOKAHEAD.
-     * Otherwise, window_size == 2*WSIZE so more >= 2.
-     * If there was sliding, more >= WSIZE. So in all cases, more >= 2.
+     * Otherwise, window_size == WINDOW_SIZE so more >= 2.
+     * If there was sliding, more >= WSLIDE. So in all cases, more >= 2.
      */
     Assert(state, more >= 2, "more < 2");
 
@@ -1984,6 +2187,9 @@ void fill_window(TState &state) {
         more);
 
     if (n == 0 || n == (unsigned)EOF) {
+      // Pushed input has merely run dry, the rest comes with the next push.
+      if (state.ds.pushing) return;
+
       state.ds.eofile = 1;
     } else {
       state.ds.lookahead += n;
@@ -2008,12 +2214,18 @@ void fill_window(TState &state) {
  * new strings in the dictionary only for unmatched strings or for short
  * matches. It is used only for the fast compression options.
  */
+template <int pack_level>
 ulg deflate_fast(TState &state) {
-  IPos hash_head = NIL;      /* head of the hash chain */
-  int flush;                 /* set if current block must be flushed */
-  unsigned match_length = 0; /* length of best match */
+  constexpr config cfg{configuration_table[pack_level]};
+  /* Insert new strings in the hash table only if the match length
+   * is not greater than this length. This saves time but degrades
+   * compression.
+   */
+  constexpr unsigned max_insert_length{cfg.max_lazy};
+  IPos hash_head = state.ds.hash_head; /* head of the hash chain */
+  int flush; /* set if current block must be flushed */
+  unsigned match_length = state.ds.match_length; /* length of best match */
 
-  state.ds.prev_length = MIN_MATCH - 1;
   while (state.ds.lookahead != 0) {
     /* Insert the string window[strstart .. strstart+2] in the
      * dictionary, and set hash_head to the head of the hash chain:
@@ -2032,9 +2244,10 @@ ulg deflate_fast(TState &state) {
       /* Do not look for matches beyond the end of the input.
        * This is necessary to make deflate deterministic.
        */
-      if ((unsigned)state.ds.nice_match > state.ds.lookahead)
-        state.ds.nice_match = (int)state.ds.lookahead;
-      match_length = longest_match(state, hash_head);
+      const int nice_match{cfg.nice_length > state.ds.lookahead
+                               ? (int)state.ds.lookahead
+                               : cfg.nice_length};
+      match_length = longest_match<pack_level>(state, hash_head, nice_match);
       /* longest_match() sets match_start */
       if (match_length > state.ds.lookahead) match_length = state.ds.lookahead;
     }
@@ -2049,13 +2262,13 @@ ulg deflate_fast(TState &state) {
       /* Insert new strings in the hash table only if the match length
        * is not too large. This saves time but degrades compression.
        */
-      if (match_length <= state.ds.max_insert_length &&
+      if (match_length <= max_insert_length &&
           state.ds.lookahead >= MIN_MATCH) {
         match_length--; /* string at strstart already in hash table */
         do {
           state.ds.strstart++;
           INSERT_STRING(state.ds.strstart, hash_head);
-          /* strstart never exceeds WSIZE-MAX_MATCH, so there are
+          /* strstart never exceeds WINDOW_SIZE-MAX_MATCH, so there are
            * always MIN_MATCH bytes ahead.
            */
         } while (--match_length != 0);
@@ -2081,24 +2294,105 @@ ulg deflate_fast(TState &state) {
      * for the next match, plus MIN_MATCH bytes to insert the
      * string following the next match.
      */
-    if (state.ds.lookahead < MIN_LOOKAHEAD) fill_window(state);
+    if (state.ds.lookahead < MIN_LOOKAHEAD) {
+      fill_window(state);
+
+      if (state.ds.lookahead < MIN_LOOKAHEAD && state.ds.pushing) {
+        state.ds.hash_head = hash_head;
+        state.ds.match_length = match_length;
+        return 0;
+      }
+    }
+  }
+  return FLUSH_BLOCK(state, 1); /* eof */
+}
+
+/* ===========================================================================
+ * Processes a new input file and return its compressed length, as fast as
+ * possible: this is level 1. Parsing is greedy, and head[] keeps just the
+ * last position for each hash of four bytes, with no chains in prev[], so
+ * each string is checked against one earlier string only. The strings
+ * inside a match are skipped without being inserted.
+ */
+ulg deflate_fastest(TState &state) {
+  uch *const window = state.ds.window;
+  int flush; /* set if current block must be flushed */
+
+  while (state.ds.lookahead != 0) {
+    const unsigned strstart = state.ds.strstart;
+    unsigned match_length = 0; /* length of the match, if any */
+
+    if (state.ds.lookahead > MIN_MATCH) {
+      Pos &head = state.ds.head[hash4(window + strstart)];
+      const IPos cur_match = head;
+      head = strstart;
+
+      /* As elsewhere, the string at window index 0 is never matched. */
+      if (cur_match != NIL && strstart - cur_match <= MAX_DIST &&
+          memcmp(window + cur_match, window + strstart, MIN_MATCH + 1) == 0) {
+        /* Do not look for matches beyond the end of the input. */
+        const unsigned max_length = state.ds.lookahead < MAX_MATCH
+                                        ? state.ds.lookahead
+                                        : MAX_MATCH;
+        const uch *scan = window + strstart + MIN_MATCH + 1;
+        const uch *match = window + cur_match + MIN_MATCH + 1;
+        const uch *const strend = window + strstart + max_length;
+
+        while (strend - scan >= 8) {
+          unsigned long long sv, mv;
+          memcpy(&sv, scan, 8);
+          memcpy(&mv, match, 8);
+          if (sv != mv) break;
+          scan += 8, match += 8;
+        }
+        while (scan < strend && *scan == *match) scan++, match++;
+
+        match_length = (unsigned)(scan - (window + strstart));
+        state.ds.match_start = cur_match;
+      }
+    }
+
+    if (match_length != 0) {
+      check_match(state, strstart, state.ds.match_start, match_length);
+
+      flush = ct_tally(state, strstart - state.ds.match_start,
+                       match_length - MIN_MATCH);
+
+      state.ds.lookahead -= match_length;
+      state.ds.strstart += match_length;
+    } else {
+      /* No match, output a literal byte */
+      flush = ct_tally(state, 0, window[strstart]);
+      state.ds.lookahead--;
+      state.ds.strstart++;
+    }
+    if (flush) FLUSH_BLOCK(state, 0), state.ds.block_start = state.ds.strstart;
+
+    /* Make sure that we always have enough lookahead, except
+     * at the end of the input file.
+     */
+    if (state.ds.lookahead < MIN_LOOKAHEAD) {
+      fill_window(state);
+
+      if (state.ds.lookahead < MIN_LOOKAHEAD && state.ds.pushing) return 0;
+    }
   }
   return FLUSH_BLOCK(state, 1); /* eof */
 }
 
 /* ===========================================================================
- * Same as above, but achieves better compression. We use a lazy
+ * Same as deflate_fast(), but achieves better compression. We use a lazy
  * evaluation for matches: a match is finally adopted only if there is
  * no better match at the next window position.
  */
-ulg deflate(TState &state) {
-  IPos hash_head = NIL;    /* head of hash chain */
-  IPos prev_match;         /* previous match */
-  int flush;               /* set if current block must be flushed */
-  int match_available = 0; /* set if previous match exists */
-  unsigned match_length = MIN_MATCH - 1; /* length of best match */
-
-  if (state.level <= 3) return deflate_fast(state); /* optimized for speed */
+template <int pack_level>
+ulg deflate_slow(TState &state) {
+  constexpr config cfg{configuration_table[pack_level]};
+  IPos hash_head = state.ds.hash_head; /* head of hash chain */
+  IPos prev_match;                     /* previous match */
+  int flush; /* set if current block must be flushed */
+  int match_available = state.ds.match_available; /* previous match exists */
+  unsigned match_length = state.ds.match_length; /* length of best match */
 
   /* Process the input block. */
   while (state.ds.lookahead != 0) {
@@ -2113,7 +2407,7 @@ ulg deflate(TState &state) {
     state.ds.prev_length = match_length, prev_match = state.ds.match_start;
     match_length = MIN_MATCH - 1;
 
-    if (hash_head != NIL && state.ds.prev_length < state.ds.max_lazy_match &&
+    if (hash_head != NIL && state.ds.prev_length < cfg.max_lazy &&
         state.ds.strstart - hash_head <= MAX_DIST) {
       /* To simplify the code, we prevent matches with the string
        * of window index 0 (in particular we have to avoid a match
@@ -2122,9 +2416,10 @@ ulg deflate(TState &state) {
       /* Do not look for matches beyond the end of the input.
        * This is necessary to make deflate deterministic.
        */
-      if ((unsigned)state.ds.nice_match > state.ds.lookahead)
-        state.ds.nice_match = (int)state.ds.lookahead;
-      match_length = longest_match(state, hash_head);
+      const int nice_match{cfg.nice_length > state.ds.lookahead
+                               ? (int)state.ds.lookahead
+                               : cfg.nice_length};
+      match_length = longest_match<pack_level>(state, hash_head, nice_match);
       /* longest_match() sets match_start */
       if (match_length > state.ds.lookahead) match_length = state.ds.lookahead;
 
@@ -2156,7 +2451,7 @@ ulg deflate(TState &state) {
       do {
         if (++state.ds.strstart <= max_insert) {
           INSERT_STRING(state.ds.strstart, hash_head);
-          /* strstart never exceeds WSIZE-MAX_MATCH, so there are
+          /* strstart never exceeds WINDOW_SIZE-MAX_MATCH, so there are
            * always MIN_MATCH bytes ahead.
            */
         }
@@ -2194,7 +2489,16 @@ ulg deflate(TState &state) {
      * for the next match, plus MIN_MATCH bytes to insert the
      * string following the next match.
      */
-    if (state.ds.lookahead < MIN_LOOKAHEAD) fill_window(state);
+    if (state.ds.lookahead < MIN_LOOKAHEAD) {
+      fill_window(state);
+
+      if (state.ds.lookahead < MIN_LOOKAHEAD && state.ds.pushing) {
+        state.ds.hash_head = hash_head;
+        state.ds.match_length = match_length;
+        state.ds.match_available = match_available;
+        return 0;
+      }
+    }
   }
   if (match_available)
     ct_tally(state, 0, state.ds.window[state.ds.strstart - 1]);
@@ -2202,6 +2506,56 @@ ulg deflate(TState &state) {
   return FLUSH_BLOCK(state, 1); /* eof */
 }
 
+/* ===========================================================================
+ * Processes a new input file and returns its compressed length, with the
+ * loop for state.level: deflate_fastest() at level 1, deflate_fast() at
+ * levels 2 and 3, which are optimized for speed, and deflate_slow() above
+ * that.
+ */
+ulg deflate(TState &state) {
+  switch (state.level) {
+    case 1:
+      return deflate_fastest(state);
+    case 2:
+      return deflate_fast<2>(state);
+    case 3:
+      return deflate_fast<3>(state);
+    case 4:
+      return deflate_slow<4>(state);
+    case 5:
+      return deflate_slow<5>(state);
+    case 6:
+      return deflate_slow<6>(state);
+    case 7:
+      return deflate_slow<7>(state);
+    case 8:
+      return deflate_slow<8>(state);
+    default:
+      return deflate_slow<9>(state);
+  }
+}
+
+/* ===========================================================================
+ * Same as above, for input that is pushed in a piece at a time rather than
+ * pulled through readfunc. While state.ds.pushing is set this consumes what
+ * has been pushed, keeping the last MIN_LOOKAHEAD bytes in the window until
+ * more arrive, and returns 0. Once pushing is cleared it finishes the input
+ * and returns the compressed length like deflate().
+ */
+ulg deflate_push(TState &state) {
+  if (state.ds.lookahead < MIN_LOOKAHEAD) fill_window(state);
+  if (state.ds.lookahead < MIN_LOOKAHEAD && state.ds.pushing) return 0;
+
+  // first time round: prime the hash as lm_init() does for pulled input
+  if (state.ds.strstart == 0) {
+    state.ds.ins_h = 0;
+    for (unsigned j = 0; j < MIN_MATCH - 1; j++)
+      UPDATE_HASH(state.ds.ins_h, state.ds.window[j]);
+  }
+
+  return deflate(state);
+}
+
 // Write a local header described by *z to file *f. Return a ZE_ error code.
 int putlocal(struct zlist *z, WRITEFUNC wfunc, void *param) {
   PUTLG(LOCSIG, f);
@@ -2328,25 +2682,43 @@ constexpr ulg crc_table[256] = {
     0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
     0x2d02ef8dL};
 
+// crc_table extended for eight bytes at a time: slice[k][n] is the CRC of
+// byte n followed by k zero bytes.
+struct crc_slices {
+  unsigned slice[8][256];
+};
+
+constexpr crc_slices make_crc_slices() {
+  crc_slices s{};
+  for (int n = 0; n < 256; n++) s.slice[0][n] = (unsigned)crc_table[n];
+  for (int k = 1; k < 8; k++) {
+    for (int n = 0; n < 256; n++) {
+      const unsigned c{s.slice[k - 1][n]};
+      s.slice[k][n] = (c >> 8) ^ s.slice[0][c & 0xff];
+    }
+  }
+  return s;
+}
+
+constexpr crc_slices crc_slices8{make_crc_slices()};
+
 #define CRC32(c, b) (crc_table[((int)(c) ^ (b)) & 0xff] ^ ((c) >> 8))
 #define DO1(buf) crc = CRC32(crc, *buf++)
-#define DO2(buf) \
-  DO1(buf);      \
-  DO1(buf)
-#define DO4(buf) \
-  DO2(buf);      \
-  DO2(buf)
-#define DO8(buf) \
-  DO4(buf);      \
-  DO4(buf)
 
 ulg crc32(ulg crc, const uch *buf, extent len) {
   if (buf == nullptr) return 0L;
 
   crc = crc ^ 0xffffffffL;
 
+  const auto &t = crc_slices8.slice;
   while (len >= 8) {
-    DO8(buf);
+    const unsigned c{(unsigned)crc ^ ((unsigned)buf[0] | (unsigned)buf[1] << 8 |
+                                      (unsigned)buf[2] << 16 |
+                                      (unsigned)buf[3] << 24)};
+    crc = t[7][c & 0xff] ^ t[6][(c >> 8) & 0xff] ^ t[5][(c >> 16) & 0xff] ^
+          t[4][c >> 24] ^ t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^
+          t[0][buf[7]];
+    buf += 8;
     len -= 8;
   }
 
@@ -2407,9 +2779,117 @@ bool HasZipSuffix(const TCHAR *fn) {
   return false;
 }
 
+// Puts dstzn into iname as zip has its names look: dir/file.stuff, in UTF-8.
+// A name too long is cut short.  Returns the length of iname.
+size_t ZipName(const TCHAR *dstzn, char (&iname)[MAX_PATH]) {
+  TCHAR name[MAX_PATH];
+  _tcsncpy(name, dstzn, std::size(name) - 1);
+  name[std::size(name) - 1] = 0;
+
+  for (TCHAR *d{name}; *d != 0; ++d) {
+    if (*d == '\\') *d = '/';
+  }
+
+#ifdef UNICODE
+  if (WideCharToMultiByte(CP_UTF8, 0, name, -1, iname, MAX_PATH, 0, 0) == 0)
+    iname[0] = 0;
+#else
+  memcpy(iname, name, sizeof(name));
+#endif
+
+  return strlen(iname);
+}
+
+// The allocator used when the caller doesn't give one.
+void *DefaultAllocate(void *, size_t size) { return malloc(size); }
+void DefaultDeallocate(void *, void *ptr) { free(ptr); }
+
+constexpr ZALLOCATOR default_allocator{DefaultAllocate, DefaultDeallocate,
+                                       nullptr};
+
+void *zaalloc(const ZALLOCATOR &a, size_t size) {
+  return a.allocate(a.opaque, size);
+}
+
+void zafree(const ZALLOCATOR &a, void *ptr) {
+  if (ptr) a.deallocate(a.opaque, ptr);
+}
+
+// Constructs a T in memory obtained from the allocator, nullptr on failure.
+template <typename T, typename... Args>
+T *zanew(const ZALLOCATOR &a, Args &&...args) {
+  void *mem{zaalloc(a, sizeof(T))};
+  return mem ? new (mem) T(std::forward<Args>(args)...) : nullptr;
+}
+
+template <typename T>
+void zadelete(const ZALLOCATOR &a, T *ptr) {
+  if (ptr) {
+    ptr->~T();
+    a.deallocate(a.opaque, ptr);
+  }
+}
+
+// How much a seekable file output gathers before writing it out.  Big enough
+// that deflate's 16k flushes and the headers between them go out together.
+constexpr unsigned default_wbufsize{256 * 1024};
+
+// putlocal writes a byte or two at a time, so a header being rewritten is
+// gathered here first and then patched in one go.
+struct TZipHeaderPatch {
+  char buf[4 + LOCHEAD + MAX_PATH + EB_L_UT_SIZE];
+  unsigned len;
+
+  static unsigned swrite(void *param, const char *buf, unsigned size) {
+    auto *patch = static_cast<TZipHeaderPatch *>(param);
+    if (size > sizeof(patch->buf) - patch->len) return 0;
+
+    memcpy(patch->buf + patch->len, buf, size);
+    patch->len += size;
+    return size;
+  }
+};
+
+// A bounded ring of blocks passed from one thread to another, for the read
+// and write stages of a pipelined Add.  The producer fills slots[head] without
+// the lock, since the consumer doesn't touch a slot until it is counted in
+// full, and likewise the other way round.
+struct TZipStage {
+  static constexpr unsigned maxslots{16};
+
+  std::mutex mu;
+  std::condition_variable cv;
+  char *slots[maxslots];
+  unsigned lens[maxslots];
+  unsigned count;  // slots in use, at most maxslots
+  unsigned head;   // next slot for the producer to fill
+  unsigned tail;   // next slot for the consumer to drain
+  unsigned full;   // filled and not yet drained
+  unsigned pos;    // how far into slots[tail] the consumer has got
+  bool done;       // the producer has nothing more to give
+  bool failed;     // whoever does the I/O has given up
+  bool stop;       // the consumer wants no more
+
+  void reset() {
+    head = tail = full = pos = 0;
+    done = failed = stop = false;
+  }
+};
+
+struct TZipPipeline {
+  static constexpr unsigned slotsize{256 * 1024};
+
+  TZipStage in, out;
+  std::thread reader, writer;
+  bool reading, writing;
+  // what the reader saw, handed over when it's joined
+  ulg crc;
+  long red;
+};
+
 class TZip {
  public:
-  explicit TZip(const char *pwd) noexcept
+  TZip(const char *pwd, const ZALLOCATOR &allocator) noexcept
       : password(nullptr),
         hfout(nullptr),
         mustclosehfout(false),
@@ -2426,10 +2906,18 @@ class TZip {
         hfin(nullptr) {
     memset(this, 0, sizeof(*this));
 
+    ualloc = allocator;
+#ifdef ZU_STATS
+    alloc = {StatAllocate, StatDeallocate, this};
+#else
+    alloc = allocator;
+#endif
+    olevel = 8;
+
     if (pwd && *pwd) {
       const size_t pwdsize{strlen(pwd) + 1};
 
-      password = new (std::nothrow) char[pwdsize];
+      password = static_cast<char *>(zaalloc(alloc, pwdsize));
       if (password) {
         strcpy(password, pwd);
       } else {
@@ -2439,11 +2927,52 @@ class TZip {
   }
 
   ~TZip() noexcept {
-    delete state;
-    delete[] encbuf;
-    delete[] password;
+    // entries are normally freed by AddCentral, unless we never got there
+    for (TZipFileInfo *zfi{zfis}; zfi != nullptr;) {
+      TZipFileInfo *zfinext{zfi->nxt};
+
+      zafree(alloc, zfi->cextra);
+      zafree(alloc, zfi->comment);
+      zadelete(alloc, zfi);
+
+      zfi = zfinext;
+    }
+
+    zafree(alloc, ocomment);
+    zafree(alloc, ofn);
+    zafree(alloc, otmpfn);
+    if (ogrow) zafree(alloc, obuf);
+    zafree(alloc, wbuf);
+
+    if (pipe) {
+      for (TZipStage *stage : {&pipe->in, &pipe->out}) {
+        for (unsigned i{0}; i < stage->count; ++i)
+          zafree(alloc, stage->slots[i]);
+      }
+      zadelete(alloc, pipe);
+    }
+
+    zadelete(alloc, state);
+    zafree(alloc, encbuf);
+    zafree(alloc, password);
   }
 
+  // all our memory comes from here.  It's the caller's ualloc, counted when
+  // there are statistics; the TZip itself comes straight from ualloc.
+  ZALLOCATOR alloc;
+  ZALLOCATOR ualloc;
+#ifdef ZU_STATS
+  static void *StatAllocate(void *opaque, size_t size);
+  static void StatDeallocate(void *opaque, void *ptr);
+
+  // For ZipGetStats.  While the pipeline runs, its reader and writer threads
+  // each count only the fields for their side.  cbns is the time spent in
+  // read(), write() and the like on the caller's thread, which compress_ns
+  // leaves out.
+  ZIPSTATS stats;
+  unsigned long long cbns;
+#endif
+
   // These variables say about the file we're writing into
   // We can write to pipe, file-by-handle, file-by-name, memory-to-memmapfile
   char *password;       // keep a copy of the password
@@ -2459,6 +2988,14 @@ class TZip {
   char *obuf;        // this is where we've locked mmap to view.
   unsigned opos;     // current pos in the mmap
   unsigned mapsize;  // the size of the map we created
+  bool ogrow;        // obuf is ours, and grows (from alloc) as it fills
+  // Seekable files are written from wbuf with positional writes, so that
+  // going back to fix up a local header neither moves the file position nor
+  // costs a flush.  wbufsize is 0 to write straight through.
+  char *wbuf;
+  unsigned wbufsize;
+  unsigned wbuflen;  // bytes waiting in wbuf, which end at wpos
+  unsigned wpos;     // offset (after ooffset) of the end of everything written
   bool hasputcen;    // have we yet placed the central directory?
   // if true, then we'll encrypt stuff using 'keys' before we write it to disk
   bool encwriting;
@@ -2470,14 +3007,55 @@ class TZip {
 
   // each file gets added onto this list, for writing the table at the end
   TZipFileInfo *zfis;
+  TZipFileInfo *zfislast;
+  // An existing zip opened by OpenZipForAppend keeps its comment, and is cut
+  // short at the end if the new directory leaves it shorter than before.
+  char *ocomment;
+  unsigned ocomlen;
+  bool otruncate;
+  // It also keeps its name: once ZipDelete has marked items (trash), the zip
+  // is rewritten beside it without them, and Close renames that over it.
+  TCHAR *ofn;
+  TCHAR *otmpfn;  // the rewrite, once there is one
+  bool odeleted;  // some items are marked but not yet compacted out
+  bool oadded;    // an item has been added, so it's too late to delete any
   // we use just one state object per zip, because it's big (500k)
   TState *state;
+  // Optional read-ahead and write-behind threads for Add; pipeslots is 0 when
+  // it's off.  While they run the writer owns everything on the output side
+  // (oerr included), and the caller only touches the rings.
+  TZipPipeline *pipe;
+  unsigned pipeslots;
+  // deflate level, 1 to 9, or 0 to store everything
+  int olevel;
 
   [[nodiscard]] ZRESULT Create(void *z, unsigned len, DWORD flags);
   static unsigned sflush(void *param, const char *buf, unsigned *size);
+  static unsigned mflush(void *param, const char *buf, unsigned *size);
   static unsigned swrite(void *param, const char *buf, unsigned size);
+  void otarget();
   unsigned write(const char *buf, unsigned size);
-  [[nodiscard]] bool oseek(unsigned pos);
+  unsigned oemit(const char *buf, unsigned size);
+  [[nodiscard]] bool ogrowto(unsigned size);
+  [[nodiscard]] bool owriteat(unsigned pos, const char *buf, unsigned size);
+  [[nodiscard]] bool oreadat(HANDLE h, unsigned long pos, char *buf,
+                             unsigned size);
+  [[nodiscard]] ZRESULT ReadCentral();
+  [[nodiscard]] ZRESULT Compact();
+  [[nodiscard]] ZRESULT BeginAdding();
+  [[nodiscard]] ZRESULT Delete(const TCHAR *odstzn);
+  [[nodiscard]] bool owrite(const char *buf, unsigned size);
+  [[nodiscard]] bool oflush();
+  [[nodiscard]] bool opatch(unsigned pos, const char *buf, unsigned size);
+  [[nodiscard]] ZRESULT SetBufferSize(unsigned size);
+  [[nodiscard]] ZRESULT SetPipeline(unsigned buffers);
+  [[nodiscard]] ZRESULT SetLevel(int level);
+  [[nodiscard]] bool pstart(ZipMode flags);
+  [[nodiscard]] ZRESULT pstop();
+  void preadloop();
+  void pwriteloop();
+  unsigned pget(char *buf, unsigned size);
+  unsigned pput(const char *buf, unsigned size);
   [[nodiscard]] ZRESULT GetMemory(void **pbuf, unsigned long *plen);
   ZRESULT Close();
 
@@ -2495,28 +3073,76 @@ class TZip {
   bool selfclosehf;  // for input files and pipes
   const char *bufin;
   unsigned lenin, posin;  // for memory
+  void *imap;             // read-only mapping of an input file, if any
+  size_t imaplen;
   // and a variable for what we've done with the input: (i.e. compressed it!)
   ulg csize;  // compressed size, set by the compression routines
   // and this is used by some of the compression routines
   char buf[16384];
 
   [[nodiscard]] ZRESULT open_file(const TCHAR *fn);
+  void map_file();
   [[nodiscard]] ZRESULT open_handle(HANDLE hf, unsigned len);
   [[nodiscard]] ZRESULT open_mem(void *src, unsigned len);
   [[nodiscard]] ZRESULT open_dir();
+  [[nodiscard]] ZRESULT open_push(unsigned len);
   static unsigned sread(TState &s, char *buf, unsigned size);
   unsigned read(char *buf, unsigned size);
+  unsigned iread(char *buf, unsigned size, bool *failed);
   ZRESULT iclose();
 
+  [[nodiscard]] ZRESULT istart(TZipFileInfo *zfi, bool push);
   [[nodiscard]] ZRESULT ideflate(TZipFileInfo *zfi);
   [[nodiscard]] ZRESULT istore();
 
+  // the entry currently being added. Add() goes from BeginEntry to EndEntry
+  // in one call, ZipEntryBegin/Write/End spread it over several.
+  TZipFileInfo entry;
+  char entryxloc[EB_L_UT_SIZE], entryxcen[EB_C_UT_SIZE];
+  ush entrymethod;
+  int entrypassex;
+  bool entryisdir;
+  bool inentry;  // between EntryBegin and EntryEnd
+
+  [[nodiscard]] ZRESULT BeginEntry(const TCHAR *odstzn, void *src,
+                                   unsigned len, ZipMode flags);
+  [[nodiscard]] ZRESULT EndEntry(ZRESULT writeres);
+
   [[nodiscard]] ZRESULT Add(const TCHAR *odstzn, void *src, unsigned len,
                             ZipMode flags);
+  [[nodiscard]] ZRESULT EntryBegin(const TCHAR *odstzn, unsigned len);
+  [[nodiscard]] ZRESULT EntryWrite(const void *src, unsigned len);
+  [[nodiscard]] ZRESULT EntryEnd();
+  [[nodiscard]] ZRESULT AddRaw(const TCHAR *odstzn, HZIP hzsrc, int index);
+  [[nodiscard]] ZRESULT AddRawItem(const TCHAR *odstzn, const ZIPRAWITEM &raw,
+                                   HZIPITEM item);
+  [[nodiscard]] ZRESULT CopyRaw(const TCHAR *odstzn, const ZIPRAWITEM &raw,
+                                HZIPITEM item);
+  [[nodiscard]] ZRESULT KeepEntry(TZipFileInfo &zfi);
   [[nodiscard]] ZRESULT AddCentral();
 };
 
+#ifdef ZU_STATS
+void *TZip::StatAllocate(void *opaque, size_t size) {
+  auto *zip = static_cast<TZip *>(opaque);
+
+  void *ptr{zaalloc(zip->ualloc, size)};
+  if (ptr) {
+    ++zip->stats.allocations;
+    zip->stats.allocated += size;
+  }
+
+  return ptr;
+}
+
+void TZip::StatDeallocate(void *opaque, void *ptr) {
+  zafree(static_cast<TZip *>(opaque)->ualloc, ptr);
+}
+#endif
+
 ZRESULT TZip::Create(void *z, unsigned len, DWORD flags) {
+  ZTRACE_SCOPE("zip_open");
+
   if (hfout != nullptr || hmapout != nullptr || obuf != nullptr || writ != 0 ||
       oerr != ZR_OK || hasputcen) {
     return ZR_NOTINITED;
@@ -2543,6 +3169,15 @@ ZRESULT TZip::Create(void *z, unsigned len, DWORD flags) {
     ocanseek = res != INVALID_SET_FILE_POINTER;
     ooffset = ocanseek ? res : 0;
 
+    if (ocanseek) {
+#ifdef ZIP_STD
+      // we write by position from now on, behind stdio's back
+      if (fflush(hfout) != 0) return ZR_WRITE;
+#endif
+      wpos = 0;
+      wbufsize = default_wbufsize;
+    }
+
     return ZR_OK;
   }
 
@@ -2563,24 +3198,88 @@ ZRESULT TZip::Create(void *z, unsigned len, DWORD flags) {
     }
 #endif
 
-    ocanseek = true;
+    // "files" like /dev/stdout are really pipes
+    ocanseek = GetFilePosZ(hfout) != INVALID_SET_FILE_POINTER;
     ooffset = 0;
     mustclosehfout = true;
 
+    if (ocanseek) {
+      wpos = 0;
+      wbufsize = default_wbufsize;
+    }
+
+    return ZR_OK;
+  }
+
+  if (flags == ZIP_APPEND) {
+    const auto *fn = static_cast<const TCHAR *>(z);
+
+#ifdef ZIP_STD
+    hfout = fopen(fn, "r+b");
+    if (!hfout) return ZR_NOFILE;
+#else
+    hfout = CreateFile(fn, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                       OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_BACKUP_SEMANTICS,
+                       nullptr);
+    if (hfout == INVALID_HANDLE_VALUE) {
+      hfout = nullptr;
+      return ZR_NOFILE;
+    }
+#endif
+
+    mustclosehfout = true;
+    ocanseek = GetFilePosZ(hfout) != INVALID_SET_FILE_POINTER;
+    ooffset = 0;
+
+    const size_t fnsize{(_tcslen(fn) + 1) * sizeof(TCHAR)};
+    ofn = static_cast<TCHAR *>(zaalloc(alloc, fnsize));
+    if (ofn) memcpy(ofn, fn, fnsize);
+
+    // new entries go where the old directory was, by position like any other
+    // seekable file
+    const ZRESULT rc{!ofn       ? ZR_NOALLOC
+                     : ocanseek ? ReadCentral()
+                                : ZR_SEEK};
+    if (rc != ZR_OK) {
+#ifdef ZIP_STD
+      fclose(hfout);
+#else
+      CloseHandle(hfout);
+#endif
+      hfout = nullptr;
+      mustclosehfout = false;
+      return rc;
+    }
+
+    wpos = writ;
+    wbufsize = default_wbufsize;
+    otruncate = true;
+
     return ZR_OK;
   }
 
   if (flags == ZIP_MEMORY) {
     unsigned size{len};
 
-    if (size == 0) return ZR_MEMSIZE;
-
 #ifdef ZIP_STD
-    if (z)
+    if (z) {
+      if (size == 0) return ZR_MEMSIZE;
+
       obuf = static_cast<char *>(z);
-    else
-      return ZR_ARGS;
+    } else {
+      // No paging file to reserve from, so len is just a first guess and the
+      // buffer grows as needed.
+      if (size == 0) size = 65536;
+
+      obuf = static_cast<char *>(zaalloc(alloc, size));
+      if (!obuf) return ZR_NOALLOC;
+
+      ogrow = true;
+    }
 #else
+    if (size == 0) return ZR_MEMSIZE;
+
     if (z)
       obuf = static_cast<char *>(z);
     else {
@@ -2615,7 +3314,9 @@ unsigned TZip::sflush(void *param, const char *buf, unsigned *size) {  // static
   auto *zip = static_cast<TZip *>(param);
   const unsigned writ{zip->write(buf, *size)};
 
-  if (writ != 0) *size = 0;
+  // A failed write has been noted already (it shows at the end of the entry),
+  // and keeping the block would only run the caller off the end of out_buf.
+  *size = 0;
 
   return writ;
 }
@@ -2627,38 +3328,108 @@ unsigned TZip::swrite(void *param, const char *buf, unsigned size) {  // static
   return zip->write(buf, size);
 }
 
-unsigned TZip::write(const char *inbuf, unsigned size) {
-  const char *srcbuf{inbuf};
+// The flush for a memory zip that is deflated straight into obuf (see
+// otarget): the bytes are already in place at opos, so they are only
+// encrypted there and kept.  A stored block comes from the window instead and
+// is written as usual.
+unsigned TZip::mflush(void *param, const char *buf, unsigned *size) {  // static
+  if (*size == 0) return 0;
 
-  if (encwriting) {
-    if (encbuf && encbufsize < size) {
-      delete[] encbuf;
-      encbuf = 0;
-    }
+  auto *zip = static_cast<TZip *>(param);
+  unsigned written;
 
-    if (!encbuf) {
-      encbuf = new (std::nothrow) char[size * 2];
-      if (!encbuf) {
-        oerr = ZR_NOALLOC;
-        return 0;
-      }
+  if (buf == zip->obuf + zip->opos) {
+    ZSTAT_TIME(zip->cbns);
+    ZSTAT_ADD(zip->stats.bytes_out, *size);
 
-      encbufsize = size;
+    char *out{zip->obuf + zip->opos};
+    if (zip->encwriting) {
+      for (unsigned i{0}; i < *size; i++) out[i] = zencode(zip->keys, out[i]);
     }
 
-    memcpy(encbuf, inbuf, size);
+    zip->opos += *size;
+    written = *size;
+  } else {
+    written = zip->write(buf, *size);
+  }
 
-    for (unsigned i{0}; i < size; i++) {
-      encbuf[i] = zencode(keys, encbuf[i]);
-    }
+  *size = 0;
+  zip->otarget();
+
+  return written;
+}
+
+// Points the compressor's output at the free space after opos in a memory zip,
+// growing obuf first if it is short of room, so that each compressed byte is
+// written once.  Near the end of a fixed buffer, and for other zips, output
+// goes through buf and sflush, and oemit reports any overflow.
+void TZip::otarget() {
+  constexpr unsigned minroom{sizeof(buf)};
+
+  if (obuf && !(pipe && pipe->writing) &&
+      (mapsize - opos > minroom || (ogrow && ogrowto(opos + minroom)))) {
+    // keeping the last byte free, as oemit does
+    state->bs.out_buf = obuf + opos;
+    state->bs.out_size = mapsize - opos - 1;
+    state->flush_outbuf = mflush;
+  } else {
+    state->bs.out_buf = buf;
+    state->bs.out_size = sizeof(buf);
+    state->flush_outbuf = sflush;
+  }
+}
+
+unsigned TZip::write(const char *inbuf, unsigned size) {
+  ZSTAT_TIME(cbns);
+
+  if (pipe && pipe->writing) return pput(inbuf, size);
+
+  return oemit(inbuf, size);
+}
+
+// Encrypts if need be and puts the bytes out, on the writer thread if there is
+// one.
+unsigned TZip::oemit(const char *inbuf, unsigned size) {
+  const char *srcbuf{inbuf};
+
+  ZSTAT_ADD(stats.bytes_out, size);
+
+  if (encwriting) {
+    if (encbuf && encbufsize < size) {
+      zafree(alloc, encbuf);
+      encbuf = 0;
+    }
+
+    if (!encbuf) {
+      encbuf = static_cast<char *>(zaalloc(alloc, size * 2));
+      if (!encbuf) {
+        oerr = ZR_NOALLOC;
+        return 0;
+      }
+
+      encbufsize = size;
+    }
+
+    memcpy(encbuf, inbuf, size);
+
+    for (unsigned i{0}; i < size; i++) {
+      encbuf[i] = zencode(keys, encbuf[i]);
+    }
 
     srcbuf = encbuf;
   }
 
   if (obuf) {
     if (opos + size >= mapsize) {
-      oerr = ZR_MEMSIZE;
-      return 0;
+      if (!ogrow) {
+        oerr = ZR_MEMSIZE;
+        return 0;
+      }
+
+      if (!ogrowto(opos + size)) {
+        oerr = ZR_NOALLOC;
+        return 0;
+      }
     }
 
     memcpy(obuf + opos, srcbuf, size);
@@ -2667,7 +3438,13 @@ unsigned TZip::write(const char *inbuf, unsigned size) {
     return size;
   }
 
+  if (hfout && ocanseek) return owrite(srcbuf, size) ? size : 0;
+
   if (hfout) {
+    ZTRACE_SCOPE("write");
+    ZSTAT_TIME(stats.write_ns);
+    ZSTAT_ADD(stats.writes, 1);
+
     DWORD bytes;
 
 #ifdef ZIP_STD
@@ -2687,42 +3464,808 @@ unsigned TZip::write(const char *inbuf, unsigned size) {
   return 0;
 }
 
-bool TZip::oseek(unsigned pos) {
+// Makes room in a growable obuf for more than size bytes, at least doubling it
+// so that a zip written in small pieces costs few copies.
+bool TZip::ogrowto(unsigned size) {
+  constexpr unsigned maxsize{~0U};
+
+  if (size < opos || size == maxsize) return false;  // overflowed
+
+  unsigned newsize{mapsize > maxsize / 2 ? maxsize : mapsize * 2};
+  if (newsize <= size) newsize = size + 1;
+
+  auto *newbuf = static_cast<char *>(zaalloc(alloc, newsize));
+  if (!newbuf) return false;
+
+  memcpy(newbuf, obuf, opos > writ ? opos : writ);
+  zafree(alloc, obuf);
+
+  obuf = newbuf;
+  mapsize = newsize;
+  return true;
+}
+
+// Writes size bytes at pos (after ooffset) without moving the file position.
+bool TZip::owriteat(unsigned pos, const char *buf, unsigned size) {
+  ZTRACE_SCOPE("write");
+  ZSTAT_TIME(stats.write_ns);
+  ZSTAT_ADD(stats.writes, 1);
+
+  unsigned long offset{static_cast<unsigned long>(ooffset) + pos};
+
+#ifdef ZIP_STD
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+  // no pwrite here; Close puts the position back at the end
+  if (fseek(hfout, static_cast<long>(offset), SEEK_SET) != 0) return false;
+  if (fwrite(buf, 1, size, hfout) != size) return false;
+
+  return fflush(hfout) == 0;
+#else
+  while (size != 0) {
+    const ssize_t put{
+        pwrite(fileno(hfout), buf, size, static_cast<off_t>(offset))};
+    if (put < 0 && errno == EINTR) continue;
+    if (put <= 0) return false;
+
+    buf += put;
+    size -= static_cast<unsigned>(put);
+    offset += static_cast<unsigned long>(put);
+  }
+
+  return true;
+#endif
+#else
+  while (size != 0) {
+    OVERLAPPED ov = {};
+    ov.Offset = static_cast<DWORD>(offset);
+
+    DWORD put{0};
+    if (!WriteFile(hfout, buf, size, &put, &ov) || put == 0) return false;
+
+    buf += put;
+    size -= put;
+    offset += put;
+  }
+
+  return true;
+#endif
+}
+
+// Reads what's already in a file being appended to.  Positional, like
+// owriteat, so it doesn't matter where the handle was left.
+bool TZip::oreadat(HANDLE h, unsigned long pos, char *buf, unsigned size) {
+#ifdef ZIP_STD
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+  if (fseek(h, static_cast<long>(pos), SEEK_SET) != 0) return false;
+
+  return fread(buf, 1, size, h) == size;
+#else
+  while (size != 0) {
+    const ssize_t got{pread(fileno(h), buf, size, static_cast<off_t>(pos))};
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return false;
+
+    buf += got;
+    size -= static_cast<unsigned>(got);
+    pos += static_cast<unsigned long>(got);
+  }
+
+  return true;
+#endif
+#else
+  while (size != 0) {
+    OVERLAPPED ov = {};
+    ov.Offset = static_cast<DWORD>(pos);
+
+    DWORD got{0};
+    if (!ReadFile(h, buf, size, &got, &ov) || got == 0) return false;
+
+    buf += got;
+    size -= got;
+    pos += got;
+  }
+
+  return true;
+#endif
+}
+
+// Loads the central directory of the zip opened by OpenZipForAppend into
+// zfis, as though its entries had just been added, and sets writ to where the
+// directory started so that new entries overwrite it.
+ZRESULT TZip::ReadCentral() {
+  ZTRACE_SCOPE("read_central_dir");
+
+  unsigned long size;
+#ifdef ZIP_STD
+  if (fseek(hfout, 0, SEEK_END) != 0) return ZR_SEEK;
+
+  const long end{ftell(hfout)};
+  if (end < 0) return ZR_SEEK;
+
+  size = static_cast<unsigned long>(end);
+#else
+  size = GetFileSize(hfout, nullptr);
+  if (size == INVALID_FILE_SIZE) return ZR_SEEK;
+#endif
+
+  // the end record is the last thing in the file, bar a comment of up to 64k
+  constexpr unsigned endsize{4 + ENDHEAD};
+  if (size < endsize) return ZR_CORRUPT;
+
+  const unsigned taillen{
+      static_cast<unsigned>(size < endsize + 0xFFFF ? size : endsize + 0xFFFF)};
+  auto *tail = static_cast<uch *>(zaalloc(alloc, taillen));
+  if (!tail) return ZR_NOALLOC;
+
+  if (!oreadat(hfout, size - taillen, reinterpret_cast<char *>(tail),
+               taillen)) {
+    zafree(alloc, tail);
+    return ZR_READ;
+  }
+
+  const auto sh = [](const uch *p) -> unsigned { return p[0] | (p[1] << 8); };
+  const auto lg = [](const uch *p) -> ulg {
+    return p[0] | (p[1] << 8) | ((ulg)p[2] << 16) | ((ulg)p[3] << 24);
+  };
+
+  const uch *endrec{nullptr};
+  for (unsigned i{taillen - endsize + 1}; i-- > 0;) {
+    const uch *p{tail + i};
+    if (lg(p) == ENDSIG && i + endsize + sh(p + 20) <= taillen) {
+      endrec = p;
+      break;
+    }
+  }
+
+  ZRESULT rc{ZR_OK};
+  ulg count{0}, cdsize{0}, cdoff{0}, endpos{0};
+  if (!endrec) {
+    rc = ZR_CORRUPT;
+  } else {
+    count = sh(endrec + 10);
+    cdsize = lg(endrec + 12);
+    cdoff = lg(endrec + 16);
+    endpos = size - taillen + static_cast<ulg>(endrec - tail);
+
+    // no multi-disk or zip64 archives, nor one pointing past its own end
+    if (sh(endrec + 4) != 0 || sh(endrec + 6) != 0 ||
+        sh(endrec + 8) != count || count == 0xFFFF || cdoff == 0xFFFFFFFF ||
+        cdsize > endpos || cdoff > endpos - cdsize) {
+      rc = ZR_CORRUPT;
+    }
+  }
+
+  if (rc == ZR_OK && (ocomlen = sh(endrec + 20)) != 0) {
+    ocomment = static_cast<char *>(zaalloc(alloc, ocomlen));
+    if (ocomment)
+      memcpy(ocomment, endrec + endsize, ocomlen);
+    else
+      rc = ZR_NOALLOC;
+  }
+
+  zafree(alloc, tail);
+  if (rc != ZR_OK) return rc;
+
+  // Anything before the zip proper (a self-extractor stub, say) shifts every
+  // offset.  Ours count from the start of the file, as for any zip written
+  // after something else, so old entries are moved into line.
+  const ulg bias{endpos - cdsize - cdoff};
+
+  uch *cd{nullptr};
+  if (cdsize != 0) {
+    cd = static_cast<uch *>(zaalloc(alloc, cdsize));
+    if (!cd) return ZR_NOALLOC;
+
+    if (!oreadat(hfout, cdoff + bias, reinterpret_cast<char *>(cd), cdsize)) {
+      zafree(alloc, cd);
+      return ZR_READ;
+    }
+  }
+
+  const uch *p{cd};
+  for (ulg i{0}; i < count && rc == ZR_OK; ++i) {
+    if (static_cast<ulg>(p - cd) + 4 + CENHEAD > cdsize || lg(p) != CENSIG) {
+      rc = ZR_CORRUPT;
+      break;
+    }
+
+    const unsigned nam{sh(p + 28)}, cext{sh(p + 30)}, com{sh(p + 32)};
+    if (static_cast<ulg>(p - cd) + 4 + CENHEAD + nam + cext + com > cdsize ||
+        nam == 0 || nam >= MAX_PATH) {
+      rc = ZR_CORRUPT;
+      break;
+    }
+
+    // a size or offset of all ones is a zip64 entry, whose real value is in
+    // an extra field that this library doesn't read or write
+    if (lg(p + 20) == 0xFFFFFFFF || lg(p + 24) == 0xFFFFFFFF ||
+        lg(p + 42) == 0xFFFFFFFF) {
+      rc = ZR_CORRUPT;
+      break;
+    }
+
+    auto *zfi = zanew<TZipFileInfo>(alloc);
+    if (!zfi) {
+      rc = ZR_NOALLOC;
+      break;
+    }
+
+    zfi->vem = static_cast<ush>(sh(p + 4));
+    zfi->ver = static_cast<ush>(sh(p + 6));
+    zfi->flg = zfi->lflg = static_cast<ush>(sh(p + 8));
+    zfi->how = static_cast<ush>(sh(p + 10));
+    zfi->tim = lg(p + 12);
+    zfi->crc = lg(p + 16);
+    zfi->siz = lg(p + 20);
+    zfi->len = lg(p + 24);
+    zfi->nam = nam;
+    zfi->dsk = static_cast<ush>(sh(p + 34));
+    zfi->att = static_cast<ush>(sh(p + 36));
+    zfi->atx = lg(p + 38);
+    zfi->off = lg(p + 42) + bias;
+    zfi->mark = 1;
+
+    p += 4 + CENHEAD;
+    memcpy(zfi->iname, p, nam);
+    zfi->iname[nam] = 0;
+    p += nam;
+
+    if (cext != 0) zfi->cextra = static_cast<char *>(zaalloc(alloc, cext));
+    if (com != 0) zfi->comment = static_cast<char *>(zaalloc(alloc, com));
+    if ((cext != 0 && !zfi->cextra) || (com != 0 && !zfi->comment)) {
+      zafree(alloc, zfi->cextra);
+      zafree(alloc, zfi->comment);
+      zadelete(alloc, zfi);
+      rc = ZR_NOALLOC;
+      break;
+    }
+
+    if (cext != 0) memcpy(zfi->cextra, p, cext);
+    zfi->cext = cext;
+    p += cext;
+
+    if (com != 0) memcpy(zfi->comment, p, com);
+    zfi->com = com;
+    p += com;
+
+    if (!zfis)
+      zfis = zfi;
+    else
+      zfislast->nxt = zfi;
+
+    zfislast = zfi;
+  }
+
+  zafree(alloc, cd);
+  if (rc != ZR_OK) return rc;
+
+  writ = cdoff + bias;
+  return ZR_OK;
+}
+
+// Rewrites an appended zip without the items ZipDelete marked, into a file
+// beside it, which becomes hfout.  The items kept are copied as they are, a
+// run of neighbours at a time, and only their offsets change.  The original
+// isn't touched, so until Close renames the rewrite over it a failure leaves
+// it as it was.  Nor are the items, until the copy is whole.
+ZRESULT TZip::Compact() {
+  ZTRACE_SCOPE("compact");
+
+  otruncate = false;
+
+  unsigned count{0};
+  for (TZipFileInfo *zfi{zfis}; zfi != nullptr; zfi = zfi->nxt) ++count;
+
+  // Each item runs from its local header up to the next one, so sorting by
+  // offset finds the extent of everything there, descriptors included.
+  auto **byoff = static_cast<TZipFileInfo **>(
+      zaalloc(alloc, (count ? count : 1) * sizeof(TZipFileInfo *)));
+  if (!byoff) return ZR_NOALLOC;
+
+  unsigned i{0};
+  for (TZipFileInfo *zfi{zfis}; zfi != nullptr; zfi = zfi->nxt)
+    byoff[i++] = zfi;
+
+  std::sort(byoff, byoff + count,
+            [](const TZipFileInfo *a, const TZipFileInfo *b) {
+              return a->off < b->off;
+            });
+
+  constexpr TCHAR suffix[]{_T(".tmp")};
+  const size_t fnlen{_tcslen(ofn)};
+  otmpfn = static_cast<TCHAR *>(
+      zaalloc(alloc, fnlen * sizeof(TCHAR) + sizeof(suffix)));
+  if (!otmpfn) {
+    zafree(alloc, byoff);
+    return ZR_NOALLOC;
+  }
+
+  memcpy(otmpfn, ofn, fnlen * sizeof(TCHAR));
+  memcpy(otmpfn + fnlen, suffix, sizeof(suffix));
+
+#ifdef ZIP_STD
+  HANDLE hftmp{fopen(otmpfn, "wb")};
+#else
+  HANDLE hftmp{CreateFile(otmpfn, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL, nullptr)};
+  if (hftmp == INVALID_HANDLE_VALUE) hftmp = nullptr;
+#endif
+  if (!hftmp) {
+    zafree(alloc, otmpfn);
+    otmpfn = nullptr;
+    zafree(alloc, byoff);
+    return ZR_NOFILE;
+  }
+
+  const HANDLE hfold{hfout};
+  hfout = hftmp;
+  wpos = 0;
+
+#if defined(ZIP_STD) && !defined(_MSC_VER) && !defined(__BORLANDC__) && \
+    !defined(__MINGW32__)
+  // the rewrite takes the original's place, so it takes its permissions too
+  struct stat st;
+  if (fstat(fileno(hfold), &st) == 0) fchmod(fileno(hftmp), st.st_mode & 07777);
+#endif
+
+  constexpr unsigned copysize{1U << 20};
+  char *cbuf{static_cast<char *>(zaalloc(alloc, copysize))};
+
+  ZRESULT rc{cbuf ? ZR_OK : ZR_NOALLOC};
+  const auto copy = [&](ulg from, ulg to) {
+    while (rc == ZR_OK && from < to) {
+      const unsigned n{
+          static_cast<unsigned>(to - from < copysize ? to - from : copysize)};
+
+      if (!oreadat(hfold, from, cbuf, n))
+        rc = ZR_READ;
+      else if (!owrite(cbuf, n))
+        rc = oerr;
+
+      from += n;
+    }
+  };
+
+  // whatever precedes the first item (a self-extractor, say) goes too
+  ulg runstart{0};
+  for (i = 0; i < count; ++i) {
+    const TZipFileInfo *zfi{byoff[i]};
+
+    if (zfi->trash) {
+      copy(runstart, zfi->off);
+      runstart = i + 1 < count ? byoff[i + 1]->off : writ;
+    }
+  }
+  copy(runstart, writ);
+
+  zafree(alloc, cbuf);
+
+#ifdef ZIP_STD
+  fclose(hfold);
+#else
+  CloseHandle(hfold);
+#endif
+
+  if (rc != ZR_OK) {
+    zafree(alloc, byoff);
+    return rc;
+  }
+
+  // each item moves back by the size of those deleted ahead of it
+  ulg shift{0};
+  for (i = 0; i < count; ++i) {
+    TZipFileInfo *zfi{byoff[i]};
+    const ulg stop{i + 1 < count ? byoff[i + 1]->off : writ};
+
+    if (zfi->trash)
+      shift += stop - zfi->off;
+    else
+      zfi->off -= shift;
+  }
+
+  zafree(alloc, byoff);
+
+  odeleted = false;
+  writ = wpos;
+
+  TZipFileInfo **link{&zfis};
+  zfislast = nullptr;
+  while (TZipFileInfo *zfi{*link}) {
+    if (zfi->trash) {
+      *link = zfi->nxt;
+
+      zafree(alloc, zfi->cextra);
+      zafree(alloc, zfi->comment);
+      zadelete(alloc, zfi);
+    } else {
+      zfislast = zfi;
+      link = &zfi->nxt;
+    }
+  }
+
+  return ZR_OK;
+}
+
+// Called before the first byte of an item is written.  New items go after
+// the old ones, so any deleted from among those have to be compacted out
+// first.
+ZRESULT TZip::BeginAdding() {
+  oadded = true;
+  if (!odeleted) return ZR_OK;
+
+  const ZRESULT rc{Compact()};
+  if (rc != ZR_OK) oerr = rc;
+
+  return rc;
+}
+
+ZRESULT TZip::Delete(const TCHAR *odstzn) {
+  if (odstzn == nullptr) return ZR_ARGS;
+  if (oerr) return ZR_FAILED;
+  if (hasputcen) return ZR_ENDED;
+  if (!ofn || oadded) return ZR_ZMODE;
+
+  char iname[MAX_PATH];
+  const size_t nam{ZipName(odstzn, iname)};
+  if (nam == 0) return ZR_ARGS;
+
+  // a folder matches with or without its trailing slash
+  bool found{false};
+  for (TZipFileInfo *zfi{zfis}; zfi != nullptr; zfi = zfi->nxt) {
+    if (!zfi->trash && strncmp(zfi->iname, iname, nam) == 0 &&
+        (zfi->nam == nam ||
+         (zfi->nam == nam + 1 && zfi->iname[nam] == '/'))) {
+      zfi->trash = 1;
+      found = true;
+    }
+  }
+
+  if (!found) return ZR_NOTFOUND;
+
+  odeleted = true;
+  return ZR_OK;
+}
+
+// Appends to a seekable file output, through wbuf when there is one.
+bool TZip::owrite(const char *buf, unsigned size) {
+  if (wbufsize != 0 && wbuf == nullptr) {
+    wbuf = static_cast<char *>(zaalloc(alloc, wbufsize));
+    if (!wbuf) {
+      oerr = ZR_NOALLOC;
+      return false;
+    }
+  }
+
+  if (wbuf && size < wbufsize) {
+    if (wbuflen + size > wbufsize && !oflush()) return false;
+
+    memcpy(wbuf + wbuflen, buf, size);
+    wbuflen += size;
+    wpos += size;
+    return true;
+  }
+
+  // too big to be worth copying
+  if (!oflush()) return false;
+
+  if (!owriteat(wpos, buf, size)) {
+    oerr = ZR_WRITE;
+    return false;
+  }
+
+  wpos += size;
+  return true;
+}
+
+bool TZip::oflush() {
+  if (wbuflen == 0) return true;
+
+  if (!owriteat(wpos - wbuflen, wbuf, wbuflen)) {
+    oerr = ZR_WRITE;
+    return false;
+  }
+
+  wbuflen = 0;
+  return true;
+}
+
+// Overwrites size bytes at pos, which must already have been written: in wbuf
+// if they're still there, otherwise in the file.
+bool TZip::opatch(unsigned pos, const char *buf, unsigned size) {
   if (!ocanseek) {
     oerr = ZR_SEEK;
     return false;
   }
 
   if (obuf) {
-    if (pos >= mapsize) {
+    if (pos + size >= mapsize) {
       oerr = ZR_MEMSIZE;
       return false;
     }
 
-    opos = pos;
+    memcpy(obuf + pos, buf, size);
     return true;
   }
 
   if (hfout) {
-#ifdef ZIP_STD
-    const int res{fseek(hfout, pos + ooffset, SEEK_SET)};
+    if (pos + size > wpos) {
+      oerr = ZR_SEEK;
+      return false;
+    }
 
-    if (res != 0) oerr = ZR_SEEK;
+    const unsigned wbufstart{wpos - wbuflen};
+    if (pos + size > wbufstart) {
+      const unsigned from{pos > wbufstart ? pos : wbufstart};
 
-    return res ? false : true;
-#else
-    const DWORD res{SetFilePointer(hfout, pos + ooffset, nullptr, FILE_BEGIN)};
+      memcpy(wbuf + (from - wbufstart), buf + (from - pos), pos + size - from);
+      size = from - pos;
+    }
 
-    if (res == INVALID_SET_FILE_POINTER) oerr = ZR_SEEK;
+    if (size == 0) return true;
 
-    return oerr == ZR_OK;
-#endif
+    ZSTAT_ADD(stats.seeks, 1);
+
+    if (!owriteat(pos, buf, size)) {
+      oerr = ZR_WRITE;
+      return false;
+    }
+
+    return true;
   }
 
   oerr = ZR_NOTINITED;
   return false;
 }
 
+ZRESULT TZip::SetPipeline(unsigned buffers) {
+  if (buffers > TZipStage::maxslots) buffers = TZipStage::maxslots;
+
+  // slots already allocated are kept; the rings only ever grow
+  pipeslots = buffers;
+  return ZR_OK;
+}
+
+ZRESULT TZip::SetLevel(int level) {
+  if (level < 0 || level > 9) return ZR_ARGS;
+
+  olevel = level;
+  return ZR_OK;
+}
+
+// Starts the helper threads for the entry just opened by BeginEntry, if it's
+// worth it.  Returns false to have Add go on as though there were none.
+bool TZip::pstart(ZipMode flags) {
+  if (pipeslots == 0 || flags == ZIP_FOLDER) return false;
+  if (isize >= 0 && isize < static_cast<long>(TZipPipeline::slotsize))
+    return false;
+
+  const bool reading{hfin != nullptr && bufin == nullptr};
+  const bool writing{hfout != nullptr && obuf == nullptr};
+  if (!reading && !writing) return false;
+
+  if (!pipe) {
+    pipe = zanew<TZipPipeline>(alloc);
+    if (!pipe) return false;
+  }
+
+  for (TZipStage *stage : {&pipe->in, &pipe->out}) {
+    while (stage->count < pipeslots) {
+      char *slot{static_cast<char *>(zaalloc(alloc, TZipPipeline::slotsize))};
+      if (!slot) break;
+
+      stage->slots[stage->count++] = slot;
+    }
+
+    // one slot would leave nothing to overlap
+    if (stage->count < 2) return false;
+
+    stage->reset();
+  }
+
+  pipe->crc = crc;
+  pipe->red = ired;
+  pipe->reading = reading;
+  pipe->writing = writing;
+
+  if (reading) pipe->reader = std::thread{&TZip::preadloop, this};
+  if (writing) pipe->writer = std::thread{&TZip::pwriteloop, this};
+
+  return true;
+}
+
+// Waits for both helpers and takes back what they were looking after.
+ZRESULT TZip::pstop() {
+  bool readfailed{false};
+  bool writefailed{false};
+
+  if (pipe->reading) {
+    {
+      std::lock_guard<std::mutex> lock{pipe->in.mu};
+      pipe->in.stop = true;  // if we gave up before the end
+    }
+    pipe->in.cv.notify_all();
+    pipe->reader.join();
+    pipe->reading = false;
+
+    readfailed = pipe->in.failed;
+    crc = pipe->crc;
+    ired = pipe->red;
+  }
+
+  if (pipe->writing) {
+    {
+      std::lock_guard<std::mutex> lock{pipe->out.mu};
+      if (pipe->out.pos != 0) {  // the last, partly filled slot
+        pipe->out.lens[pipe->out.head] = pipe->out.pos;
+        pipe->out.head = (pipe->out.head + 1) % pipe->out.count;
+        pipe->out.pos = 0;
+        ++pipe->out.full;
+      }
+      pipe->out.done = true;
+    }
+    pipe->out.cv.notify_all();
+    pipe->writer.join();
+    pipe->writing = false;
+
+    writefailed = pipe->out.failed;
+  }
+
+  if (readfailed && oerr == ZR_OK) oerr = ZR_READ;
+  if (writefailed && oerr == ZR_OK) oerr = ZR_WRITE;
+
+  return oerr;
+}
+
+void TZip::preadloop() {
+  TZipStage &in{pipe->in};
+
+  for (;;) {
+    unsigned slot;
+    {
+      std::unique_lock<std::mutex> lock{in.mu};
+      in.cv.wait(lock, [&in] { return in.full < in.count || in.stop; });
+      if (in.stop) return;
+
+      slot = in.head;
+    }
+
+    bool failed{false};
+    const unsigned red{
+        iread(in.slots[slot], TZipPipeline::slotsize, &failed)};
+
+    pipe->red += red;
+    {
+      ZSTAT_TIME(stats.crc_ns);
+      pipe->crc = crc32(pipe->crc, (const uch *)in.slots[slot], red);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock{in.mu};
+      if (failed) {
+        in.failed = true;
+      } else if (red == 0) {
+        in.done = true;
+      } else {
+        in.lens[slot] = red;
+        in.head = (slot + 1) % in.count;
+        ++in.full;
+      }
+    }
+    in.cv.notify_all();
+
+    if (failed || red == 0) return;
+  }
+}
+
+unsigned TZip::pget(char *buf, unsigned size) {
+  TZipStage &in{pipe->in};
+
+  unsigned slot;
+  {
+    ZTRACE_SCOPE("wait_reader");
+
+    std::unique_lock<std::mutex> lock{in.mu};
+    in.cv.wait(lock, [&in] { return in.full != 0 || in.done || in.failed; });
+    if (in.full == 0) return 0;
+
+    slot = in.tail;
+  }
+
+  unsigned red{in.lens[slot] - in.pos};
+  if (red > size) red = size;
+
+  memcpy(buf, in.slots[slot] + in.pos, red);
+  in.pos += red;
+
+  if (in.pos == in.lens[slot]) {
+    {
+      std::lock_guard<std::mutex> lock{in.mu};
+      in.tail = (slot + 1) % in.count;
+      in.pos = 0;
+      --in.full;
+    }
+    in.cv.notify_all();
+  }
+
+  return red;
+}
+
+void TZip::pwriteloop() {
+  TZipStage &out{pipe->out};
+
+  for (;;) {
+    unsigned slot;
+    bool failed;
+    {
+      std::unique_lock<std::mutex> lock{out.mu};
+      out.cv.wait(lock, [&out] { return out.full != 0 || out.done; });
+      if (out.full == 0) return;
+
+      slot = out.tail;
+      failed = out.failed;
+    }
+
+    // after a failure keep draining, so that the caller never waits forever
+    if (!failed && oemit(out.slots[slot], out.lens[slot]) != out.lens[slot])
+      failed = true;
+
+    {
+      std::lock_guard<std::mutex> lock{out.mu};
+      out.tail = (slot + 1) % out.count;
+      out.failed = failed;
+      --out.full;
+    }
+    out.cv.notify_all();
+  }
+}
+
+unsigned TZip::pput(const char *buf, unsigned size) {
+  TZipStage &out{pipe->out};
+  const unsigned wanted{size};
+
+  while (size != 0) {
+    {
+      ZTRACE_SCOPE("wait_writer");
+
+      std::unique_lock<std::mutex> lock{out.mu};
+      out.cv.wait(lock, [&out] { return out.full < out.count; });
+      if (out.failed) return wanted - size;
+    }
+
+    unsigned put{TZipPipeline::slotsize - out.pos};
+    if (put > size) put = size;
+
+    memcpy(out.slots[out.head] + out.pos, buf, put);
+    out.pos += put;
+    buf += put;
+    size -= put;
+
+    if (out.pos == TZipPipeline::slotsize) {
+      {
+        std::lock_guard<std::mutex> lock{out.mu};
+        out.lens[out.head] = out.pos;
+        out.head = (out.head + 1) % out.count;
+        out.pos = 0;
+        ++out.full;
+      }
+      out.cv.notify_all();
+    }
+  }
+
+  return wanted;
+}
+
+ZRESULT TZip::SetBufferSize(unsigned size) {
+  if (!hfout || !ocanseek) return ZR_OK;  // nothing of ours to buffer
+  if (!oflush()) return oerr;
+
+  zafree(alloc, wbuf);
+  wbuf = nullptr;
+  wbufsize = size;
+
+  return ZR_OK;
+}
+
 // When the user calls GetMemory, they're presumably at the end of all their
 // adding.  In any case, we have to add the central directory now, otherwise the
 // memory we tell them won't be complete.
@@ -2745,13 +4288,67 @@ ZRESULT TZip::GetMemory(void **pbuf, unsigned long *plen) {
 }
 
 ZRESULT TZip::Close() {
+  ZTRACE_SCOPE("zip_close");
+
+  // A rewrite that failed, or never got started, is thrown away below
+  // without a directory, leaving the original as it was.  (In place, the
+  // old directory has been written over, so there a directory still goes
+  // after whatever was added before the failure.)
+  const bool rewriting{otmpfn != nullptr || odeleted};
+  ZRESULT rc{rewriting ? oerr : ZR_OK};
+
   // if the directory hadn't already been added through a call to GetMemory,
   // then we do it now
-  ZRESULT rc{!hasputcen ? AddCentral() : ZR_OK};
+  if (!hasputcen && rc == ZR_OK && odeleted) rc = BeginAdding();
+  if (!hasputcen && rc == ZR_OK) rc = AddCentral();
 
   hasputcen = true;
 
+  if (hfout && ocanseek) {
+    if (!oflush() && rc == ZR_OK) rc = ZR_WRITE;
+
+    // an appended zip may now end sooner than the old one did
+    if (otruncate) {
+#ifdef ZIP_STD
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+      const bool cut{_chsize_s(_fileno(hfout), wpos) == 0};
+#else
+      const bool cut{ftruncate(fileno(hfout), static_cast<off_t>(wpos)) == 0};
+#endif
+#else
+      const bool cut{SetFilePointer(hfout, wpos, nullptr, FILE_BEGIN) !=
+                         INVALID_SET_FILE_POINTER &&
+                     SetEndOfFile(hfout)};
+#endif
+      if (!cut && rc == ZR_OK) rc = ZR_WRITE;
+    }
+
+    // positional writes leave the position wherever; put it after the zip,
+    // as a caller writing more to their handle would expect
+#ifdef ZIP_STD
+    if (fseek(hfout, static_cast<long>(ooffset + wpos), SEEK_SET) != 0 &&
+        rc == ZR_OK) {
+      rc = ZR_SEEK;
+    }
+#else
+    if (SetFilePointer(hfout, ooffset + wpos, nullptr, FILE_BEGIN) ==
+            INVALID_SET_FILE_POINTER &&
+        rc == ZR_OK) {
+      rc = ZR_SEEK;
+    }
+#endif
+  }
+
 #ifdef ZIP_STD
+  // a rewrite has to be on disk before it's renamed over the original
+  if (hfout && otmpfn && rc == ZR_OK) {
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+    if (fflush(hfout) != 0 || _commit(_fileno(hfout)) != 0) rc = ZR_WRITE;
+#else
+    if (fflush(hfout) != 0 || fsync(fileno(hfout)) != 0) rc = ZR_WRITE;
+#endif
+  }
+
   if (hfout && mustclosehfout) {
     if (fclose(hfout) && rc == ZR_OK) {
       rc = ZR_WRITE;
@@ -2776,6 +4373,10 @@ ZRESULT TZip::Close() {
     hmapout = nullptr;
   }
 
+  if (hfout && otmpfn && rc == ZR_OK && !FlushFileBuffers(hfout)) {
+    rc = ZR_WRITE;
+  }
+
   if (hfout && mustclosehfout) {
     if (!CloseHandle(hfout) && rc == ZR_OK) {
       rc = ZR_WRITE;
@@ -2785,6 +4386,35 @@ ZRESULT TZip::Close() {
   mustclosehfout = false;
 #endif
 
+  // A failed rewrite is thrown away, leaving the original as it was.  A
+  // failed rename leaves both, since where the rename can't replace a file
+  // the original has already gone by then.
+  if (otmpfn) {
+    if (rc != ZR_OK) {
+#ifdef ZIP_STD
+      remove(otmpfn);
+#else
+      DeleteFile(otmpfn);
+#endif
+    } else {
+#ifdef ZIP_STD
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+      const bool renamed{remove(ofn) == 0 && rename(otmpfn, ofn) == 0};
+#else
+      const bool renamed{rename(otmpfn, ofn) == 0};
+#endif
+#else
+      const bool renamed{MoveFileEx(otmpfn, ofn,
+                                    MOVEFILE_REPLACE_EXISTING |
+                                        MOVEFILE_WRITE_THROUGH) != 0};
+#endif
+      if (!renamed) rc = ZR_WRITE;
+    }
+
+    zafree(alloc, otmpfn);
+    otmpfn = nullptr;
+  }
+
   return rc;
 }
 
@@ -2810,6 +4440,8 @@ ZRESULT TZip::open_file(const TCHAR *fn) {
       return rc;
     }
   }
+
+  map_file();
 #else
   HANDLE hf{CreateFile(
       fn, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
@@ -2830,6 +4462,34 @@ ZRESULT TZip::open_file(const TCHAR *fn) {
   return ZR_OK;
 }
 
+// Large regular files are mapped rather than read, and then served through
+// the same path as ZipAdd from memory: read() copies straight from the page
+// cache into the deflate window and istore() writes from the mapping.  Pipes,
+// devices, small files and anything mmap refuses stay on fread.
+void TZip::map_file() {
+#if !defined(_MSC_VER) && !defined(__BORLANDC__) && !defined(__MINGW32__)
+  constexpr long min_map_size{256 * 1024};
+
+  if (!iseekable || isize < min_map_size) return;
+  // lenin and posin are unsigned, as is every size in a (non-zip64) archive
+  if (static_cast<unsigned long>(isize) > ~0U) return;
+
+  // open_handle rewound hfin, so the mapping starts at the file start too.
+  const size_t len{static_cast<size_t>(isize)};
+  void *map{mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fileno(hfin), 0)};
+  if (map == MAP_FAILED) return;
+
+  // Only a hint: the kernel reads ahead harder and drops pages behind us.
+  madvise(map, len, MADV_SEQUENTIAL);
+
+  imap = map;
+  imaplen = len;
+  bufin = static_cast<const char *>(map);
+  lenin = static_cast<unsigned>(len);
+  posin = 0;
+#endif
+}
+
 ZRESULT TZip::open_handle(HANDLE hf, unsigned len) {
   hfin = nullptr;
   bufin = nullptr;
@@ -2936,6 +4596,33 @@ ZRESULT TZip::open_dir() {
   return ZR_OK;
 }
 
+ZRESULT TZip::open_push(unsigned len) {
+  hfin = nullptr;
+  // read() takes pushed data from here, EntryWrite points it at each piece
+  bufin = "";
+  selfclosehf = false;
+  crc = CRCVAL_INITIAL;
+  csize = 0;
+  ired = 0;
+  lenin = 0;
+  posin = 0;
+  attr = 0x80000000;  // just a normal file
+  isize = -1;         // can't know size until the end
+
+  if (len != 0) isize = len;  // unless we were told explicitly!
+
+  iseekable = false;
+
+  WORD dosdate, dostime;
+  GetNow(&times.atime, &dosdate, &dostime);
+
+  times.mtime = times.atime;
+  times.ctime = times.atime;
+  timestamp = (WORD)dostime | (((DWORD)dosdate) << 16);
+
+  return ZR_OK;
+}
+
 unsigned TZip::sread(TState &s, char *buf, unsigned size) {  // static
   auto *zip = static_cast<TZip *>(s.param);
 
@@ -2943,6 +4630,8 @@ unsigned TZip::sread(TState &s, char *buf, unsigned size) {  // static
 }
 
 unsigned TZip::read(char *inbuf, unsigned size) {
+  ZSTAT_TIME(cbns);
+
   if (bufin != 0) {
     if (posin >= lenin) return 0;  // end of input
 
@@ -2953,31 +4642,30 @@ unsigned TZip::read(char *inbuf, unsigned size) {
 
     posin += red;
     ired += red;
-    crc = crc32(crc, (uch *)inbuf, red);
+    {
+      ZSTAT_TIME(stats.crc_ns);
+      crc = crc32(crc, (uch *)inbuf, red);
+    }
 
     return red;
   }
 
+  if (pipe && pipe->reading) return pget(inbuf, size);
+
   if (hfin != nullptr) {
-    DWORD red;
+    bool failed{false};
+    const unsigned red{iread(inbuf, size, &failed)};
 
-#ifdef ZIP_STD
-    red = (DWORD)fread(inbuf, 1, size, hfin);
-    // If read from pipe may be closed by outside supplier.  It is ok, we
-    // already read what they want.
-    if (red == 0) return 0;
-#else
-    const BOOL ok{ReadFile(hfin, inbuf, size, &red, nullptr)};
-    // if read from pipe may be closed by outside supplier.  It is ok, we
-    // already read what they want.
-    if (!ok && GetLastError() != ERROR_BROKEN_PIPE) {
+    if (failed) {
       oerr = ZR_READ;
       return 0;
     }
-#endif
 
     ired += red;
-    crc = crc32(crc, (uch *)inbuf, red);
+    {
+      ZSTAT_TIME(stats.crc_ns);
+      crc = crc32(crc, (uch *)inbuf, red);
+    }
     return red;
   }
 
@@ -2985,10 +4673,46 @@ unsigned TZip::read(char *inbuf, unsigned size) {
   return 0;
 }
 
+// Reads from hfin, on the reader thread if there is one, so it mustn't touch
+// oerr.
+unsigned TZip::iread(char *inbuf, unsigned size, bool *failed) {
+  ZTRACE_SCOPE("read");
+  ZSTAT_TIME(stats.read_ns);
+  ZSTAT_ADD(stats.reads, 1);
+
+  DWORD red;
+
+#ifdef ZIP_STD
+  red = (DWORD)fread(inbuf, 1, size, hfin);
+  // If read from pipe may be closed by outside supplier.  It is ok, we
+  // already read what they want.
+  (void)failed;
+#else
+  const BOOL ok{ReadFile(hfin, inbuf, size, &red, nullptr)};
+  // if read from pipe may be closed by outside supplier.  It is ok, we
+  // already read what they want.
+  if (!ok && GetLastError() != ERROR_BROKEN_PIPE) {
+    *failed = true;
+    return 0;
+  }
+#endif
+
+  return red;
+}
+
 ZRESULT TZip::iclose() {
   ZRESULT rc{ZR_OK};
 
 #ifdef ZIP_STD
+#if !defined(_MSC_VER) && !defined(__BORLANDC__) && !defined(__MINGW32__)
+  if (imap) {
+    munmap(imap, imaplen);
+    bufin = nullptr;
+  }
+#endif
+  imap = nullptr;
+  imaplen = 0;
+
   if (selfclosehf && hfin) rc = !fclose(hfin) ? ZR_OK : ZR_WRITE;
 
   hfin = nullptr;
@@ -3005,39 +4729,76 @@ ZRESULT TZip::iclose() {
   return mismatch ? ZR_MISSIZE : rc;
 }
 
-ZRESULT TZip::ideflate(TZipFileInfo *zfi) {
-  if (state == nullptr) state = new (std::nothrow) TState();
+ZRESULT TZip::istart(TZipFileInfo *zfi, bool push) {
+  if (state == nullptr) state = zanew<TState>(alloc);
   if (!state) return ZR_NOALLOC;
 
-  // It's a very big object!  500k! We allocate it on the heap, because
+  // It's a very big object!  1.4M! We allocate it on the heap, because
   // PocketPC's stack breaks if we try to put it all on the stack.  It will be
   // deleted lazily.
   state->err = 0;
   state->readfunc = sread;
-  state->flush_outbuf = sflush;
   state->param = this;
-  state->level = 8;
+#ifdef ZU_STATS
+  state->stats = &stats;
+#endif
+  // a pushed entry can be deflated even when storing (see BeginEntry)
+  state->level = olevel != 0 ? olevel : 1;
   state->seekable = iseekable;
   state->err = nullptr;
-  // the following line will make ct_init realise it has to perform the init
-  state->ts.static_dtree[0].dl.len = 0;
   // Thanks to Alvin77 for this crucial fix:
   state->ds.window_size = 0;
+  state->ds.pushing = push;
   //  I think that covers everything that needs to be initted.
   //
   // it used to be just 1024-size, not 16384 as here.
   bi_init(*state, buf, sizeof(buf), 1);
+  otarget();
   ct_init(*state, &zfi->att);
   lm_init(*state, state->level, &zfi->flg);
 
-  csize = deflate(*state);
+  return !state->err ? ZR_OK : ZR_FLATE;
+}
+
+ZRESULT TZip::ideflate(TZipFileInfo *zfi) {
+  const ZRESULT rc{istart(zfi, false)};
+  if (rc != ZR_OK) return rc;
+
+  {
+    ZTRACE_SCOPE("deflate");
+    csize = deflate(*state);
+  }
 
   return !state->err ? ZR_OK : ZR_FLATE;
 }
 
 ZRESULT TZip::istore() {
+  ZTRACE_SCOPE("store");
+
   ulg size{0};
 
+  // A mapped input needn't be copied through buf first.
+  if (imap && bufin) {
+    while (posin < lenin) {
+      unsigned cin{lenin - posin};
+      if (cin > sizeof(buf)) cin = sizeof(buf);
+
+      const char *src{bufin + posin};
+      posin += cin;
+      ired += cin;
+      {
+        ZSTAT_TIME2(stats.crc_ns, cbns);
+        crc = crc32(crc, (const uch *)src, cin);
+      }
+
+      const unsigned cout{write(src, cin)};
+
+      if (cout != cin) return ZR_MISSIZE;
+
+      size += cin;
+    }
+  }
+
   for (;;) {
     const unsigned cin{read(buf, 16384)};
 
@@ -3050,40 +4811,40 @@ ZRESULT TZip::istore() {
     size += cin;
   }
 
-  csize = size;
+  // cumulative, since a pushed entry is stored a piece at a time
+  csize += size;
   return ZR_OK;
 }
 
 thread_local bool has_seeded{false};
 
-ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
+ZRESULT TZip::BeginEntry(const TCHAR *odstzn, void *src, unsigned len,
+                         ZipMode flags) {
   if (odstzn == nullptr) return ZR_ARGS;
   if (oerr) return ZR_FAILED;
   if (hasputcen) return ZR_ENDED;
+  if (inentry) return ZR_ARGS;
 
   // if we use password encryption, then every isize and csize is 12 bytes
   // bigger
-  int passex{0};
-  if (password && flags != ZIP_FOLDER) passex = 12;
+  entrypassex = 0;
+  if (password && flags != ZIP_FOLDER) entrypassex = 12;
 
   // zip has its own notion of what its names should look like: i.e.
   // dir/file.stuff
-  TCHAR dstzn[MAX_PATH];
-  _tcsncpy(dstzn, odstzn, std::size(dstzn) - 1);
-  dstzn[std::size(dstzn) - 1] = 0;
-
-  if (*dstzn == 0) return ZR_ARGS;
-
-  TCHAR *d{dstzn};
-  while (*d != 0) {
-    if (*d == '\\') *d = '/';
-
-    ++d;
-  }
+  char iname[MAX_PATH];
+  const size_t nam{ZipName(odstzn, iname)};
+  if (nam == 0) return ZR_ARGS;
 
   const bool isdir{flags == ZIP_FOLDER};
-  const bool needs_trailing_slash = (isdir && dstzn[_tcslen(dstzn) - 1] != '/');
-  const ush method{isdir || HasZipSuffix(dstzn) ? STORE : DEFLATE};
+  const bool needs_trailing_slash = (isdir && iname[nam - 1] != '/');
+  ush method{isdir || olevel == 0 || HasZipSuffix(odstzn) ? STORE : DEFLATE};
+
+  // A stored entry of unknown size can only have its header fixed up by
+  // seeking back, so pushed data that can't be is deflated instead.
+  if (flags == ZIP_PUSH && method == STORE && len == 0 &&
+      (!ocanseek || password))
+    method = DEFLATE;
 
   // now open whatever was our input source:
   ZRESULT openres;
@@ -3095,27 +4856,30 @@ ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
     openres = open_mem(src, len);
   else if (flags == ZIP_FOLDER)
     openres = open_dir();
+  else if (flags == ZIP_PUSH)
+    openres = open_push(len);
   else
     return ZR_ARGS;
 
   if (openres != ZR_OK) return openres;
 
+  const ZRESULT addres{BeginAdding()};
+  if (addres != ZR_OK) {
+    iclose();
+    return addres;
+  }
+
   // A zip "entry" consists of a local header (which includes the file name),
   // then the compressed data, and possibly an extended local header.
 
   // Initialize the local header
-  TZipFileInfo zfi = {};
+  TZipFileInfo &zfi{entry};
+  zfi = {};
   zfi.nxt = nullptr;
   zfi.name[0] = 0;
 
-#ifdef UNICODE
-  WideCharToMultiByte(CP_UTF8, 0, dstzn, -1, zfi.iname, MAX_PATH, 0, 0);
-#else
-  strncpy(zfi.iname, dstzn, std::size(zfi.iname) - 1);
-  zfi.iname[std::size(zfi.iname) - 1] = 0;
-#endif
-
-  zfi.nam = strlen(zfi.iname);
+  memcpy(zfi.iname, iname, nam + 1);
+  zfi.nam = nam;
 
   if (needs_trailing_slash && zfi.nam < std::size(zfi.iname) - 1) {
     strcat(zfi.iname, "/");
@@ -3150,22 +4914,26 @@ ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
   zfi.lflg = zfi.flg;  // to be updated later
   zfi.how = method;    // to be updated later
   // to be updated later
-  zfi.siz = (ulg)(method == STORE && isize >= 0 ? isize + passex : 0);
+  zfi.siz = (ulg)(method == STORE && isize >= 0 ? isize + entrypassex : 0);
   zfi.len = (ulg)(isize);  // to be updated later
   zfi.dsk = 0;
   zfi.atx = attr;
   // offset within file of the start of this local record
   zfi.off = writ + ooffset;
 
+  entrymethod = method;
+  entryisdir = isdir;
+
   // stuff the 'times' structure into zfi.extra
 
   // nb. apparently there's a problem with PocketPC CE(zip)->CE(unzip) fails.
   // And removing the following block fixes it up.
-  char xloc[EB_L_UT_SIZE] = {};
+  char *xloc{entryxloc};
+  memset(entryxloc, 0, sizeof(entryxloc));
   zfi.extra = xloc;
   zfi.ext = EB_L_UT_SIZE;
-  char xcen[EB_C_UT_SIZE] = {};
-  zfi.cextra = xcen;
+  memset(entryxcen, 0, sizeof(entryxcen));
+  zfi.cextra = entryxcen;
   zfi.cext = EB_C_UT_SIZE;
   xloc[0] = 'U';
   xloc[1] = 'T';
@@ -3237,34 +5005,35 @@ ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
     return writeres;
   }
 
-  //(2) Write deflated/stored file to zip file
-
   // an object member variable to say whether we write to disk encrypted
   encwriting = password && !isdir;
 
-  if (!isdir && method == DEFLATE)
-    writeres = ideflate(&zfi);
-  else if (!isdir && method == STORE)
-    writeres = istore();
-  else if (isdir)
-    csize = 0;
+  return ZR_OK;
+}
+
+ZRESULT TZip::EndEntry(ZRESULT writeres) {
+  TZipFileInfo &zfi{entry};
+  const bool isdir{entryisdir};
+  const ush method{entrymethod};
 
   encwriting = false;
 
   const ZRESULT closeres{iclose()};
   writ += csize;
+  ZSTAT_ADD(stats.bytes_in, static_cast<unsigned long long>(isize));
 
   if (oerr != ZR_OK) return oerr;
   if (writeres != ZR_OK) return ZR_WRITE;
   if (closeres != ZR_OK) return ZR_WRITE;
 
   // (3) Either rewrite the local header with correct information...
-  const bool first_header_has_size_right{zfi.siz == csize + passex};
+  const bool first_header_has_size_right{zfi.siz == csize + entrypassex};
 
   zfi.crc = crc;
-  zfi.siz = csize + passex;
+  zfi.siz = csize + entrypassex;
   zfi.len = isize;
 
+  int r;
   if (ocanseek && (password == 0 || isdir)) {
     zfi.how = method;
 
@@ -3273,10 +5042,12 @@ ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
 
     zfi.lflg = zfi.flg;
 
-    // rewrite the local header:
-    if (!oseek(zfi.off - ooffset)) return ZR_SEEK;
-    if ((r = putlocal(&zfi, swrite, this)) != ZE_OK) return ZR_WRITE;
-    if (!oseek(writ)) return ZR_SEEK;
+    // rewrite the local header, in place:
+    TZipHeaderPatch patch;
+    patch.len = 0;
+    if ((r = putlocal(&zfi, TZipHeaderPatch::swrite, &patch)) != ZE_OK)
+      return ZR_WRITE;
+    if (!opatch(zfi.off - ooffset, patch.buf, patch.len)) return oerr;
   } else {
     // (4) ... or put an updated header at the end
     if (zfi.how != method) return ZR_NOCHANGE;
@@ -3289,36 +5060,268 @@ ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
 
   if (oerr != ZR_OK) return oerr;
 
-  // Keep a copy of the zipfileinfo, for our end-of-zip directory
-  char *cextra = new (std::nothrow) char[zfi.cext];
-  if (!cextra) {
-    oerr = ZR_NOALLOC;
-    return oerr;
+  return KeepEntry(zfi);
+}
+
+// Keep a copy of the zipfileinfo, for our end-of-zip directory
+ZRESULT TZip::KeepEntry(TZipFileInfo &zfi) {
+  char *cextra{nullptr};
+  if (zfi.cext != 0) {
+    cextra = static_cast<char *>(zaalloc(alloc, zfi.cext));
+    if (!cextra) {
+      oerr = ZR_NOALLOC;
+      return oerr;
+    }
+
+    memcpy(cextra, zfi.cextra, zfi.cext);
   }
 
-  memcpy(cextra, zfi.cextra, zfi.cext);
+  auto *pzfi = zanew<TZipFileInfo>(alloc);
+  if (!pzfi) {
+    zafree(alloc, cextra);
+    return ZR_NOALLOC;
+  }
 
   zfi.cextra = cextra;
 
-  auto *pzfi = new (std::nothrow) TZipFileInfo;
-  if (!pzfi) return ZR_NOALLOC;
-
   memcpy(pzfi, &zfi, sizeof(zfi));
 
   if (!zfis)
     zfis = pzfi;
-  else {
-    TZipFileInfo *z{zfis};
+  else
+    zfislast->nxt = pzfi;
+
+  zfislast = pzfi;
+  ZSTAT_ADD(stats.items, 1);
+
+  return ZR_OK;
+}
+
+ZRESULT TZip::Add(const TCHAR *odstzn, void *src, unsigned len, ZipMode flags) {
+  ZTRACE_SCOPE("zip_add");
+
+  ZRESULT writeres{BeginEntry(odstzn, src, len, flags)};
+  if (writeres != ZR_OK) return writeres;
+
+  const bool piped{pstart(flags)};
+
+  //(2) Write deflated/stored file to zip file
+  {
+    ZSTAT_TIME_LESS(stats.compress_ns, cbns);
+
+    if (flags != ZIP_FOLDER && entrymethod == DEFLATE)
+      writeres = ideflate(&entry);
+    else if (flags != ZIP_FOLDER && entrymethod == STORE)
+      writeres = istore();
+    else
+      csize = 0;
+  }
+
+  if (piped) {
+    const ZRESULT piperes{pstop()};
+    if (writeres == ZR_OK) writeres = piperes;
+  }
+
+  return EndEntry(writeres);
+}
+
+ZRESULT TZip::EntryBegin(const TCHAR *odstzn, unsigned len) {
+  ZTRACE_SCOPE("zip_entry_begin");
 
-    while (z->nxt) z = z->nxt;
+  ZRESULT rc{BeginEntry(odstzn, nullptr, len, ZIP_PUSH)};
+  if (rc != ZR_OK) return rc;
 
-    z->nxt = pzfi;
+  if (entrymethod == DEFLATE) rc = istart(&entry, true);
+  if (rc != ZR_OK) {
+    encwriting = false;
+    iclose();
+    return rc;
   }
 
+  inentry = true;
   return ZR_OK;
 }
 
+ZRESULT TZip::EntryWrite(const void *src, unsigned len) {
+  ZTRACE_SCOPE("zip_entry_write");
+
+  if (!inentry) return ZR_ARGS;
+  if (src == nullptr && len != 0) return ZR_ARGS;
+  if (oerr) return ZR_FAILED;
+
+  // read() hands this straight to the compressor, which copies it into its
+  // window, so there is nothing to buffer here
+  bufin = static_cast<const char *>(src);
+  lenin = len;
+  posin = 0;
+
+  ZRESULT rc{ZR_OK};
+  {
+    ZSTAT_TIME_LESS(stats.compress_ns, cbns);
+
+    if (entrymethod == DEFLATE) {
+      ZTRACE_SCOPE("deflate");
+
+      deflate_push(*state);
+      if (state->err) rc = ZR_FLATE;
+    } else {
+      rc = istore();
+    }
+  }
+
+  bufin = "";
+  lenin = 0;
+  posin = 0;
+
+  if (oerr != ZR_OK) return oerr;
+  return rc;
+}
+
+ZRESULT TZip::EntryEnd() {
+  ZTRACE_SCOPE("zip_entry_end");
+
+  if (!inentry) return ZR_ARGS;
+
+  inentry = false;
+
+  ZRESULT writeres{ZR_OK};
+  if (entrymethod == DEFLATE) {
+    // no more to come, so let the compressor drain its window
+    ZSTAT_TIME_LESS(stats.compress_ns, cbns);
+    ZTRACE_SCOPE("deflate");
+
+    state->ds.pushing = 0;
+    csize = deflate_push(*state);
+    if (state->err) writeres = ZR_FLATE;
+  }
+
+  return EndEntry(writeres);
+}
+
+// Copies an item across from a zip being read, as it is stored there.  Only
+// the headers are written afresh (under a new name, if given); the compressed
+// and maybe encrypted bytes go over untouched.
+ZRESULT TZip::AddRaw(const TCHAR *odstzn, HZIP hzsrc, int index) {
+  if (oerr) return ZR_FAILED;
+  if (hasputcen) return ZR_ENDED;
+  if (inentry) return ZR_ARGS;
+
+  ZIPRAWITEM raw;
+  HZIPITEM item;
+  ZRESULT rc{OpenZipItemRaw(hzsrc, index, &raw, &item)};
+  if (rc != ZR_OK) return rc;
+
+  rc = BeginAdding();
+  if (rc != ZR_OK) {
+    CloseZipItem(item);
+    return rc;
+  }
+
+  rc = CopyRaw(odstzn, raw, item);
+  CloseZipItem(item);
+
+  return rc;
+}
+
+ZRESULT TZip::AddRawItem(const TCHAR *odstzn, const ZIPRAWITEM &raw,
+                         HZIPITEM item) {
+  if (oerr) return ZR_FAILED;
+  if (hasputcen) return ZR_ENDED;
+  if (inentry) return ZR_ARGS;
+
+  const ZRESULT rc{BeginAdding()};
+  if (rc != ZR_OK) return rc;
+
+  return CopyRaw(odstzn, raw, item);
+}
+
+ZRESULT TZip::CopyRaw(const TCHAR *odstzn, const ZIPRAWITEM &raw,
+                      HZIPITEM item) {
+  ZTRACE_SCOPE("zip_add_raw");
+
+  TZipFileInfo zfi = {};
+
+  if (odstzn != nullptr) {
+    zfi.nam = ZipName(odstzn, zfi.iname);
+  } else {
+    static_assert(sizeof(zfi.iname) == sizeof(raw.name));
+    memcpy(zfi.iname, raw.name, sizeof(zfi.iname));
+    zfi.iname[std::size(zfi.iname) - 1] = 0;
+
+    zfi.nam = strlen(zfi.iname);
+  }
+
+  if (zfi.nam == 0) return ZR_ARGS;
+
+  zfi.vem = raw.version;
+  zfi.ver = raw.version_needed;
+  zfi.flg = zfi.lflg = raw.flag;
+  zfi.how = raw.method;
+  zfi.tim = raw.dos_time;
+  zfi.crc = raw.crc;
+  zfi.siz = raw.comp_size;
+  zfi.len = raw.unc_size;
+  zfi.att = raw.internal_attr;
+  zfi.atx = raw.external_attr;
+  // putlocal and KeepEntry only read these
+  zfi.extra = const_cast<char *>(reinterpret_cast<const char *>(raw.extra));
+  zfi.ext = raw.extra_len;
+  zfi.cextra = const_cast<char *>(reinterpret_cast<const char *>(raw.cextra));
+  zfi.cext = raw.cextra_len;
+  zfi.mark = 1;
+  zfi.off = writ + ooffset;
+
+  // The sizes are known, so they go in the local header even if the source
+  // put them after the data.  That flag stays, and so does the descriptor it
+  // promises, since an encrypted item's check byte depends on it.
+  if (putlocal(&zfi, swrite, this) != ZE_OK) return ZR_WRITE;
+
+  writ += 4 + LOCHEAD + (unsigned)zfi.nam + (unsigned)zfi.ext;
+  if (oerr != ZR_OK) return oerr;
+
+  // From here on a failure leaves a half written item, which nothing can
+  // take back out of the zip.
+  for (;;) {
+    unsigned int got;
+    const ZRESULT readres{ReadZipItem(item, buf, sizeof(buf), &got)};
+    if (readres != ZR_OK && readres != ZR_MORE) {
+      oerr = readres;
+      return oerr;
+    }
+
+    if (got != 0 && write(buf, got) != got) {
+      if (oerr == ZR_OK) oerr = ZR_WRITE;
+      return oerr;
+    }
+
+    writ += got;
+
+    if (readres == ZR_OK) break;
+  }
+
+  if (zfi.flg & 8) {
+    if (putextended(&zfi, swrite, this) != ZE_OK) {
+      if (oerr == ZR_OK) oerr = ZR_WRITE;
+      return oerr;
+    }
+
+    writ += 16L;
+  }
+
+  if (oerr != ZR_OK) return oerr;
+
+  return KeepEntry(zfi);
+}
+
 ZRESULT TZip::AddCentral() {  // write central directory
+  ZTRACE_SCOPE("write_central_dir");
+
+  // an entry left open by ZipEntryBegin is finished before the directory
+  if (inentry) {
+    const ZRESULT rc{EntryEnd()};
+    if (rc != ZR_OK) return rc;
+  }
+
   int numentries{0};
   ulg pos_at_start_of_central{writ};
 
@@ -3337,21 +5340,25 @@ ZRESULT TZip::AddCentral() {  // write central directory
 
     TZipFileInfo *zfinext{zfi->nxt};
 
-    delete[] zfi->cextra;
-    delete zfi;
+    zafree(alloc, zfi->cextra);
+    zafree(alloc, zfi->comment);
+    zadelete(alloc, zfi);
 
     zfi = zfinext;
   }
 
+  zfis = nullptr;
+  zfislast = nullptr;
+
   const ulg center_size{writ - pos_at_start_of_central};
 
   if (okay) {
     const int res{putend(numentries, center_size,
-                         pos_at_start_of_central + ooffset, 0, nullptr, swrite,
-                         this)};
+                         pos_at_start_of_central + ooffset, ocomlen, ocomment,
+                         swrite, this)};
     if (res != ZE_OK) okay = false;
 
-    writ += 4 + ENDHEAD + 0;
+    writ += 4 + ENDHEAD + ocomlen;
   }
 
   return okay ? ZR_OK : ZR_WRITE;
@@ -3366,27 +5373,38 @@ struct TZipHandleData {
 thread_local ZRESULT lasterrorZ{ZR_OK};
 
 HZIP CreateZipInternal(void *z, unsigned len, DWORD flags,
-                       const char *password) {
-  auto *zip = new (std::nothrow) TZip(password);
-  if (!zip) return nullptr;
+                       const char *password, const ZALLOCATOR *allocator) {
+  if (allocator &&
+      (allocator->allocate == nullptr || allocator->deallocate == nullptr)) {
+    lasterrorZ = ZR_ARGS;
+    return nullptr;
+  }
+
+  const ZALLOCATOR &alloc{allocator ? *allocator : default_allocator};
+
+  auto *zip = zanew<TZip>(alloc, password, alloc);
+  if (!zip) {
+    lasterrorZ = ZR_NOALLOC;
+    return nullptr;
+  }
 
   ZRESULT rc{zip->oerr};
   if (rc != ZR_OK) {
-    delete zip;
+    zadelete(alloc, zip);
     lasterrorZ = rc;
     return nullptr;
   }
 
   rc = zip->Create(z, len, flags);
   if (rc != ZR_OK) {
-    delete zip;
+    zadelete(alloc, zip);
     lasterrorZ = rc;
     return nullptr;
   }
 
-  auto *han = new (std::nothrow) TZipHandleData;
+  auto *han = zanew<TZipHandleData>(alloc);
   if (!han) {
-    delete zip;
+    zadelete(alloc, zip);
     lasterrorZ = ZR_NOALLOC;
     return nullptr;
   }
@@ -3509,14 +5527,21 @@ size_t FormatZipMessageZ(ZRESULT code, char *buf, size_t len) {
   return mlen;
 }
 
-HZIP CreateZipHandle(HANDLE h, const char *password) {
-  return CreateZipInternal(h, 0, ZIP_HANDLE, password);
+HZIP CreateZipHandle(HANDLE h, const char *password,
+                     const ZALLOCATOR *allocator) {
+  return CreateZipInternal(h, 0, ZIP_HANDLE, password, allocator);
 }
-HZIP CreateZip(const TCHAR *fn, const char *password) {
-  return CreateZipInternal((void *)fn, 0, ZIP_FILENAME, password);
+HZIP CreateZip(const TCHAR *fn, const char *password,
+               const ZALLOCATOR *allocator) {
+  return CreateZipInternal((void *)fn, 0, ZIP_FILENAME, password, allocator);
 }
-HZIP CreateZip(void *z, unsigned len, const char *password) {
-  return CreateZipInternal(z, len, ZIP_MEMORY, password);
+HZIP CreateZip(void *z, unsigned len, const char *password,
+               const ZALLOCATOR *allocator) {
+  return CreateZipInternal(z, len, ZIP_MEMORY, password, allocator);
+}
+HZIP OpenZipForAppend(const TCHAR *fn, const char *password,
+                      const ZALLOCATOR *allocator) {
+  return CreateZipInternal((void *)fn, 0, ZIP_APPEND, password, allocator);
 }
 
 ZRESULT ZipAdd(HZIP hz, const TCHAR *dstzn, const TCHAR *fn) {
@@ -3535,6 +5560,134 @@ ZRESULT ZipAddFolder(HZIP hz, const TCHAR *dstzn) {
   return ZipAddInternal(hz, dstzn, 0, 0, ZIP_FOLDER);
 }
 
+ZRESULT ZipAddRawFromZip(HZIP hz, HZIP hzsrc, int index, const TCHAR *dstzn) {
+  if (hz == nullptr || hzsrc == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->AddRaw(dstzn, hzsrc, index)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT ZipDelete(HZIP hz, const TCHAR *name) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->Delete(name)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT ZipAddRawItem(HZIP hz, HZIPITEM item, const ZIPRAWITEM *raw,
+                      const TCHAR *dstzn) {
+  if (hz == nullptr || item == nullptr || raw == nullptr)
+    return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->AddRawItem(dstzn, *raw, item)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT ZipEntryBegin(HZIP hz, const TCHAR *dstzn) {
+  return ZipEntryBegin(hz, dstzn, 0);
+}
+ZRESULT ZipEntryBegin(HZIP hz, const TCHAR *dstzn, unsigned len) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->EntryBegin(dstzn, len)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT ZipEntryWrite(HZIP hz, const void *buf, unsigned len) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->EntryWrite(buf, len)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT ZipEntryEnd(HZIP hz) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->EntryEnd()};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT SetZipBufferSize(HZIP hz, unsigned int size) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->SetBufferSize(size)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT SetZipPipeline(HZIP hz, unsigned int buffers) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->SetPipeline(buffers)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT SetZipLevel(HZIP hz, int level) {
+  if (hz == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+  TZip *zip{han->zip};
+  const ZRESULT rc{zip->SetLevel(level)};
+
+  return (lasterrorZ = rc);
+}
+
+ZRESULT ZipGetStats(HZIP hz, ZIPSTATS *stats) {
+  if (hz == nullptr || stats == nullptr) return (lasterrorZ = ZR_ARGS);
+
+  auto *han = reinterpret_cast<TZipHandleData *>(hz);
+  if (han->flag != 2) return (lasterrorZ = ZR_ZMODE);
+
+#ifdef ZU_STATS
+  *stats = han->zip->stats;
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+
+  return (lasterrorZ = ZR_OK);
+}
+
 ZRESULT ZipGetMemory(HZIP hz, void **buf, unsigned long *len) {
   if (hz == nullptr) {
     if (buf != nullptr) *buf = nullptr;
@@ -3568,8 +5721,11 @@ ZRESULT CloseZipZ(HZIP hz) {
   TZip *zip{han->zip};
   const ZRESULT rc{zip->Close()};
 
-  delete zip;
-  delete han;
+  // copy, since the allocator lives inside the zip we're about to free
+  const ZALLOCATOR alloc{zip->ualloc};
+
+  zadelete(alloc, zip);
+  zadelete(alloc, han);
 
   return (lasterrorZ = rc);
 }
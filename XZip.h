@@ -101,8 +101,13 @@ using HANDLE = void *;
 
 using DWORD = unsigned long;
 
+// An item of a zip being read raw, for ZipAddRawItem; see XUnzip.h.
+struct ZIPRAWITEM;
+using HZIPITEM = struct HZIPITEM__ *;
+
 #include <cstddef>  // size_t
 
+#include "XZalloc.h"
 #include "XZresult.h"
 
 #if defined(_MSC_VER)
@@ -166,7 +171,10 @@ using DWORD = unsigned long;
 // the zip may not exceed len bytes.  This is a bit friendlier than allocating
 // memory with new[]: it won't lead to fragmentation, and the memory won't be
 // touched unless needed.  That means you can give very large estimates of the
-// maximum-size without too much worry.  As for the password, it lets you
+// maximum-size without too much worry.  Where there is no paging file (the
+// ZIP_STD build) len is only the initial size, and may be 0: the buffer comes
+// from the allocator and grows as the zip does, so ZipGetMemory always hands
+// back one contiguous block.  As for the password, it lets you
 // encrypt every file in the archive.  (This api doesn't support per-file
 // encryption.)
 //
@@ -187,13 +195,52 @@ using DWORD = unsigned long;
 // NOTE: for windows-ce, you cannot close the handle until after CloseZip.  But
 // for real windows, the zip makes its own copy of your handle, so you can close
 // yours anytime.
-ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP CreateZip(const TCHAR *fn,
-                                                     const char *password);
-ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP CreateZip(void *buf,
-                                                     unsigned int len,
-                                                     const char *password);
+//
+// allocator, if given, supplies all the memory the zip uses; see XZalloc.h.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP CreateZip(
+    const TCHAR *fn, const char *password,
+    const ZALLOCATOR *allocator = nullptr);
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP CreateZip(
+    void *buf, unsigned int len, const char *password,
+    const ZALLOCATOR *allocator = nullptr);
 ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP CreateZipHandle(
-    HANDLE h, const char *password);
+    HANDLE h, const char *password, const ZALLOCATOR *allocator = nullptr);
+
+// OpenZipForAppend - opens an existing zip file so that more items can be
+// added to it.
+//
+// The items already there are left where they are.  New ones are written over
+// the old central directory, and CloseZip writes a new directory covering both
+// old and new.  So adding to a big archive costs only the size of what's added
+// and of the directory, not of the whole archive.
+//
+// Returns nullptr (FormatZipMessage(ZR_RECENT) says why) if fn can't be opened
+// for reading and writing, isn't seekable, or isn't a zip this library can
+// write: multi-disk and zip64 archives are refused.  Anything ahead of the
+// zip, such as a self-extractor stub, is kept.  The password applies to the
+// new items only.
+//
+// Until CloseZip returns, the file has no valid directory; if the process dies
+// in between the old items can still be salvaged, but not through OpenZip.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] HZIP OpenZipForAppend(
+    const TCHAR *fn, const char *password,
+    const ZALLOCATOR *allocator = nullptr);
+
+// ZipDelete - removes an item from a zip opened with OpenZipForAppend.
+//
+// name is matched exactly as it's stored in the zip (a folder with or without
+// its trailing slash), and every item of that name goes.  To replace an item,
+// delete it and then add the new one under the same name.  Deleting has to
+// come before adding anything, else ZR_ZMODE; ZR_NOTFOUND if there's nothing
+// of that name.
+//
+// Once anything has been deleted, the zip is rewritten next to the original,
+// as fn with ".tmp" after it, when the first item is added or else at
+// CloseZip.  The items kept are copied across as they are, without being
+// recompressed.  CloseZip then renames the rewrite over the original, so if
+// anything fails before that, the original is left as it was.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipDelete(HZIP hz,
+                                                       const TCHAR *name);
 
 // ZipAdd - call this for each file to be added to the zip.
 //
@@ -228,11 +275,137 @@ ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipAddHandle(HZIP hz,
 ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipAddFolder(HZIP hz,
                                                            const TCHAR *dstzn);
 
+// ZipAddRawFromZip - copies item index of hzsrc, a zip opened with OpenZip,
+// into this one as it is stored there.
+//
+// The compressed bytes are copied verbatim, and so are the crc, sizes, method,
+// times, attributes and extra fields.  An encrypted item stays encrypted with
+// its own password, whatever this zip's is.  Only the name (dstzn, or the
+// original if that's nullptr) and where the item lies are new.  That makes
+// rebuilding a zip with a few items changed cost no more than copying the rest:
+//
+// HZIP hsrc = OpenZip("old.zip",0); HZIP hdst = CreateZip("new.zip",0);
+// for (int i=0; i<n; i++) if (i!=changed) ZipAddRawFromZip(hdst,hsrc,i,0);
+// ZipAdd(hdst,"changed.txt",buf,len);
+//
+// hzsrc can't have been opened through a pipe (ZR_SEEK).  If reading or
+// writing fails part way through the copy, this zip can't be finished.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipAddRawFromZip(
+    HZIP hz, HZIP hzsrc, int index, const TCHAR *dstzn);
+
+// ZipAddRawItem - as ZipAddRawFromZip, but for an item already opened with
+// OpenZipItemRaw, whose details the caller may adjust first.
+//
+// raw is what OpenZipItemRaw filled in.  Its times, attributes, version made
+// by and extra fields can be changed, to give a copy the metadata of another
+// item; the crc, sizes, method and flag describe the bytes copied and must be
+// left alone.  The item is read to its end, and still has to be closed with
+// CloseZipItem afterwards.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipAddRawItem(
+    HZIP hz, HZIPITEM item, const ZIPRAWITEM *raw, const TCHAR *dstzn);
+
+// ZipEntryBegin - start an entry whose data you supply yourself, in pieces.
+//
+// Instead of handing ZipAddHandle a pipe fed by another thread, call
+// ZipEntryBegin, then ZipEntryWrite as many times as you like, then
+// ZipEntryEnd.  Each ZipEntryWrite compresses what it is given before
+// returning, so the buffer can be reused straight away.
+//
+// ZipEntryBegin(hz,"file.dat");
+// while (produce(buf,&n)) ZipEntryWrite(hz,buf,n);
+// ZipEntryEnd(hz);
+//
+// Only one entry can be open at a time, and no ZipAdd calls can be made while
+// it is.  An entry still open when the zip is closed is ended then.  As with
+// ZipAddHandle from a pipe, passing a non-zero len puts the size in the local
+// header up front, and ZipEntryEnd fails if it turns out wrong.  Without it, an
+// entry that would normally be stored (e.g. "x.zip") is deflated instead when
+// the header can't be fixed up afterwards (zip to a pipe, or with password).
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipEntryBegin(HZIP hz,
+                                                            const TCHAR *dstzn);
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipEntryBegin(HZIP hz,
+                                                            const TCHAR *dstzn,
+                                                            unsigned int len);
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipEntryWrite(HZIP hz,
+                                                            const void *buf,
+                                                            unsigned int len);
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipEntryEnd(HZIP hz);
+
+// SetZipBufferSize - how much of a zip being written to a file is gathered in
+// memory before it goes to disk.
+//
+// Local headers that need their sizes filled in afterwards are patched where
+// they lie, in the buffer if still there, without seeking.  The default is
+// 256k; 0 writes everything straight through.  It has no effect on zips written
+// to memory or to pipes, and can be changed at any time.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT SetZipBufferSize(
+    HZIP hz, unsigned int size);
+
+// SetZipPipeline - lets ZipAdd overlap reading, compressing and writing.
+//
+// With buffers non-zero, each later ZipAdd of a file or handle reads ahead on
+// a thread of its own, and a zip going to a file or handle is written out on
+// another, while compression stays on the calling thread.  Each side keeps at
+// most buffers blocks of 256k (up to 16) in flight.  It pays off when the disks
+// are slow; entries smaller than one block, folders, and anything that is in
+// memory on both sides are added as before.  0, the default, turns it off.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT SetZipPipeline(
+    HZIP hz, unsigned int buffers);
+
+// SetZipLevel - how hard later items are compressed.
+//
+// 1 is fastest and 9 smallest; the default is 8.  1 has a simpler matcher of
+// its own, which makes it quicker than 2 but its output a few percent bigger.
+// 0 stores items without compressing them, except that an entry of unknown
+// size begun with ZipEntryBegin is still deflated (at level 1) where its header
+// couldn't be fixed up afterwards.  Items whose names say they're compressed
+// already (".zip", ".gz" and so on) are stored whatever the level.  ZR_ARGS if
+// level is outside 0 to 9.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT SetZipLevel(HZIP hz, int level);
+
+// ZIPSTATS - what a zip handle has done so far, from ZipGetStats.
+//
+// Counts run from CreateZip/OpenZipForAppend and are never reset.  Times are
+// in nanoseconds of wall clock: compress_ns is deflating or storing, without
+// the reading, CRC and writing done on its behalf, which have their own.
+// With SetZipPipeline the reads and writes happen on other threads, so the
+// times overlap rather than add up.
+struct ZIPSTATS {
+  unsigned long long items;      // entries added, raw copies included
+  unsigned long long bytes_in;   // uncompressed bytes read from the sources
+  unsigned long long bytes_out;  // bytes of zip produced
+  unsigned long long reads;      // reads from source files and handles
+  unsigned long long writes;     // writes to the zip file or handle
+  unsigned long long seeks;      // writes back to fix up a local header
+  // Deflate blocks by how flush_block chose to send them.
+  unsigned long long blocks_stored;
+  unsigned long long blocks_static;
+  unsigned long long blocks_dynamic;
+  unsigned long long literals;  // bytes sent as literals
+  // Matches by deflate length code: matches[i] counts codes 257 + i, so
+  // matches[0] is 3 bytes long and matches[28] 258.
+  unsigned long long matches[29];
+  unsigned long long compress_ns;
+  unsigned long long crc_ns;
+  unsigned long long read_ns;
+  unsigned long long write_ns;
+  unsigned long long allocations;  // calls to the allocator, handle excluded
+  unsigned long long allocated;    // bytes they asked for
+};
+
+// ZipGetStats - fills stats in with what the zip has done so far.
+//
+// Cheap enough to call between items.  If the library was built without
+// ZU_ENABLE_STATS every count is 0.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipGetStats(HZIP hz,
+                                                          ZIPSTATS *stats);
+
 // ZipGetMemory - If the zip was created in memory, via ZipCreate(0,len), then
 // this function will return information about that memory block.  Buf will
 // receive a pointer to its start, and len its length.
 //
-// NOTE: you can't add any more after calling this.
+// NOTE: you can't add any more after calling this.  The memory belongs to the
+// zip and stays valid until CloseZip.
 ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT ZipGetMemory(HZIP hz, void **buf,
                                                            unsigned long *len);
 
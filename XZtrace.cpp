@@ -0,0 +1,135 @@
+// Timeline tracing for the zip and unzip functions.  See XZtrace.h.
+
+#include "XZtrace.h"
+
+#ifndef ZIP_STD
+#include <tchar.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+
+namespace {
+
+using TraceScopeFunc = void (*)(void *opaque, const char *name,
+                                unsigned long long start,
+                                unsigned long long duration,
+                                unsigned long thread);
+
+// The sink.  The two halves are set apart, which is why SetZipTraceSink
+// mustn't race with the functions being traced.
+std::atomic<TraceScopeFunc> sinkscope{nullptr};
+std::atomic<void *> sinkopaque{nullptr};
+
+const std::chrono::steady_clock::time_point origin{
+    std::chrono::steady_clock::now()};
+
+std::atomic<unsigned long> lastthread{0};
+
+unsigned long ThreadNumber() {
+  thread_local const unsigned long number{++lastthread};
+  return number;
+}
+
+// The built-in sink, writing Chrome's trace event format.  Each scope is a
+// complete ("X") event, with times in microseconds.
+struct TChromeTrace {
+  std::mutex mu;
+  FILE *f;
+  bool any;  // an event has been written, so the next needs a comma
+};
+
+TChromeTrace chrome;
+
+void ChromeScope(void *opaque, const char *name, unsigned long long start,
+                 unsigned long long duration, unsigned long thread) {
+  auto *trace = static_cast<TChromeTrace *>(opaque);
+
+  std::lock_guard<std::mutex> lock{trace->mu};
+  if (!trace->f) return;  // a scope that ended as StopZipTrace ran
+
+  fputs(trace->any ? ",\n{\"name\":\"" : "\n{\"name\":\"", trace->f);
+  for (const char *c{name}; *c; ++c) {
+    if (*c == '"' || *c == '\\') fputc('\\', trace->f);
+    fputc(*c, trace->f);
+  }
+  fprintf(trace->f,
+          "\",\"cat\":\"zip\",\"ph\":\"X\",\"ts\":%llu.%03llu,"
+          "\"dur\":%llu.%03llu,\"pid\":1,\"tid\":%lu}",
+          start / 1000, start % 1000, duration / 1000, duration % 1000,
+          thread);
+
+  trace->any = true;
+}
+
+}  // namespace
+
+ZRESULT SetZipTraceSink(const ZTRACESINK *sink) {
+  if (sink && !sink->scope) return ZR_ARGS;
+
+  // with the function cleared first, no scope sees the new opaque with the
+  // old function
+  sinkscope.store(nullptr);
+  sinkopaque.store(sink ? sink->opaque : nullptr);
+  sinkscope.store(sink ? sink->scope : nullptr);
+
+  return ZR_OK;
+}
+
+ZRESULT StartZipTrace(const TCHAR *fn) {
+  if (!fn) return ZR_ARGS;
+
+  std::lock_guard<std::mutex> lock{chrome.mu};
+  if (chrome.f) return ZR_ARGS;
+
+#ifdef ZIP_STD
+  chrome.f = fopen(fn, "wb");
+#else
+  chrome.f = _tfopen(fn, _T("wb"));
+#endif
+  if (!chrome.f) return ZR_NOFILE;
+
+  fputs("{\"traceEvents\":[", chrome.f);
+  chrome.any = false;
+
+  const ZTRACESINK sink{ChromeScope, &chrome};
+  return SetZipTraceSink(&sink);
+}
+
+ZRESULT StopZipTrace() {
+  if (sinkscope.load() == ChromeScope) (void)SetZipTraceSink(nullptr);
+
+  std::lock_guard<std::mutex> lock{chrome.mu};
+  if (!chrome.f) return ZR_ARGS;
+
+  fputs("\n]}\n", chrome.f);
+
+  const bool failed{ferror(chrome.f) != 0};
+  const bool closed{fclose(chrome.f) == 0};
+  chrome.f = nullptr;
+
+  return !failed && closed ? ZR_OK : ZR_WRITE;
+}
+
+unsigned long long ZipTraceNow() {
+  return static_cast<unsigned long long>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - origin)
+          .count());
+}
+
+bool ZipTraceEnabled() {
+  return sinkscope.load(std::memory_order_relaxed) != nullptr;
+}
+
+void ZipTraceScope(const char *name, unsigned long long start) {
+  const TraceScopeFunc scope{sinkscope.load(std::memory_order_relaxed)};
+  if (!scope) return;
+
+  const unsigned long long now{ZipTraceNow()};
+
+  scope(sinkopaque.load(std::memory_order_relaxed), name, start,
+        now > start ? now - start : 0, ThreadNumber());
+}
@@ -0,0 +1,73 @@
+// Timeline tracing for the zip and unzip functions.
+//
+// Only there when the library is built with ZU_ENABLE_TRACE (which defines
+// ZU_TRACE).  Without it the trace scopes compile away to nothing.
+//
+// e.g. to see where an hour of zipping went, in chrome://tracing or Perfetto:
+//
+//   StartZipTrace("zip.trace.json");
+//   HZIP hz = CreateZip("big.zip", 0);
+//   ...
+//   CloseZip(hz);
+//   StopZipTrace();
+
+#ifndef ZIP_UTILS_XZTRACE_H_
+#define ZIP_UTILS_XZTRACE_H_
+
+#include "XZip.h"
+
+#ifdef ZU_TRACE
+
+// ZTRACESINK - where the zip and unzip functions report what they spend time
+// on.
+//
+// scope is called as each traced stretch of work ends, on the thread that did
+// it, so it must be safe to call from several threads at once.  name is a
+// static string saying what it was: "zip_add", "deflate", "flush_block",
+// "write", "unzip_item", "inflate", "read" and so on.  start is when it began,
+// in nanoseconds by ZipTraceNow, and duration how long it took.  thread
+// numbers the calling thread, from 1.  Scopes nest, and the inner ones are
+// reported first.
+struct ZTRACESINK {
+  void (*scope)(void *opaque, const char *name, unsigned long long start,
+                unsigned long long duration, unsigned long thread);
+  void *opaque;
+};
+
+// SetZipTraceSink - sends every trace scope, from every handle, to sink.
+//
+// nullptr stops tracing.  The sink is copied.  Change it only while no other
+// thread is inside the zip functions.  ZR_ARGS if sink has no scope.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT SetZipTraceSink(
+    const ZTRACESINK *sink);
+
+// StartZipTrace - traces into the file fn as Chrome trace event JSON, until
+// StopZipTrace.
+//
+// This replaces any sink set before.  ZR_ARGS if a trace file is already being
+// written, and ZR_NOFILE if fn can't be created.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT StartZipTrace(const TCHAR *fn);
+
+// StopZipTrace - stops tracing, finishes off the file and closes it.
+//
+// ZR_ARGS if StartZipTrace wasn't called, and ZR_WRITE if the file couldn't be
+// written.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] ZRESULT StopZipTrace();
+
+// ZipTraceNow - the trace clock: nanoseconds since the library was loaded.
+// Steady, and the same on every thread.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] unsigned long long ZipTraceNow();
+
+// ZipTraceEnabled - whether there's a sink, so that callers needn't read the
+// clock for nothing.
+ZU_ZIP_ATTRIBUTE_SHARED [[nodiscard]] bool ZipTraceEnabled();
+
+// ZipTraceScope - reports work of your own, begun at start (by ZipTraceNow)
+// and ending now, to the sink, in among the zip functions' own scopes.  name
+// must stay valid as long as the sink needs it.
+ZU_ZIP_ATTRIBUTE_SHARED void ZipTraceScope(const char *name,
+                                           unsigned long long start);
+
+#endif  // ZU_TRACE
+
+#endif  // ZIP_UTILS_XZTRACE_H_
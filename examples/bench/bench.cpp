@@ -0,0 +1,517 @@
+﻿// This program measures how fast zips are made and read, how well they
+// compress, and how much memory that takes, for a set of generated corpora at
+// several levels and through each way in and out of the library.
+//
+// zip-utils-bench [-l levels] [-c corpora] [-p paths] [-s scale] [-r repeats]
+//                 [-d dir]
+//
+// levels is a comma separated list (default 1,6,8,9), as are corpora (text,
+// json, binary, compressed, tiny, huge) and paths (memory, file, handle); all
+// by default.  scale multiplies the corpus sizes (1 is about 26 MB in all),
+// the best of repeats runs is reported, and dir is where the files for the
+// file and handle paths go (default /tmp).  The corpora are generated from a
+// fixed seed for each, so every run, every version of the library and every
+// toolchain sees the same bytes.
+//
+// Results are printed one JSON object per line: first a header with the
+// library version, then one line per corpus, level and path with the sizes,
+// the ratio, zip and unzip throughput in MB/s of uncompressed data, and the
+// peak resident set size of each phase in KiB.  Only ZIP_STD builds are
+// supported.
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "../bench_utils.h"
+#include "XUnzip.h"
+#include "XZip.h"
+
+#ifndef ZU_BENCH_VERSION_STRING
+#define ZU_BENCH_VERSION_STRING "unknown"
+#endif
+
+using namespace zu_utils::examples;
+
+namespace {
+
+struct Item {
+  std::string name;
+  std::string data;
+};
+
+struct Corpus {
+  const char *name;
+  std::vector<Item> items;
+  size_t bytes{0};
+};
+
+const std::vector<std::string> &Words() {
+  static const std::vector<std::string> words{[] {
+    static const char *const syllables[]{"a",  "ka", "to", "re", "mi", "su",
+                                         "lo", "ne", "the", "in", "ing", "or",
+                                         "ex", "pro", "al", "de", "com", "ti"};
+    Random rng{42};
+    std::vector<std::string> w;
+    for (unsigned i{0}; i < 1000; ++i) {
+      std::string word;
+      const unsigned n{1 + rng.Below(3)};
+      for (unsigned j{0}; j < n; ++j)
+        word += syllables[rng.Below(std::size(syllables))];
+      w.push_back(word);
+    }
+    return w;
+  }()};
+
+  return words;
+}
+
+void AppendText(Random &rng, std::string &out, size_t size) {
+  const std::vector<std::string> &words{Words()};
+
+  while (out.size() < size) {
+    const unsigned n{6 + rng.Below(10)};
+    for (unsigned i{0}; i < n; ++i) {
+      if (i != 0) out += ' ';
+      out += words[rng.Skewed(static_cast<unsigned>(words.size()))];
+    }
+    out += rng.Below(8) == 0 ? ".\n\n" : ".\n";
+  }
+
+  out.resize(size);
+}
+
+void AppendJson(Random &rng, std::string &out, size_t size) {
+  const std::vector<std::string> &words{Words()};
+  char line[256];
+
+  for (unsigned id{1}; out.size() < size; ++id) {
+    snprintf(line, sizeof(line),
+             "{\"id\":%u,\"user\":\"%s%u\",\"active\":%s,\"score\":%u.%02u,"
+             "\"tags\":[\"%s\",\"%s\"]}\n",
+             id, words[rng.Skewed(100)].c_str(), rng.Below(10000),
+             rng.Below(2) ? "true" : "false", rng.Below(1000), rng.Below(100),
+             words[rng.Skewed(50)].c_str(), words[rng.Skewed(50)].c_str());
+    out += line;
+  }
+
+  out.resize(size);
+}
+
+// Records of a slowly changing measurement, as a sensor log might hold.
+void AppendBinary(Random &rng, std::string &out, size_t size) {
+  uint32_t time{1700000000};
+  int32_t value{0};
+
+  while (out.size() < size) {
+    time += 1 + rng.Below(3);
+    value += static_cast<int32_t>(rng.Below(64)) - 32;
+
+    const uint32_t record[4]{time, static_cast<uint32_t>(value),
+                             rng.Below(4), static_cast<uint32_t>(rng.Next())};
+    out.append(reinterpret_cast<const char *>(record), sizeof(record));
+  }
+
+  out.resize(size);
+}
+
+// Stands in for data already compressed: no redundancy at all.
+void AppendRandom(Random &rng, std::string &out, size_t size) {
+  while (out.size() < size) {
+    const uint64_t v{rng.Next()};
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+
+  out.resize(size);
+}
+
+// 64-bit FNV-1a of s.  Unlike std::hash, it's the same with every standard
+// library, so each corpus gets the same seed everywhere.
+uint64_t Fnv1a(const std::string &s) {
+  uint64_t h{0xCBF29CE484222325ULL};
+  for (const char c : s) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+Corpus MakeCorpus(const std::string &name, double scale) {
+  Corpus c;
+  Random rng{0x5EED ^ Fnv1a(name)};
+  const auto scaled = [scale](double mb) {
+    return static_cast<size_t>(mb * scale * 1024 * 1024);
+  };
+
+  if (name == "text") {
+    c.name = "text";
+    c.items.push_back({"text.txt", {}});
+    AppendText(rng, c.items.back().data, scaled(2));
+  } else if (name == "json") {
+    c.name = "json";
+    c.items.push_back({"records.json", {}});
+    AppendJson(rng, c.items.back().data, scaled(2));
+  } else if (name == "binary") {
+    c.name = "binary";
+    c.items.push_back({"sensor.dat", {}});
+    AppendBinary(rng, c.items.back().data, scaled(2));
+  } else if (name == "compressed") {
+    c.name = "compressed";
+    c.items.push_back({"photo.raw", {}});
+    AppendRandom(rng, c.items.back().data, scaled(2));
+  } else if (name == "tiny") {
+    c.name = "tiny";
+    const unsigned count{static_cast<unsigned>(2000 * scale) + 1};
+    char fn[64];
+    for (unsigned i{0}; i < count; ++i) {
+      snprintf(fn, sizeof(fn), "tiny/%03u/%05u.txt", i / 100, i);
+      c.items.push_back({fn, {}});
+      AppendText(rng, c.items.back().data, 64 + rng.Below(960));
+    }
+  } else if (name == "huge") {
+    // one file mixing all of the above, in 64k runs
+    c.name = "huge";
+    c.items.push_back({"huge.bin", {}});
+    std::string &data{c.items.back().data};
+    const size_t size{scaled(16)};
+    while (data.size() < size) {
+      const size_t run{data.size() + 65536};
+      switch (rng.Below(4)) {
+        case 0:
+          AppendText(rng, data, run);
+          break;
+        case 1:
+          AppendJson(rng, data, run);
+          break;
+        case 2:
+          AppendBinary(rng, data, run);
+          break;
+        default:
+          AppendRandom(rng, data, run);
+          break;
+      }
+    }
+    data.resize(size);
+  } else {
+    c.name = nullptr;
+  }
+
+  for (const Item &item : c.items) c.bytes += item.data.size();
+  return c;
+}
+
+// The peak resident set size since the last call, in KiB.  Linux can reset
+// the peak (clear_refs); elsewhere it only ever grows.
+long PeakRss() {
+  long kb{-1};
+
+  if (FILE *f{fopen("/proc/self/status", "r")}) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, "VmHWM:", 6) == 0) kb = atol(line + 6);
+    }
+    fclose(f);
+  }
+
+  if (kb < 0) {
+    rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) kb = ru.ru_maxrss;
+  }
+
+  if (FILE *f{fopen("/proc/self/clear_refs", "w")}) {
+    fputs("5", f);
+    fclose(f);
+  }
+
+  return kb;
+}
+
+struct Result {
+  bool ok{true};
+  unsigned long zipped{0};
+  double zipsecs{0}, unzipsecs{0};
+  long ziprss{0}, unziprss{0};
+};
+
+// What a zip made in memory is read back from.
+struct MemoryZip {
+  HZIP hz{nullptr};
+  void *buf{nullptr};
+  unsigned long len{0};
+};
+
+bool Check(ZRESULT rc, const char *what) {
+  if (rc == ZR_OK) return true;
+
+  char text[256];
+  FormatZipMessage(rc, text, sizeof(text));
+  fprintf(stderr, "* %s: %s\n", what, text);
+  return false;
+}
+
+// Writes the corpus out as files, for the file and handle paths to read.
+bool WriteInputs(const Corpus &c, const std::string &dir) {
+  for (const Item &item : c.items) {
+    const std::string fn{dir + "/" + item.name};
+
+    for (size_t slash{fn.find('/', dir.size() + 1)};
+         slash != std::string::npos; slash = fn.find('/', slash + 1)) {
+      mkdir(fn.substr(0, slash).c_str(), 0755);
+    }
+
+    FILE *f{fopen(fn.c_str(), "wb")};
+    if (!f) return false;
+
+    const bool ok{fwrite(item.data.data(), 1, item.data.size(), f) ==
+                  item.data.size()};
+    if (fclose(f) != 0 || !ok) return false;
+  }
+
+  return true;
+}
+
+Result RunMemory(const Corpus &c, int level) {
+  Result r;
+  size_t biggest{0};
+  for (const Item &item : c.items)
+    biggest = item.data.size() > biggest ? item.data.size() : biggest;
+  std::vector<char> out(biggest + 1);
+
+  PeakRss();
+  double start{Now()};
+
+  MemoryZip mz;
+  mz.hz = CreateZip(static_cast<void *>(nullptr), 0, nullptr);
+  r.ok = mz.hz && Check(SetZipLevel(mz.hz, level), "level");
+  for (const Item &item : c.items) {
+    if (!r.ok) break;
+
+    r.ok = Check(ZipAdd(mz.hz, item.name.c_str(),
+                        const_cast<char *>(item.data.data()),
+                        static_cast<unsigned>(item.data.size())),
+                 item.name.c_str());
+  }
+  if (r.ok) r.ok = Check(ZipGetMemory(mz.hz, &mz.buf, &mz.len), "memory");
+
+  r.zipsecs = Now() - start;
+  r.ziprss = PeakRss();
+  r.zipped = mz.len;
+
+  start = Now();
+  HZIP hz{r.ok ? OpenZip(mz.buf, static_cast<unsigned>(mz.len), nullptr)
+               : nullptr};
+  r.ok = r.ok && hz;
+  for (size_t i{0}; r.ok && i < c.items.size(); ++i) {
+    r.ok = Check(UnzipItem(hz, static_cast<int>(i), out.data(),
+                           static_cast<unsigned>(out.size())),
+                 c.items[i].name.c_str());
+  }
+  if (hz) (void)CloseZip(hz);
+
+  r.unzipsecs = Now() - start;
+  r.unziprss = PeakRss();
+
+  if (mz.hz) (void)CloseZip(mz.hz);
+  return r;
+}
+
+Result RunFile(const Corpus &c, int level, const std::string &in,
+               const std::string &work, bool handles) {
+  Result r;
+  const std::string zfn{work + "/bench.zip"};
+  const std::string outfn{work + "/item.out"};
+  const std::string outdir{work + "/out"};
+  mkdir(outdir.c_str(), 0755);
+
+  PeakRss();
+  double start{Now()};
+
+  FILE *zf{handles ? fopen(zfn.c_str(), "wb") : nullptr};
+  HZIP hz{handles ? (zf ? CreateZipHandle(zf, nullptr) : nullptr)
+                  : CreateZip(zfn.c_str(), nullptr)};
+  r.ok = hz && Check(SetZipLevel(hz, level), "level");
+  for (const Item &item : c.items) {
+    if (!r.ok) break;
+
+    const std::string fn{in + "/" + item.name};
+    if (handles) {
+      FILE *f{fopen(fn.c_str(), "rb")};
+      r.ok = f && Check(ZipAddHandle(hz, item.name.c_str(), f), fn.c_str());
+      if (f) fclose(f);
+    } else {
+      r.ok = Check(ZipAdd(hz, item.name.c_str(), fn.c_str()), fn.c_str());
+    }
+  }
+  if (hz && !Check(CloseZip(hz), zfn.c_str())) r.ok = false;
+  if (zf && fclose(zf) != 0) r.ok = false;
+
+  r.zipsecs = Now() - start;
+  r.ziprss = PeakRss();
+
+  struct stat st;
+  r.zipped = stat(zfn.c_str(), &st) == 0 ? st.st_size : 0;
+
+  start = Now();
+  zf = handles && r.ok ? fopen(zfn.c_str(), "rb") : nullptr;
+  hz = !r.ok     ? nullptr
+       : handles ? (zf ? OpenZipHandle(zf, nullptr) : nullptr)
+                 : OpenZip(zfn.c_str(), nullptr);
+  r.ok = r.ok && hz;
+  if (r.ok && !handles)
+    r.ok = Check(SetUnzipBaseDir(hz, outdir.c_str()), "dir");
+
+  ZIPENTRY ze;
+  for (size_t i{0}; r.ok && i < c.items.size(); ++i) {
+    const int index{static_cast<int>(i)};
+    if (handles) {
+      FILE *f{fopen(outfn.c_str(), "wb")};
+      r.ok = f && Check(UnzipItemHandle(hz, index, f), outfn.c_str());
+      if (f && fclose(f) != 0) r.ok = false;
+    } else {
+      r.ok = Check(GetZipItem(hz, index, &ze), "item") &&
+             Check(UnzipItem(hz, index, ze.name), ze.name);
+    }
+  }
+  if (hz) (void)CloseZip(hz);
+  if (zf) fclose(zf);
+
+  r.unzipsecs = Now() - start;
+  r.unziprss = PeakRss();
+
+  return r;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::vector<std::string> levels{"1", "6", "8", "9"};
+  std::vector<std::string> corpora{"text", "json",       "binary",
+                                   "compressed", "tiny", "huge"};
+  std::vector<std::string> paths{"memory", "file", "handle"};
+  double scale{1};
+  int repeats{1};
+  std::string dir{"/tmp"};
+
+  for (int i{1}; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      fprintf(stderr,
+              "usage: zip-utils-bench [-l levels] [-c corpora] [-p paths] "
+              "[-s scale] [-r repeats] [-d dir]\n");
+      return 2;
+    }
+
+    if (strcmp(argv[i], "-l") == 0)
+      levels = Split(argv[i + 1]);
+    else if (strcmp(argv[i], "-c") == 0)
+      corpora = Split(argv[i + 1]);
+    else if (strcmp(argv[i], "-p") == 0)
+      paths = Split(argv[i + 1]);
+    else if (strcmp(argv[i], "-s") == 0)
+      scale = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "-r") == 0)
+      repeats = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-d") == 0)
+      dir = argv[i + 1];
+    else
+      i = argc - 1;  // to the usage message
+  }
+
+  if (scale <= 0 || repeats < 1) {
+    fprintf(stderr, "* scale and repeats must be positive\n");
+    return 2;
+  }
+
+  std::string work{dir + "/zip-utils-bench.XXXXXX"};
+  if (!mkdtemp(work.data())) {
+    fprintf(stderr, "* can't make a directory in %s\n", dir.c_str());
+    return 1;
+  }
+
+  printf("{\"bench\":\"zip-utils-bench\",\"version\":\"%s\",\"scale\":%g,"
+         "\"repeats\":%d}\n",
+         ZU_BENCH_VERSION_STRING, scale, repeats);
+  fflush(stdout);
+
+  bool ok{true};
+  for (const std::string &cname : corpora) {
+    const Corpus c{MakeCorpus(cname, scale)};
+    if (!c.name) {
+      fprintf(stderr, "* no corpus %s\n", cname.c_str());
+      ok = false;
+      continue;
+    }
+
+    const std::string in{work + "/in"};
+    mkdir(in.c_str(), 0755);
+    if (!WriteInputs(c, in)) {
+      fprintf(stderr, "* can't write the %s corpus to %s\n", c.name,
+              in.c_str());
+      ok = false;
+      break;
+    }
+
+    for (const std::string &lname : levels) {
+      const int level{atoi(lname.c_str())};
+
+      for (const std::string &path : paths) {
+        Result best;
+        for (int rep{0}; rep < repeats; ++rep) {
+          Result r;
+          if (path == "memory")
+            r = RunMemory(c, level);
+          else if (path == "file" || path == "handle")
+            r = RunFile(c, level, in, work, path == "handle");
+          else
+            r.ok = false;
+
+          if (!r.ok) {
+            best = r;
+            break;
+          }
+
+          if (rep == 0 || r.zipsecs < best.zipsecs) {
+            best.zipsecs = r.zipsecs;
+            best.ziprss = r.ziprss;
+          }
+          if (rep == 0 || r.unzipsecs < best.unzipsecs) {
+            best.unzipsecs = r.unzipsecs;
+            best.unziprss = r.unziprss;
+          }
+          best.zipped = r.zipped;
+        }
+
+        if (!best.ok) {
+          fprintf(stderr, "* %s at level %d through %s failed\n", c.name,
+                  level, path.c_str());
+          ok = false;
+          continue;
+        }
+
+        const double mb{static_cast<double>(c.bytes) / 1e6};
+        printf("{\"corpus\":\"%s\",\"level\":%d,\"path\":\"%s\","
+               "\"items\":%zu,\"bytes\":%zu,\"zipped\":%lu,\"ratio\":%.4f,"
+               "\"zip_mbps\":%.2f,\"unzip_mbps\":%.2f,\"zip_rss_kb\":%ld,"
+               "\"unzip_rss_kb\":%ld}\n",
+               c.name, level, path.c_str(), c.items.size(), c.bytes,
+               best.zipped,
+               c.bytes ? static_cast<double>(best.zipped) / c.bytes : 0.0,
+               best.zipsecs > 0 ? mb / best.zipsecs : 0.0,
+               best.unzipsecs > 0 ? mb / best.unzipsecs : 0.0, best.ziprss,
+               best.unziprss);
+        fflush(stdout);
+      }
+    }
+
+    RemoveTree(in);
+  }
+
+  RemoveTree(work);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+﻿#ifndef ZU_UTILS_EXAMPLES_BENCH_UTILS_H_
+#define ZU_UTILS_EXAMPLES_BENCH_UTILS_H_
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace zu_utils::examples {
+
+// splitmix64, so that generated data is the same everywhere
+class Random {
+ public:
+  explicit Random(uint64_t seed) noexcept : state_{seed} {}
+
+  uint64_t Next() noexcept {
+    uint64_t z{state_ += 0x9E3779B97F4A7C15ULL};
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // Below n, favouring small values, roughly as word frequencies do.
+  unsigned Skewed(unsigned n) noexcept {
+    const double u{static_cast<double>(Next() >> 11) / 9007199254740992.0};
+    return static_cast<unsigned>(u * u * u * n);
+  }
+
+  unsigned Below(unsigned n) noexcept {
+    return static_cast<unsigned>(Next() % n);
+  }
+
+ private:
+  uint64_t state_;
+};
+
+// Seconds, from some fixed point.
+inline double Now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline std::vector<std::string> Split(const char *list) {
+  std::vector<std::string> parts;
+  std::string part;
+  for (const char *p{list};; ++p) {
+    if (*p == ',' || *p == 0) {
+      if (!part.empty()) parts.push_back(part);
+      part.clear();
+      if (*p == 0) break;
+    } else {
+      part += *p;
+    }
+  }
+  return parts;
+}
+
+inline int RemoveEntry(const char *path, const struct stat *, int, FTW *) {
+  return remove(path);
+}
+
+// Removes dir and everything in it.
+inline void RemoveTree(const std::string &dir) {
+  nftw(dir.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+}  // namespace zu_utils::examples
+
+#endif  // ZU_UTILS_EXAMPLES_BENCH_UTILS_H_
@@ -0,0 +1,295 @@
+﻿// This program measures the per-item operations on a zip with very many
+// items: opening it, listing it, looking items up and extracting small ones.
+//
+// zip-utils-metabench [-n items] [-o ops] [-r repeats] [-z zip] [-d dir]
+//
+// Unless given a zip to use (-z), it first makes one in dir (default /tmp) of
+// items (default 100000) small files, a thousand to a folder, and removes it
+// afterwards.  Then it times, one call at a time:
+//
+//   open        OpenZip, repeats times (default 5)
+//   enumerate   GetZipItem on every item in order
+//   get_random  GetZipItem on ops items (default 200) in random order
+//   find_hit    FindZipItem of ops names that are there, case sensitive
+//   find_hit_ic the same names in upper case, case insensitive
+//   find_miss   FindZipItem of ops names that aren't there
+//   find_miss_ic the same, case insensitive
+//   unzip_random UnzipItem of ops items in random order, into memory
+//
+// Each prints one JSON object on a line of its own, with the number of calls
+// and their latency in microseconds: mean, 50th, 90th, 99th and 99.9th
+// percentiles and the maximum.  Names and the random order come from a fixed
+// seed.  Only ZIP_STD builds are supported.
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../bench_utils.h"
+#include "XUnzip.h"
+#include "XZip.h"
+
+#ifndef ZU_BENCH_VERSION_STRING
+#define ZU_BENCH_VERSION_STRING "unknown"
+#endif
+
+using namespace zu_utils::examples;
+
+namespace {
+
+// Latencies of one operation, in seconds.
+class Timings {
+ public:
+  explicit Timings(const char *op) : op_{op} {}
+
+  template <typename F>
+  [[nodiscard]] bool Time(F &&call) {
+    const double start{Now()};
+    const bool ok{call()};
+    samples_.push_back(Now() - start);
+    return ok;
+  }
+
+  void Print() {
+    if (samples_.empty()) return;
+
+    std::sort(samples_.begin(), samples_.end());
+
+    double total{0};
+    for (double s : samples_) total += s;
+
+    const auto at = [this](double q) {
+      const size_t i{static_cast<size_t>(q * (samples_.size() - 1) + 0.5)};
+      return samples_[i] * 1e6;
+    };
+
+    printf("{\"op\":\"%s\",\"calls\":%zu,\"mean_us\":%.3f,\"p50_us\":%.3f,"
+           "\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}"
+           "\n",
+           op_, samples_.size(), total / samples_.size() * 1e6, at(0.5),
+           at(0.9), at(0.99), at(0.999), samples_.back() * 1e6);
+    fflush(stdout);
+  }
+
+ private:
+  const char *op_;
+  std::vector<double> samples_;
+};
+
+bool Check(ZRESULT rc, const char *what) {
+  if (rc == ZR_OK) return true;
+
+  char text[256];
+  FormatZipMessage(rc, text, sizeof(text));
+  fprintf(stderr, "* %s: %s\n", what, text);
+  return false;
+}
+
+std::string ItemName(unsigned i) {
+  char name[64];
+  snprintf(name, sizeof(name), "dir%04u/file%06u.txt", i / 1000, i);
+  return name;
+}
+
+// Makes a zip of count small items, with a folder for every thousand.
+bool MakeZip(const std::string &zfn, unsigned count) {
+  HZIP hz{CreateZip(zfn.c_str(), nullptr)};
+  if (!hz) return Check(ZR_RECENT, zfn.c_str());
+
+  Random rng{7};
+  char data[256];
+  bool ok{true};
+  for (unsigned i{0}; ok && i < count; ++i) {
+    if (i % 1000 == 0) {
+      char dir[32];
+      snprintf(dir, sizeof(dir), "dir%04u", i / 1000);
+      ok = Check(ZipAddFolder(hz, dir), dir);
+    }
+
+    const std::string name{ItemName(i)};
+    const int len{snprintf(data, sizeof(data), "item %u of %u, %llu\n", i,
+                           count,
+                           static_cast<unsigned long long>(rng.Next()))};
+    ok = ok && Check(ZipAdd(hz, name.c_str(), data, static_cast<unsigned>(len)),
+                     name.c_str());
+  }
+
+  const ZRESULT rc{CloseZip(hz)};
+  return ok && Check(rc, zfn.c_str());
+}
+
+std::vector<unsigned> Shuffled(Random &rng, unsigned count, unsigned ops) {
+  std::vector<unsigned> order;
+  order.reserve(ops);
+  for (unsigned i{0}; i < ops; ++i) order.push_back(rng.Below(count));
+  return order;
+}
+
+std::string Upper(std::string s) {
+  for (char &c : s) c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+  return s;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  unsigned count{100000}, ops{200};
+  int repeats{5};
+  std::string zfn, dir{"/tmp"};
+
+  for (int i{1}; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      fprintf(stderr,
+              "usage: zip-utils-metabench [-n items] [-o ops] [-r repeats] "
+              "[-z zip] [-d dir]\n");
+      return 2;
+    }
+
+    if (strcmp(argv[i], "-n") == 0)
+      count = static_cast<unsigned>(atol(argv[i + 1]));
+    else if (strcmp(argv[i], "-o") == 0)
+      ops = static_cast<unsigned>(atol(argv[i + 1]));
+    else if (strcmp(argv[i], "-r") == 0)
+      repeats = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-z") == 0)
+      zfn = argv[i + 1];
+    else if (strcmp(argv[i], "-d") == 0)
+      dir = argv[i + 1];
+    else
+      i = argc - 1;  // to the usage message
+  }
+
+  if (count == 0 || repeats < 1) {
+    fprintf(stderr, "* items and repeats must be positive\n");
+    return 2;
+  }
+
+  std::string work;
+  if (zfn.empty()) {
+    work = dir + "/zip-utils-metabench.XXXXXX";
+    if (!mkdtemp(work.data())) {
+      fprintf(stderr, "* can't make a directory in %s\n", dir.c_str());
+      return 1;
+    }
+
+    zfn = work + "/meta.zip";
+
+    const double start{Now()};
+    if (!MakeZip(zfn, count)) {
+      RemoveTree(work);
+      return 1;
+    }
+
+    fprintf(stderr, "made %s in %.2f s\n", zfn.c_str(), Now() - start);
+  }
+
+  bool ok{true};
+  Timings open{"open"};
+  for (int i{0}; ok && i < repeats; ++i) {
+    HZIP hz{nullptr};
+    ok = open.Time([&] {
+      hz = OpenZip(zfn.c_str(), nullptr);
+      return hz != nullptr;
+    });
+    if (hz) (void)CloseZip(hz);
+  }
+
+  HZIP hz{ok ? OpenZip(zfn.c_str(), nullptr) : nullptr};
+  ZIPENTRY ze;
+  ok = hz ? Check(GetZipItem(hz, -1, &ze), zfn.c_str())
+          : Check(ZR_RECENT, zfn.c_str());
+  if (!ok) {
+    if (hz) (void)CloseZip(hz);
+    if (!work.empty()) RemoveTree(work);
+    return 1;
+  }
+
+  const unsigned items{static_cast<unsigned>(ze.index)};
+  printf("{\"bench\":\"zip-utils-metabench\",\"version\":\"%s\",\"items\":%u,"
+         "\"ops\":%u}\n",
+         ZU_BENCH_VERSION_STRING, items, ops);
+  open.Print();
+
+  // the names of everything, for the lookups, and the small files to extract
+  std::vector<std::string> names;
+  std::vector<unsigned> files;
+  names.reserve(items);
+
+  Timings enumerate{"enumerate"};
+  for (unsigned i{0}; ok && i < items; ++i) {
+    ok = enumerate.Time([&] {
+      return GetZipItem(hz, static_cast<int>(i), &ze) == ZR_OK;
+    });
+    names.push_back(ze.name);
+    if (ok && ze.name[0] != 0 && ze.name[strlen(ze.name) - 1] != '/')
+      files.push_back(i);
+  }
+  enumerate.Print();
+
+  Random rng{1234};
+  if (ok) {
+    Timings get{"get_random"};
+    for (unsigned i : Shuffled(rng, items, ops)) {
+      ok = ok && get.Time([&] {
+             return GetZipItem(hz, static_cast<int>(i), &ze) == ZR_OK;
+           });
+    }
+    get.Print();
+  }
+
+  const std::vector<unsigned> hits{Shuffled(rng, items, ops)};
+  for (const bool ic : {false, true}) {
+    if (!ok) break;
+
+    Timings find{ic ? "find_hit_ic" : "find_hit"};
+    for (unsigned i : hits) {
+      const std::string name{ic ? Upper(names[i]) : names[i]};
+      int index;
+      ok = ok && find.Time([&] {
+             return FindZipItem(hz, name.c_str(), ic, &index, &ze) == ZR_OK;
+           });
+    }
+    find.Print();
+  }
+
+  for (const bool ic : {false, true}) {
+    if (!ok) break;
+
+    Timings find{ic ? "find_miss_ic" : "find_miss"};
+    for (unsigned i : hits) {
+      const std::string name{names[i] + ".missing"};
+      int index;
+      // missing is what's expected here
+      (void)find.Time([&] {
+        return FindZipItem(hz, name.c_str(), ic, &index, &ze) == ZR_NOTFOUND;
+      });
+    }
+    find.Print();
+  }
+
+  if (ok && !files.empty()) {
+    Timings unzip{"unzip_random"};
+    char buf[4096];
+    for (unsigned i : Shuffled(rng, static_cast<unsigned>(files.size()), ops)) {
+      const int index{static_cast<int>(files[i])};
+      ok = ok && unzip.Time([&] {
+             const ZRESULT rc{UnzipItem(hz, index, buf, sizeof(buf))};
+             return rc == ZR_OK || rc == ZR_MORE;
+           });
+    }
+    unzip.Print();
+  }
+
+  (void)CloseZip(hz);
+  if (!work.empty()) RemoveTree(work);
+
+  if (!ok) fprintf(stderr, "* an operation failed\n");
+  return ok ? 0 : 1;
+}
@@ -1,18 +1,1146 @@
-﻿#include <memory>
+﻿#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
 #include <new>
+#include <string>
 #include <string_view>
+#include <thread>
 
 #include "../../XUnzip.h"
 #include "../../XZip.h"
 #include "../test_utils.h"
 
+#ifdef ZU_TRACE
+#include "../../XZtrace.h"
+#endif
+
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 using namespace zu_utils::examples;
 
+namespace {
+
+using file_ptr = std::unique_ptr<FILE, FileDeleter<msg>>;
+using zip_ptr = std::unique_ptr<HZIP__, ZipDeleter<msg>>;
+
+void fail(const char *what, const char *name) {
+  msg((std::string{"* Failed to "} + what + " " + name).c_str());
+}
+
+// Text which deflates well, but not to nothing.
+std::string MakeSample(unsigned lines) {
+  std::string s;
+  for (unsigned i = 0; i < lines; i++) {
+    s += "Line " + std::to_string(i * 7919 % 10007) + " of the sample, " +
+         std::to_string(i) + " bytes of it so far\n";
+  }
+  return s;
+}
+
+// A pipe, whose read end r gets what is written to w.  Neither can seek.
+bool OpenPipe(FILE **r, FILE **w) {
+  int fds[2];
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+  if (_pipe(fds, 65536, _O_BINARY) != 0) return false;
+
+  *r = _fdopen(fds[0], "rb");
+  *w = _fdopen(fds[1], "wb");
+#else
+  if (pipe(fds) != 0) return false;
+
+  *r = fdopen(fds[0], "rb");
+  *w = fdopen(fds[1], "wb");
+#endif
+  return *r && *w;
+}
+
+// Checks that item index of hz is called name and unzips to want.
+void CheckItem(HZIP hz, int index, const char *name, std::string_view want) {
+  ZIPENTRY ze;
+  if (GetZipItem(hz, index, &ze) != ZR_OK || strcmp(ze.name, name) != 0) {
+    fail("find", name);
+    return;
+  }
+
+  // one byte over, so that an item too long doesn't fit
+  std::unique_ptr<char[]> buf{new (std::nothrow) char[want.size() + 1]};
+  if (!buf) {
+    fail("allocate for", name);
+    return;
+  }
+
+  const unsigned len{static_cast<unsigned>(want.size() + 1)};
+  if (UnzipItem(hz, index, buf.get(), len) != ZR_OK ||
+      GetZipItem(hz, index, &ze) != ZR_OK ||
+      ze.unc_size != static_cast<long>(want.size()) ||
+      std::string_view{buf.get(), want.size()} != want) {
+    fail("unzip", name);
+  }
+}
+
+// Has add zip into one end of a pipe, on a thread of its own, while check
+// unzips from the other.
+template <typename Add, typename Check>
+void ThroughPipe(Add add, Check check) {
+  FILE *r, *w;
+  if (!OpenPipe(&r, &w)) {
+    msg("* Failed to open a pipe");
+    return;
+  }
+
+  std::thread writer{[w, &add] {
+    {
+      zip_ptr hz{CreateZipHandle(w, nullptr)};
+      if (!hz)
+        msg("* Failed to create zip in a pipe");
+      else
+        add(hz.get());
+    }
+    fclose(w);
+  }};
+
+  {
+    zip_ptr hz{OpenZipHandle(r, nullptr)};
+    if (!hz)
+      msg("* Failed to open zip from a pipe");
+    else
+      check(hz.get());
+  }
+
+  // what's left is the directory, which the writer has to be able to finish
+  char rest[4096];
+  while (fread(rest, 1, sizeof(rest), r) != 0) {
+  }
+
+  writer.join();
+  fclose(r);
+}
+
+// A ZALLOCATOR which counts what it's asked for and what it's given back.
+struct CountingAllocator {
+  unsigned long allocations{0};
+  unsigned long frees{0};
+
+  static void *Allocate(void *opaque, size_t size) {
+    static_cast<CountingAllocator *>(opaque)->allocations++;
+    return malloc(size);
+  }
+
+  static void Deallocate(void *opaque, void *ptr) {
+    static_cast<CountingAllocator *>(opaque)->frees++;
+    free(ptr);
+  }
+};
+
+// Whether the last zip (Z) or unzip (U) call failed with want.
+bool RecentIs(size_t (*format)(ZRESULT, TCHAR *, size_t), ZRESULT want) {
+  char recent[256], wanted[256];
+  format(ZR_RECENT, recent, sizeof(recent));
+  format(want, wanted, sizeof(wanted));
+
+  return strcmp(recent, wanted) == 0;
+}
+
+// All the memory of a zip and of an unzip goes through the allocator given,
+// and all of it comes back by the time they're closed.  An allocator without
+// both its functions is refused.
+void TestAllocator(const std::string &text) {
+  CountingAllocator counts;
+  const ZALLOCATOR alloc{CountingAllocator::Allocate,
+                         CountingAllocator::Deallocate, &counts};
+  {
+    zip_ptr hz{CreateZip("std_alloc.zip", "std-pass", &alloc)};
+    if (!hz) msg("* Failed to create std_alloc.zip with an allocator");
+
+    if (ZipAdd(hz.get(), "alloc/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add", "alloc/text.txt");
+  }
+
+  if (counts.allocations == 0 || counts.allocations != counts.frees)
+    msg("* Failed to allocate and free a zip through the allocator");
+
+  counts = {};
+  {
+    zip_ptr hz{OpenZip("std_alloc.zip", "std-pass", &alloc)};
+    if (!hz)
+      msg("* Failed to open std_alloc.zip with an allocator");
+    else
+      CheckItem(hz.get(), 0, "alloc/text.txt", text);
+  }
+
+  if (counts.allocations == 0 || counts.allocations != counts.frees)
+    msg("* Failed to allocate and free an unzip through the allocator");
+
+  const ZALLOCATOR noalloc{nullptr, CountingAllocator::Deallocate, &counts};
+  const ZALLOCATOR nofree{CountingAllocator::Allocate, nullptr, &counts};
+  for (const ZALLOCATOR *bad : {&noalloc, &nofree}) {
+    zip_ptr hz{CreateZip(static_cast<void *>(nullptr), 0, nullptr, bad)};
+    if (hz || !RecentIs(FormatZipMessageZ, ZR_ARGS))
+      msg("* Failed to refuse a zip an allocator without both functions");
+
+    zip_ptr hzu{OpenZip("std_alloc.zip", nullptr, bad)};
+    if (hzu || !RecentIs(FormatZipMessageU, ZR_ARGS))
+      msg("* Failed to refuse an unzip an allocator without both functions");
+  }
+}
+
+// A zip made into a pipe has the sizes of each item after its data.  Read
+// back through the pipe, the items have to be inflated to find their end.
+void TestPipes(const std::string &text) {
+  const char txtbuf[]{"123 This is a text!"};
+
+  ThroughPipe(
+      [&text](HZIP hz) {
+        if (ZipAdd(hz, "pipe/text.txt", const_cast<char *>(text.data()),
+                   static_cast<unsigned>(text.size())) != ZR_OK)
+          fail("add to pipe", "pipe/text.txt");
+
+        if (ZipAdd(hz, "pipe/sample.txt", "std_sample.txt") != ZR_OK)
+          fail("add to pipe", "pipe/sample.txt");
+
+        if (ZipAddFolder(hz, "pipe/empty") != ZR_OK)
+          fail("add to pipe", "pipe/empty");
+      },
+      [&text, &txtbuf](HZIP hz) {
+        CheckItem(hz, 0, "pipe/text.txt", text);
+        CheckItem(hz, 1, "pipe/sample.txt",
+                  std::string_view{txtbuf, std::size(txtbuf)});
+
+        ZIPENTRY ze;
+        if (GetZipItem(hz, 2, &ze) != ZR_OK ||
+            strcmp(ze.name, "pipe/empty/") != 0 || !IsDirectory(ze)) {
+          fail("find", "pipe/empty/");
+        }
+
+        // a pipe can't go back
+        char c;
+        if (UnzipItem(hz, 0, &c, 1) != ZR_SEEK)
+          msg("* Failed to refuse going back in a pipe");
+      });
+}
+
+// Pushes text into an entry with ZipEntryWrite, in pieces of all sizes.  len
+// 0 leaves the size to be found out.
+void PushEntry(HZIP hz, const char *name, const std::string &text,
+               unsigned len) {
+  const ZRESULT rc{len != 0 ? ZipEntryBegin(hz, name, len)
+                            : ZipEntryBegin(hz, name)};
+  if (rc != ZR_OK) {
+    fail("begin", name);
+    return;
+  }
+
+  size_t piece = 1;
+  for (size_t at = 0; at < text.size(); at += piece) {
+    piece = std::min(piece % 50000 * 3 + 1, text.size() - at);
+
+    if (ZipEntryWrite(hz, text.data() + at, static_cast<unsigned>(piece)) !=
+        ZR_OK) {
+      fail("write", name);
+      return;
+    }
+  }
+
+  if (ZipEntryEnd(hz) != ZR_OK) fail("end", name);
+}
+
+// Entries pushed a piece at a time, into a file and into a pipe.  Where the
+// size isn't given, even a ".zip" has to be deflated into the pipe, since its
+// header can't be fixed up afterwards.  The last entry is left for CloseZip
+// to end.
+void TestEntries(const std::string &text) {
+  const auto add = [&text](HZIP hz) {
+    PushEntry(hz, "push/text.txt", text, 0);
+    PushEntry(hz, "push/text.zip", text, 0);
+    PushEntry(hz, "push/sized.zip", text, static_cast<unsigned>(text.size()));
+
+    if (ZipEntryBegin(hz, "push/open.txt") != ZR_OK ||
+        ZipEntryWrite(hz, "open", 4) != ZR_OK) {
+      fail("write", "push/open.txt");
+    }
+
+    char c{0};
+    if (ZipAdd(hz, "push/other.txt", &c, 1) == ZR_OK)
+      msg("* Failed to refuse ZipAdd inside an entry");
+  };
+
+  const auto check = [&text](HZIP hz) {
+    CheckItem(hz, 0, "push/text.txt", text);
+    CheckItem(hz, 1, "push/text.zip", text);
+    CheckItem(hz, 2, "push/sized.zip", text);
+    CheckItem(hz, 3, "push/open.txt", "open");
+  };
+
+  ThroughPipe(add, check);
+
+  {
+    zip_ptr hz{CreateZip("std_entries.zip", nullptr)};
+    if (!hz) msg("* Failed to create std_entries.zip");
+
+    add(hz.get());
+  }
+
+  zip_ptr hz{OpenZip("std_entries.zip", nullptr)};
+  if (!hz)
+    msg("* Failed to open std_entries.zip");
+  else
+    check(hz.get());
+}
+
+// Two items read side by side a piece at a time, each by its own reader,
+// with a whole item unzipped in between.
+void TestItemReaders(const std::string &text) {
+  const std::string other{MakeSample(3000)};
+  {
+    zip_ptr hz{CreateZip("std_items.zip", nullptr)};
+    if (!hz) msg("* Failed to create std_items.zip");
+
+    if (ZipAdd(hz.get(), "items/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add", "items/text.txt");
+
+    // stored, not deflated, for its name
+    if (ZipAdd(hz.get(), "items/other.zip", const_cast<char *>(other.data()),
+               static_cast<unsigned>(other.size())) != ZR_OK)
+      fail("add", "items/other.zip");
+  }
+
+  zip_ptr hz{OpenZip("std_items.zip", nullptr)};
+  if (!hz) {
+    msg("* Failed to open std_items.zip");
+    return;
+  }
+
+  HZIPITEM items[2];
+  if (OpenZipItem(hz.get(), 0, &items[0]) != ZR_OK ||
+      OpenZipItem(hz.get(), 1, &items[1]) != ZR_OK) {
+    msg("* Failed to open zip items");
+    return;
+  }
+
+  const std::string *wants[2]{&text, &other};
+  std::string gots[2];
+  ZRESULT rcs[2]{ZR_MORE, ZR_MORE};
+  char buf[4093];
+
+  for (unsigned turn = 0; rcs[0] == ZR_MORE || rcs[1] == ZR_MORE; turn++) {
+    const unsigned i{turn % 2};
+    if (rcs[i] != ZR_MORE) continue;
+
+    unsigned int read{0};
+    rcs[i] = ReadZipItem(items[i], buf, i == 0 ? 1000 : sizeof(buf), &read);
+    gots[i].append(buf, read);
+
+    if (turn == 7) CheckItem(hz.get(), 0, "items/text.txt", text);
+  }
+
+  for (unsigned i = 0; i < 2; i++) {
+    if (rcs[i] != ZR_OK || gots[i] != *wants[i])
+      msg("* Failed to read zip items side by side");
+
+    CloseZipItem(items[i]);
+  }
+}
+
+// Bytes which don't deflate at all.
+std::string MakeNoise(size_t size) {
+  std::string s(size, 0);
+  unsigned x = 12345;
+  for (char &c : s) {
+    x = x * 1103515245 + 12345;
+    c = static_cast<char>(x >> 16);
+  }
+  return s;
+}
+
+// The whole of a file, or "" if it can't be read.
+std::string ReadFile(const char *fn) {
+  file_ptr f{fopen(fn, "rb")};
+  if (!f) return {};
+
+  const long size{fsize(f)};
+  std::string s(size > 0 ? static_cast<size_t>(size) : 0, 0);
+  if (fread(s.data(), 1, s.size(), f.get()) != s.size()) return {};
+
+  return s;
+}
+
+void WriteFile(const char *fn, std::string_view data) {
+  file_ptr f{fopen(fn, "wb")};
+  if (!f || fwrite(data.data(), 1, data.size(), f.get()) != data.size())
+    fail("write", fn);
+}
+
+// Removes the empty directory dir.
+bool RemoveDir(const char *dir) {
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__MINGW32__)
+  return _rmdir(dir) == 0;
+#else
+  return rmdir(dir) == 0;
+#endif
+}
+
+// Unzips every item of hz by name, under whatever base dir it has.
+void UnzipAll(HZIP hz) {
+  ZIPENTRY ze;
+  if (GetZipItem(hz, -1, &ze) != ZR_OK) {
+    msg("* Failed to get root zip item");
+    return;
+  }
+
+  const int count{ze.index};
+  for (int i = 0; i < count; i++) {
+    if (GetZipItem(hz, i, &ze) != ZR_OK || UnzipItem(hz, i, ze.name) != ZR_OK)
+      fail("unzip to file", ze.name);
+  }
+}
+
+// Items unzipped under a base dir, into folders which are created once and
+// then remembered.  Folders removed behind the unzip's back are created
+// again, and a new base dir starts afresh.
+void TestBaseDir(const std::string &text) {
+  {
+    zip_ptr hz{CreateZip("std_base.zip", nullptr)};
+    if (!hz) msg("* Failed to create std_base.zip");
+
+    if (ZipAdd(hz.get(), "a/b/c.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK ||
+        ZipAdd(hz.get(), "a/b/d.txt", const_cast<char *>("d"), 1) != ZR_OK)
+      fail("add", "a/b/c.txt and d.txt");
+  }
+
+  zip_ptr hz{OpenZip("std_base.zip", nullptr)};
+  if (!hz || SetUnzipBaseDir(hz.get(), "std_base1") != ZR_OK) {
+    msg("* Failed to open std_base.zip under std_base1");
+    return;
+  }
+
+  const auto check = [&text](const char *base) {
+    const std::string dir{std::string{base} + "/a/b/"};
+    if (ReadFile((dir + "c.txt").c_str()) != text ||
+        ReadFile((dir + "d.txt").c_str()) != "d")
+      fail("unzip a/b/c.txt and d.txt under", base);
+  };
+
+  UnzipAll(hz.get());
+  check("std_base1");
+
+  if (remove("std_base1/a/b/c.txt") != 0 ||
+      remove("std_base1/a/b/d.txt") != 0 || !RemoveDir("std_base1/a/b"))
+    msg("* Failed to remove std_base1/a/b");
+
+  UnzipAll(hz.get());
+  check("std_base1");
+
+  if (SetUnzipBaseDir(hz.get(), "std_base2/") != ZR_OK) {
+    msg("* Failed to set base dir std_base2");
+    return;
+  }
+
+  UnzipAll(hz.get());
+  check("std_base2");
+}
+
+// A zip in memory grows from whatever it's started at, and ZipGetMemory hands
+// back all of it in one piece.  A buffer of the caller's doesn't grow.
+void TestMemoryZips(const std::string &text) {
+  const std::string noise{MakeNoise(300000)};
+
+  for (unsigned start : {0U, 100U}) {
+    zip_ptr hz{CreateZip(static_cast<void *>(nullptr), start, nullptr)};
+    if (!hz) {
+      msg("* Failed to create zip in memory");
+      continue;
+    }
+
+    if (ZipAdd(hz.get(), "mem/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add to memory", "mem/text.txt");
+
+    if (ZipAdd(hz.get(), "mem/noise.dat", const_cast<char *>(noise.data()),
+               static_cast<unsigned>(noise.size())) != ZR_OK)
+      fail("add to memory", "mem/noise.dat");
+
+    void *buf;
+    unsigned long len;
+    if (ZipGetMemory(hz.get(), &buf, &len) != ZR_OK || len <= noise.size()) {
+      msg("* Failed to get zip memory");
+      continue;
+    }
+
+    zip_ptr hzmem{OpenZip(buf, static_cast<unsigned>(len), nullptr)};
+    if (!hzmem) {
+      msg("* Failed to open zip from memory");
+      continue;
+    }
+
+    CheckItem(hzmem.get(), 0, "mem/text.txt", text);
+    CheckItem(hzmem.get(), 1, "mem/noise.dat", noise);
+  }
+
+  std::unique_ptr<char[]> small{new (std::nothrow) char[1000]};
+  if (!small) {
+    msg("* Failed to allocate for a zip in memory");
+    return;
+  }
+
+  zip_ptr hz{CreateZip(small.get(), 1000, nullptr)};
+  if (!hz) {
+    msg("* Failed to create zip in a buffer");
+    return;
+  }
+
+  if (ZipAdd(hz.get(), "mem/noise.dat", const_cast<char *>(noise.data()),
+             static_cast<unsigned>(noise.size())) != ZR_MEMSIZE)
+    msg("* Failed to refuse to overflow a zip buffer");
+}
+
+// A ZREADER over a string, giving back no more than 777 bytes a read, and
+// failing any read from below failbelow.
+struct StringReader {
+  std::string zip;
+  unsigned long failbelow{0};
+
+  static long ReadAt(void *opaque, unsigned long offset, void *buf,
+                     unsigned int len) {
+    auto *reader = static_cast<StringReader *>(opaque);
+    if (offset < reader->failbelow) return -1;
+    if (offset >= reader->zip.size()) return 0;
+
+    const size_t n{std::min<size_t>({len, 777, reader->zip.size() - offset})};
+    memcpy(buf, reader->zip.data() + offset, n);
+    return static_cast<long>(n);
+  }
+
+  static unsigned long Size(void *opaque) {
+    return static_cast<unsigned long>(
+        static_cast<StringReader *>(opaque)->zip.size());
+  }
+};
+
+// A zip read through a ZREADER, out of order, and one whose reads fail.
+void TestReader(const std::string &text) {
+  StringReader source;
+  {
+    zip_ptr hz{CreateZip(static_cast<void *>(nullptr), 0, nullptr)};
+    if (!hz) msg("* Failed to create zip in memory");
+
+    if (ZipAdd(hz.get(), "reader/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add to memory", "reader/text.txt");
+
+    if (ZipAdd(hz.get(), "reader/open.txt", const_cast<char *>("open"), 4) !=
+        ZR_OK)
+      fail("add to memory", "reader/open.txt");
+
+    void *buf;
+    unsigned long len;
+    if (ZipGetMemory(hz.get(), &buf, &len) != ZR_OK) {
+      msg("* Failed to get zip memory");
+      return;
+    }
+
+    source.zip.assign(static_cast<const char *>(buf), len);
+  }
+
+  const ZREADER reader{StringReader::ReadAt, StringReader::Size, &source};
+  {
+    zip_ptr hz{OpenZipReader(&reader, nullptr)};
+    if (!hz) {
+      msg("* Failed to open zip through a reader");
+    } else {
+      CheckItem(hz.get(), 1, "reader/open.txt", "open");
+      CheckItem(hz.get(), 0, "reader/text.txt", text);
+      CheckItem(hz.get(), 1, "reader/open.txt", "open");
+    }
+  }
+
+  // the directory, at the end, can still be read, but the text can't
+  source.failbelow = static_cast<unsigned long>(source.zip.size() / 2);
+
+  zip_ptr hz{OpenZipReader(&reader, nullptr)};
+  if (!hz) {
+    msg("* Failed to open zip through a reader");
+    return;
+  }
+
+  std::unique_ptr<char[]> buf{new (std::nothrow) char[text.size()]};
+  if (buf && UnzipItem(hz.get(), 0, buf.get(),
+                       static_cast<unsigned>(text.size())) == ZR_OK)
+    msg("* Failed to report a reader failing");
+}
+
+// Local headers are patched with the sizes once their items are done, in the
+// write buffer if they're still there and in the file if not.  With no buffer,
+// or one smaller than an item, every patch goes to the file.
+void TestBufferSizes(const std::string &text) {
+  for (unsigned size : {0U, 37U, 4096U}) {
+    const std::string name{"buffer of " + std::to_string(size)};
+    {
+      zip_ptr hz{CreateZip("std_buffer.zip", nullptr)};
+      if (!hz || SetZipBufferSize(hz.get(), size) != ZR_OK) {
+        fail("create std_buffer.zip with a", name.c_str());
+        continue;
+      }
+
+      if (ZipAdd(hz.get(), "buffer/text.txt", const_cast<char *>(text.data()),
+                 static_cast<unsigned>(text.size())) != ZR_OK ||
+          ZipAdd(hz.get(), "buffer/a.txt", const_cast<char *>("a"), 1) !=
+              ZR_OK) {
+        fail("add with a", name.c_str());
+      }
+
+      PushEntry(hz.get(), "buffer/push.txt", text, 0);
+
+      // and back to the default, for what's left in between
+      if (SetZipBufferSize(hz.get(), 256 * 1024) != ZR_OK ||
+          ZipAdd(hz.get(), "buffer/b.txt", const_cast<char *>("b"), 1) !=
+              ZR_OK) {
+        fail("add after changing a", name.c_str());
+      }
+    }
+
+    zip_ptr hz{OpenZip("std_buffer.zip", nullptr)};
+    if (!hz) {
+      fail("open std_buffer.zip made with a", name.c_str());
+      continue;
+    }
+
+    CheckItem(hz.get(), 0, "buffer/text.txt", text);
+    CheckItem(hz.get(), 1, "buffer/a.txt", "a");
+    CheckItem(hz.get(), 2, "buffer/push.txt", text);
+    CheckItem(hz.get(), 3, "buffer/b.txt", "b");
+  }
+}
+
+// Files of 256k and more added by name are mapped rather than read, both
+// when they're deflated and when they're stored (for a ".zip" name).
+void TestBigFiles(const std::string &text) {
+  const std::string noise{MakeNoise(256 * 1024)};
+  WriteFile("std_big.txt", text);
+  WriteFile("std_big.dat", noise);
+
+  {
+    zip_ptr hz{CreateZip("std_big.zip", nullptr)};
+    if (!hz) msg("* Failed to create std_big.zip");
+
+    if (ZipAdd(hz.get(), "big/text.txt", "std_big.txt") != ZR_OK)
+      fail("add", "big/text.txt");
+
+    if (ZipAdd(hz.get(), "big/text.zip", "std_big.txt") != ZR_OK)
+      fail("add", "big/text.zip");
+
+    if (ZipAdd(hz.get(), "big/noise.zip", "std_big.dat") != ZR_OK)
+      fail("add", "big/noise.zip");
+  }
+
+  zip_ptr hz{OpenZip("std_big.zip", nullptr)};
+  if (!hz) {
+    msg("* Failed to open std_big.zip");
+    return;
+  }
+
+  CheckItem(hz.get(), 0, "big/text.txt", text);
+  CheckItem(hz.get(), 1, "big/text.zip", text);
+  CheckItem(hz.get(), 2, "big/noise.zip", noise);
+
+  const unsigned short methods[]{8, 0, 0};
+  for (int i = 0; i < 3; i++) {
+    ZIPRAWITEM raw;
+    HZIPITEM item;
+    if (OpenZipItemRaw(hz.get(), i, &raw, &item) != ZR_OK) {
+      msg("* Failed to open big item raw");
+      continue;
+    }
+
+    if (raw.method != methods[i]) msg("* Failed to store or deflate big item");
+
+    CloseZipItem(item);
+  }
+}
+
+// Items added through SetZipPipeline, which reads a handle and writes the zip
+// on threads of their own, a 256k block at a time.  A handle whose reads fail
+// must fail its item.
+void TestPipeline(const std::string &text) {
+  const std::string noise{MakeNoise(1100000)};
+  WriteFile("std_noise.dat", noise);
+  WriteFile("std_text.txt", text);
+
+  {
+    zip_ptr hz{CreateZip("std_pipeline.zip", nullptr)};
+    if (!hz || SetZipPipeline(hz.get(), 4) != ZR_OK) {
+      msg("* Failed to create std_pipeline.zip with a pipeline");
+      return;
+    }
+
+    if (ZipAdd(hz.get(), "pipeline/noise.dat", "std_noise.dat") != ZR_OK)
+      fail("add", "pipeline/noise.dat");
+
+    file_ptr f{fopen("std_text.txt", "rb")};
+    if (!f || ZipAddHandle(hz.get(), "pipeline/text.txt", f.get()) != ZR_OK)
+      fail("add", "pipeline/text.txt");
+
+    if (ZipAdd(hz.get(), "pipeline/a.txt", const_cast<char *>("a"), 1) !=
+        ZR_OK)
+      fail("add", "pipeline/a.txt");
+  }
+
+  {
+    zip_ptr hz{OpenZip("std_pipeline.zip", nullptr)};
+    if (!hz) {
+      msg("* Failed to open std_pipeline.zip");
+    } else {
+      CheckItem(hz.get(), 0, "pipeline/noise.dat", noise);
+      CheckItem(hz.get(), 1, "pipeline/text.txt", text);
+      CheckItem(hz.get(), 2, "pipeline/a.txt", "a");
+    }
+  }
+
+  // open only for writing, so that its size is known but reading fails
+  zip_ptr hz{CreateZip("std_pipefail.zip", nullptr)};
+  file_ptr f{fopen("std_noise.dat", "ab")};
+  if (!hz || !f || SetZipPipeline(hz.get(), 4) != ZR_OK) {
+    msg("* Failed to create std_pipefail.zip with a pipeline");
+    return;
+  }
+
+  if (ZipAddHandle(hz.get(), "pipeline/fail.dat", f.get()) == ZR_OK)
+    msg("* Failed to report a handle failing through a pipeline");
+}
+
+// Items copied from zip to zip as they are stored.  An encrypted item keeps
+// its descriptor and its own password.
+void TestRawCopies(const std::string &text) {
+  {
+    zip_ptr hz{CreateZip("std_enc.zip", "std-pass")};
+    if (!hz) msg("* Failed to create std_enc.zip");
+
+    if (ZipAdd(hz.get(), "enc/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add", "enc/text.txt");
+  }
+
+  {
+    zip_ptr hzenc{OpenZip("std_enc.zip", nullptr)};
+    zip_ptr hzitems{OpenZip("std_items.zip", nullptr)};
+    zip_ptr hz{CreateZip("std_raw.zip", nullptr)};
+    if (!hzenc || !hzitems || !hz) msg("* Failed to open zips to copy");
+
+    ZIPRAWITEM raw;
+    HZIPITEM item;
+    if (OpenZipItemRaw(hzenc.get(), 0, &raw, &item) != ZR_OK ||
+        (raw.flag & 9) != 9) {
+      msg("* Failed to open encrypted item with descriptor raw");
+    } else {
+      CloseZipItem(item);
+    }
+
+    if (ZipAddRawFromZip(hz.get(), hzenc.get(), 0, nullptr) != ZR_OK)
+      fail("copy", "enc/text.txt");
+
+    if (ZipAddRawFromZip(hz.get(), hzitems.get(), 1, "raw\\other.zip") !=
+        ZR_OK)
+      fail("copy", "raw/other.zip");
+  }
+
+  zip_ptr hz{OpenZip("std_raw.zip", "std-pass")};
+  if (!hz) {
+    msg("* Failed to open std_raw.zip");
+    return;
+  }
+
+  CheckItem(hz.get(), 0, "enc/text.txt", text);
+  CheckItem(hz.get(), 1, "raw/other.zip", MakeSample(3000));
+
+  ZIPRAWITEM raw;
+  HZIPITEM item;
+  if (OpenZipItemRaw(hz.get(), 0, &raw, &item) != ZR_OK ||
+      (raw.flag & 9) != 9) {
+    msg("* Failed to copy encrypted item with its descriptor");
+  } else {
+    CloseZipItem(item);
+  }
+
+  zip_ptr hzwrong{OpenZip("std_raw.zip", "wrong")};
+  char c;
+  if (!hzwrong || UnzipItem(hzwrong.get(), 0, &c, 1) != ZR_PASSWORD)
+    msg("* Failed to keep the copy encrypted");
+}
+
+// Items added to a zip that's already there, behind a stub that has to stay.
+void TestAppend(const std::string &text) {
+  const char stub[]{"#!/bin/sh\nexit 0\n"};
+  {
+    file_ptr f{fopen("std_append.zip", "wb")};
+    if (!f || fwrite(stub, 1, sizeof(stub), f.get()) != sizeof(stub))
+      msg("* Failed to write std_append.zip");
+
+    zip_ptr hz{CreateZipHandle(f.get(), nullptr)};
+    if (!hz) msg("* Failed to create std_append.zip");
+
+    if (ZipAdd(hz.get(), "append/a.txt", const_cast<char *>("a"), 1) != ZR_OK)
+      fail("add", "append/a.txt");
+
+    if (ZipAdd(hz.get(), "append/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add", "append/text.txt");
+  }
+
+  {
+    zip_ptr hz{OpenZipForAppend("std_append.zip", nullptr)};
+    if (!hz) msg("* Failed to open std_append.zip for append");
+
+    if (ZipAdd(hz.get(), "append/b.txt", const_cast<char *>("bb"), 2) != ZR_OK)
+      fail("append", "append/b.txt");
+  }
+
+  {
+    zip_ptr hz{OpenZip("std_append.zip", nullptr)};
+    ZIPENTRY ze;
+    if (!hz || GetZipItem(hz.get(), -1, &ze) != ZR_OK || ze.index != 3) {
+      msg("* Failed to find 3 items in std_append.zip");
+    } else {
+      CheckItem(hz.get(), 0, "append/a.txt", "a");
+      CheckItem(hz.get(), 1, "append/text.txt", text);
+      CheckItem(hz.get(), 2, "append/b.txt", "bb");
+    }
+  }
+
+  file_ptr f{fopen("std_append.zip", "rb")};
+  char got[sizeof(stub)];
+  if (!f || fread(got, 1, sizeof(got), f.get()) != sizeof(got) ||
+      memcmp(got, stub, sizeof(stub)) != 0) {
+    msg("* Failed to keep the stub of std_append.zip");
+  }
+
+  if (OpenZipForAppend("std_sample.txt", nullptr) != nullptr)
+    msg("* Failed to refuse to append to std_sample.txt");
+
+  // An entry with a size or offset of all ones is zip64, and is refused.
+  {
+    zip_ptr hz{CreateZip("std_zip64.zip", nullptr)};
+    if (!hz || ZipAdd(hz.get(), "zip64/a.txt", const_cast<char *>("a"), 1) !=
+                   ZR_OK)
+      fail("add", "zip64/a.txt");
+  }
+
+  const std::string zip{ReadFile("std_zip64.zip")};
+  const size_t central{zip.rfind("PK\x01\x02")};
+  if (central == std::string::npos) {
+    msg("* Failed to find the directory of std_zip64.zip");
+    return;
+  }
+
+  for (size_t at : {20, 24, 42}) {
+    std::string zip64{zip};
+    zip64.replace(central + at, 4, "\xFF\xFF\xFF\xFF");
+    WriteFile("std_zip64.zip", zip64);
+
+    HZIP hz{OpenZipForAppend("std_zip64.zip", nullptr)};
+    if (hz != nullptr || !RecentIs(FormatZipMessageZ, ZR_CORRUPT)) {
+      msg("* Failed to refuse to append to a zip64 entry");
+      if (hz) (void)CloseZip(hz);
+    }
+  }
+}
+
+// Zips a.txt, b.txt (text) and c.txt (text again) into fn.
+void MakeThree(const char *fn, const std::string &text) {
+  zip_ptr hz{CreateZip(fn, nullptr)};
+  if (!hz) fail("create", fn);
+
+  if (ZipAdd(hz.get(), "delete/a.txt", const_cast<char *>("a"), 1) != ZR_OK)
+    fail("add", "delete/a.txt");
+
+  for (const char *name : {"delete/b.txt", "delete/c.txt"}) {
+    if (ZipAdd(hz.get(), name, const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add", name);
+  }
+}
+
+// Items deleted from an appended zip, and one replaced.  When the rewrite
+// fails part way, the zip must be left as it was.
+void TestDelete(const std::string &text) {
+  MakeThree("std_delete.zip", text);
+  {
+    zip_ptr hz{OpenZipForAppend("std_delete.zip", nullptr)};
+    if (!hz) msg("* Failed to open std_delete.zip for append");
+
+    if (ZipDelete(hz.get(), "delete/b.txt") != ZR_OK ||
+        ZipDelete(hz.get(), "delete/a.txt") != ZR_OK)
+      fail("delete", "delete/a.txt and b.txt");
+
+    if (ZipDelete(hz.get(), "delete/none.txt") != ZR_NOTFOUND)
+      msg("* Failed to report deleting nothing");
+
+    if (ZipAdd(hz.get(), "delete/a.txt", const_cast<char *>("aa"), 2) !=
+        ZR_OK)
+      fail("replace", "delete/a.txt");
+
+    if (ZipDelete(hz.get(), "delete/c.txt") != ZR_ZMODE)
+      msg("* Failed to refuse deleting after adding");
+  }
+
+  {
+    zip_ptr hz{OpenZip("std_delete.zip", nullptr)};
+    ZIPENTRY ze;
+    if (!hz || GetZipItem(hz.get(), -1, &ze) != ZR_OK || ze.index != 2) {
+      msg("* Failed to find 2 items in std_delete.zip");
+    } else {
+      CheckItem(hz.get(), 0, "delete/c.txt", text);
+      CheckItem(hz.get(), 1, "delete/a.txt", "aa");
+    }
+  }
+
+  // deleted with nothing added, it's rewritten by CloseZip
+  {
+    zip_ptr hz{OpenZipForAppend("std_delete.zip", nullptr)};
+    if (!hz || ZipDelete(hz.get(), "delete/c.txt") != ZR_OK)
+      fail("delete", "delete/c.txt");
+  }
+
+  {
+    zip_ptr hz{OpenZip("std_delete.zip", nullptr)};
+    ZIPENTRY ze;
+    if (!hz || GetZipItem(hz.get(), -1, &ze) != ZR_OK || ze.index != 1)
+      msg("* Failed to find 1 item in std_delete.zip");
+    else
+      CheckItem(hz.get(), 0, "delete/a.txt", "aa");
+  }
+
+  // Cut short behind the zip's back, so that copying c.txt fails.
+  MakeThree("std_fail.zip", text);
+
+  HZIP hz{OpenZipForAppend("std_fail.zip", nullptr)};
+  if (!hz || ZipDelete(hz, "delete/b.txt") != ZR_OK) {
+    fail("delete", "delete/b.txt");
+    return;
+  }
+
+  const std::string whole{ReadFile("std_fail.zip")};
+  const std::string_view cut{whole.data(), whole.size() - 20000};
+  WriteFile("std_fail.zip", cut);
+
+  if (ZipAdd(hz, "delete/d.txt", const_cast<char *>("d"), 1) != ZR_READ)
+    msg("* Failed to report a failed rewrite");
+
+  if (CloseZip(hz) == ZR_OK)
+    msg("* Failed to report a failed rewrite on close");
+
+  const bool left{ReadFile("std_fail.zip") == cut &&
+                  !file_ptr{fopen("std_fail.zip.tmp", "rb")}};
+  if (!left) msg("* Failed to leave std_fail.zip as it was");
+}
+
+// What ZipGetStats and UnzipGetStats count of a zip made and read in memory.
+// Built without ZU_ENABLE_STATS, every count is 0.
+void TestStats(const std::string &text) {
+  zip_ptr hz{CreateZip(static_cast<void *>(nullptr), 0, nullptr)};
+  if (!hz) {
+    msg("* Failed to create zip in memory");
+    return;
+  }
+
+  if (ZipAdd(hz.get(), "stats/text.txt", const_cast<char *>(text.data()),
+             static_cast<unsigned>(text.size())) != ZR_OK ||
+      ZipAdd(hz.get(), "stats/a.txt", const_cast<char *>("a"), 1) != ZR_OK) {
+    fail("add to memory", "stats/text.txt and a.txt");
+  }
+
+  void *buf;
+  unsigned long len;
+  ZIPSTATS zs;
+  if (ZipGetMemory(hz.get(), &buf, &len) != ZR_OK ||
+      ZipGetStats(hz.get(), &zs) != ZR_OK) {
+    msg("* Failed to get zip stats");
+    return;
+  }
+
+  zip_ptr hzmem{OpenZip(buf, static_cast<unsigned>(len), nullptr)};
+  if (!hzmem) {
+    msg("* Failed to open zip from memory");
+    return;
+  }
+
+  CheckItem(hzmem.get(), 0, "stats/text.txt", text);
+  CheckItem(hzmem.get(), 1, "stats/a.txt", "a");
+
+  UNZIPSTATS us;
+  if (UnzipGetStats(hzmem.get(), &us) != ZR_OK) {
+    msg("* Failed to get unzip stats");
+    return;
+  }
+
+#ifdef ZU_STATS
+  const unsigned long long size{text.size() + 1};
+  if (zs.items != 2 || zs.bytes_in != size || zs.bytes_out != len)
+    msg("* Failed to count what was zipped");
+
+  if (us.items != 2 || us.bytes_out != size || us.bytes_in == 0)
+    msg("* Failed to count what was unzipped");
+#else
+  if (zs.items != 0 || zs.bytes_in != 0 || zs.bytes_out != 0 ||
+      us.items != 0 || us.bytes_in != 0 || us.bytes_out != 0)
+    msg("* Failed to count nothing without ZU_STATS");
+#endif
+}
+
+// Zips text and noise at level into memory, and text again pushed in pieces,
+// and reads them back.  Only level 0 stores them.
+void CheckLevel(int level, const std::string &text, const std::string &noise) {
+  const std::string name{"level " + std::to_string(level)};
+
+  zip_ptr hz{CreateZip(static_cast<void *>(nullptr), 0, nullptr)};
+  if (!hz || SetZipLevel(hz.get(), level) != ZR_OK) {
+    fail("create zip in memory at", name.c_str());
+    return;
+  }
+
+  if (ZipAdd(hz.get(), "level/text.txt", const_cast<char *>(text.data()),
+             static_cast<unsigned>(text.size())) != ZR_OK ||
+      ZipAdd(hz.get(), "level/noise.dat", const_cast<char *>(noise.data()),
+             static_cast<unsigned>(noise.size())) != ZR_OK) {
+    fail("add text and noise at", name.c_str());
+    return;
+  }
+
+  PushEntry(hz.get(), "level/push.txt", text, 0);
+
+  void *buf;
+  unsigned long len;
+  if (ZipGetMemory(hz.get(), &buf, &len) != ZR_OK) {
+    fail("get zip memory at", name.c_str());
+    return;
+  }
+
+  zip_ptr hzmem{OpenZip(buf, static_cast<unsigned>(len), nullptr)};
+  if (!hzmem) {
+    fail("open zip from memory at", name.c_str());
+    return;
+  }
+
+  CheckItem(hzmem.get(), 0, "level/text.txt", text);
+  CheckItem(hzmem.get(), 1, "level/noise.dat", noise);
+  CheckItem(hzmem.get(), 2, "level/push.txt", text);
+
+  ZIPRAWITEM raw;
+  HZIPITEM item;
+  if (OpenZipItemRaw(hzmem.get(), 0, &raw, &item) != ZR_OK ||
+      raw.method != (level == 0 ? 0 : 8)) {
+    fail("compress as asked at", name.c_str());
+    return;
+  }
+
+  CloseZipItem(item);
+}
+
+// Every level, since each has its own instance of the matcher and level 1 a
+// matcher of its own.  The noise is more than deflate's 1M window, which has
+// to slide, and the pushed entry keeps its level's state from piece to piece.
+void TestLevels(const std::string &text) {
+  const std::string noise{MakeNoise(1200000)};
+
+  for (int level = 0; level <= 9; level++) CheckLevel(level, text, noise);
+
+  zip_ptr hz{CreateZip(static_cast<void *>(nullptr), 0, nullptr)};
+  if (!hz || SetZipLevel(hz.get(), -1) != ZR_ARGS ||
+      SetZipLevel(hz.get(), 10) != ZR_ARGS)
+    msg("* Failed to refuse levels outside 0 to 9");
+}
+
+#ifdef ZU_TRACE
+// A sink which counts the scopes it's given, by name.
+struct TraceCounts {
+  unsigned zip_add{0};
+  unsigned deflate{0};
+  unsigned unzip_item{0};
+  unsigned all{0};
+
+  static void Scope(void *opaque, const char *name, unsigned long long,
+                    unsigned long long, unsigned long) {
+    auto *counts = static_cast<TraceCounts *>(opaque);
+    std::string_view n{name};
+
+    if (n == "zip_add") counts->zip_add++;
+    if (n == "deflate") counts->deflate++;
+    if (n == "unzip_item") counts->unzip_item++;
+    counts->all++;
+  }
+};
+
+// Zips and unzips one item for TestTrace to watch.
+void ZipOne(const std::string &text) {
+  {
+    zip_ptr hz{CreateZip("std_trace.zip", nullptr)};
+    if (!hz ||
+        ZipAdd(hz.get(), "trace/text.txt", const_cast<char *>(text.data()),
+               static_cast<unsigned>(text.size())) != ZR_OK)
+      fail("add", "trace/text.txt");
+  }
+
+  zip_ptr hz{OpenZip("std_trace.zip", nullptr)};
+  if (!hz)
+    msg("* Failed to open std_trace.zip");
+  else
+    CheckItem(hz.get(), 0, "trace/text.txt", text);
+}
+
+// The scopes seen by a sink of our own, and the Chrome trace file.
+void TestTrace(const std::string &text) {
+  TraceCounts counts;
+  const ZTRACESINK sink{TraceCounts::Scope, &counts};
+  if (SetZipTraceSink(&sink) != ZR_OK || !ZipTraceEnabled()) {
+    msg("* Failed to set a trace sink");
+    return;
+  }
+
+  ZipOne(text);
+
+  if (SetZipTraceSink(nullptr) != ZR_OK || ZipTraceEnabled())
+    msg("* Failed to clear the trace sink");
+
+  if (counts.zip_add != 1 || counts.deflate != 1 || counts.unzip_item != 1)
+    msg("* Failed to trace zip_add, deflate and unzip_item once each");
+
+  // nothing more once the sink has gone
+  const unsigned all{counts.all};
+  ZipOne(text);
+  if (counts.all != all) msg("* Failed to stop tracing");
+
+  if (StartZipTrace("std_trace.json") != ZR_OK) {
+    msg("* Failed to start std_trace.json");
+    return;
+  }
+
+  ZipOne(text);
+
+  if (StopZipTrace() != ZR_OK) msg("* Failed to stop std_trace.json");
+
+  const std::string json{ReadFile("std_trace.json")};
+  if (json.rfind("{\"traceEvents\":[", 0) != 0 ||
+      json.find("{\"name\":\"deflate\",\"cat\":\"zip\",\"ph\":\"X\"") ==
+          std::string::npos ||
+      json.size() < 4 || json.compare(json.size() - 4, 4, "\n]}\n") != 0) {
+    msg("* Failed to write std_trace.json");
+  }
+}
+#endif
+
+}  // namespace
+
 int main() {
   msg("Zip and unzip in portable stdlib-only mode");
 
-  using file_ptr = std::unique_ptr<FILE, FileDeleter<msg>>;
-
   {
     file_ptr jpg{fopen("std_sample.dat", "wb")};
     if (!jpg) msg("* Failed to create std_sample.jpg");
@@ -33,8 +1161,6 @@ int main() {
     }
   }
 
-  using zip_ptr = std::unique_ptr<HZIP__, ZipDeleter<msg>>;
-
   {
     zip_ptr hz{CreateZip("std1.zip", nullptr)};
     if (!hz) msg("* Failed to create std1.zip");
@@ -72,6 +1198,27 @@ int main() {
     msg("* Failed to unzip std_sample.txt");
   }
 
+  const std::string text{MakeSample(20000)};
+
+  TestBaseDir(text);
+  TestAllocator(text);
+  TestPipes(text);
+  TestItemReaders(text);
+  TestEntries(text);
+  TestMemoryZips(text);
+  TestReader(text);
+  TestBufferSizes(text);
+  TestBigFiles(text);
+  TestPipeline(text);
+  TestRawCopies(text);
+  TestAppend(text);
+  TestDelete(text);
+  TestStats(text);
+  TestLevels(text);
+#ifdef ZU_TRACE
+  TestTrace(text);
+#endif
+
   if (any_errors) {
     msg("Finished");
     return 1;
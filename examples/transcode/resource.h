@@ -0,0 +1,3 @@
+﻿
+
+#define SRC_PRODUCT_FILE_DESCRIPTION_STRING   "Parallel Zip Transcoding for Zip Utils"
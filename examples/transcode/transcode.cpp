@@ -0,0 +1,338 @@
+﻿// This program recompresses a zipfile at another level, or stores what was
+// deflated, or deflates what was stored, using several threads.
+//
+// zip-utils-transcode [-l level] [-j threads] [-s] in.zip out.zip
+//
+// level is as for SetZipLevel (0 stores, 1 to 9 deflate; 8 by default), and
+// threads defaults to the number of processors.  Each worker opens in.zip for
+// itself, inflates an item into memory, and deflates it into a little zip in
+// memory of its own, so that every worker has its own unzip and zip state.  The
+// main thread copies those into out.zip raw, in the original order and with the
+// original times, attributes and extra fields.  Items which are already stored
+// as asked, and folders, empty items and encrypted ones, are copied raw
+// straight from in.zip.  Item and archive comments are not kept.
+//
+// Every deflated item is recompressed, since a zip doesn't record the level
+// it was deflated at.  -s skips those whose general purpose flag bits 1 and 2
+// match what this library writes for the level, and copies them raw instead.
+// That's only a guess: the bits tell apart no more than fast (1-2), normal
+// (3-7) and maximum (8-9), and many zippers leave them 0 whatever the level,
+// so use it only on zips this library wrote.
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "XUnzip.h"
+#include "XZip.h"
+
+namespace {
+
+// What a worker made of one item.
+struct Job {
+  bool ready{false};
+  bool raw{false};  // copy it from the source as it is
+  ZRESULT rc{ZR_OK};
+  char why[128]{};  // what ZR_RECENT meant, as only the worker can tell
+  HZIP hzip{nullptr};  // the item recompressed, alone in a zip in memory
+  HZIP hmem{nullptr};  // the same, opened for reading
+};
+
+struct Transcoder {
+  const TCHAR *src;
+  int level;
+  bool skiplevel;  // trust the flag bits to say an item is at level already
+  unsigned window;  // how many items may be done ahead of the writer
+
+  std::vector<Job> jobs;
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned next{0};     // first item no worker has taken
+  unsigned written{0};  // first item the writer hasn't finished with
+  bool stop{false};
+
+  unsigned long long recompressed{0};
+  char why[128]{};  // what the ZR_RECENT Write returned meant
+
+  // The flags deflate sets for level (see lm_init), which with -s are taken
+  // to say whether an item was deflated at that level already.
+  [[nodiscard]] static unsigned LevelFlags(int level) {
+    return level <= 2 ? 4 : level >= 8 ? 2 : 0;
+  }
+
+  [[nodiscard]] bool NeedsRaw(const ZIPRAWITEM &raw) const {
+    const size_t len{strlen(raw.name)};
+    if (len == 0 || raw.name[len - 1] == '/') return true;
+    if (raw.unc_size == 0 || (raw.flag & 1)) return true;
+    if (level == 0) return raw.method == 0;
+
+    return skiplevel && raw.method == 8 && (raw.flag & 6) == LevelFlags(level);
+  }
+
+  void Process(HZIP hz, unsigned index, Job &job) {
+    ZIPRAWITEM raw;
+    HZIPITEM item;
+    job.rc = OpenZipItemRaw(hz, static_cast<int>(index), &raw, &item);
+    if (job.rc != ZR_OK) return;
+
+    CloseZipItem(item);
+
+    job.raw = NeedsRaw(raw);
+    if (job.raw) return;
+
+    std::unique_ptr<char[]> buf{new (std::nothrow) char[raw.unc_size]};
+    if (!buf) {
+      job.rc = ZR_NOALLOC;
+      return;
+    }
+
+    job.rc = UnzipItem(hz, static_cast<int>(index), buf.get(),
+                       static_cast<unsigned>(raw.unc_size));
+    if (job.rc != ZR_OK) return;
+
+    // Deflate may grow incompressible data by a little per block, and the
+    // zip adds a local header and a central entry, each with the name and
+    // extra fields.  Windows needs the whole size up front; elsewhere it's
+    // only where the buffer starts.
+    const unsigned long long bound{raw.unc_size + raw.unc_size / 1000 +
+                                   65536 + 2 * strlen(raw.name) + 1024};
+    if (bound > 0xFFFFFFFFULL) {
+      job.rc = ZR_MEMSIZE;
+      return;
+    }
+
+    job.hzip = CreateZip(static_cast<void *>(nullptr),
+                         static_cast<unsigned>(bound), nullptr);
+    if (!job.hzip) {
+      job.rc = ZR_RECENT;
+      FormatZipMessage(ZR_RECENT, job.why, sizeof(job.why));
+      return;
+    }
+
+    job.rc = SetZipLevel(job.hzip, level);
+    if (job.rc == ZR_OK)
+      job.rc = ZipAdd(job.hzip, raw.name, buf.get(),
+                      static_cast<unsigned>(raw.unc_size));
+    if (job.rc != ZR_OK) return;
+
+    void *mem;
+    unsigned long len;
+    job.rc = ZipGetMemory(job.hzip, &mem, &len);
+    if (job.rc != ZR_OK) return;
+
+    job.hmem = OpenZip(mem, static_cast<unsigned>(len), nullptr);
+    if (!job.hmem) job.rc = ZR_CORRUPT;
+  }
+
+  void Work() {
+    HZIP hz{OpenZip(src, nullptr)};
+
+    for (;;) {
+      unsigned index;
+      {
+        std::unique_lock<std::mutex> lock{mutex};
+        cv.wait(lock, [this] {
+          return stop || next >= jobs.size() || next < written + window;
+        });
+        if (stop || next >= jobs.size()) break;
+
+        index = next++;
+      }
+
+      Job job;
+      if (hz)
+        Process(hz, index, job);
+      else
+        job.rc = ZR_NOFILE;
+
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        job.ready = true;
+        jobs[index] = job;
+      }
+      cv.notify_all();
+    }
+
+    if (hz) (void)CloseZip(hz);
+  }
+
+  // Writes item index, recompressed or not, once its worker is done with it.
+  [[nodiscard]] ZRESULT Write(HZIP hzout, HZIP hzsrc, unsigned index) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      cv.wait(lock, [this, index] { return jobs[index].ready; });
+
+      job = jobs[index];
+    }
+
+    ZRESULT rc{job.rc};
+    if (rc == ZR_RECENT) memcpy(why, job.why, sizeof(why));
+
+    if (rc == ZR_OK && job.raw) {
+      rc = ZipAddRawFromZip(hzout, hzsrc, static_cast<int>(index), nullptr);
+    } else if (rc == ZR_OK) {
+      ZIPRAWITEM orig, raw;
+      HZIPITEM origitem, item{nullptr};
+
+      rc = OpenZipItemRaw(hzsrc, static_cast<int>(index), &orig, &origitem);
+      if (rc == ZR_OK) {
+        rc = OpenZipItemRaw(job.hmem, 0, &raw, &item);
+
+        if (rc == ZR_OK) {
+          // the new data, described as the original was
+          raw.version = static_cast<unsigned short>((orig.version & 0xFF00) |
+                                                    (raw.version & 0xFF));
+          raw.dos_time = orig.dos_time;
+          raw.external_attr = orig.external_attr;
+          raw.extra = orig.extra;
+          raw.extra_len = orig.extra_len;
+          raw.cextra = orig.cextra;
+          raw.cextra_len = orig.cextra_len;
+
+          rc = ZipAddRawItem(hzout, item, &raw, nullptr);
+          CloseZipItem(item);
+
+          recompressed += raw.unc_size;
+        }
+
+        CloseZipItem(origitem);
+      }
+    }
+
+    if (job.hmem) (void)CloseZip(job.hmem);
+    if (job.hzip) (void)CloseZip(job.hzip);
+
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      jobs[index].hmem = nullptr;
+      jobs[index].hzip = nullptr;
+      written = index + 1;
+      if (rc != ZR_OK) stop = true;
+    }
+    cv.notify_all();
+
+    return rc;
+  }
+};
+
+[[nodiscard]] double FileMegabytes(const char *fn) {
+  struct stat st;
+  return stat(fn, &st) == 0 ? static_cast<double>(st.st_size) / 1e6 : 0.0;
+}
+
+int Fail(const char *what, const char *text) {
+  fprintf(stderr, "* %s: %s\n", what, text);
+  return 1;
+}
+
+int Fail(const char *what, ZRESULT rc) {
+  char text[256];
+  FormatZipMessage(rc, text, sizeof(text));
+
+  return Fail(what, text);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int level{8};
+  bool skiplevel{false};
+  unsigned threads{std::thread::hardware_concurrency()};
+  if (threads == 0) threads = 1;
+
+  int arg{1};
+  for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+    if (strcmp(argv[arg], "-s") == 0)
+      skiplevel = true;
+    else if (strcmp(argv[arg], "-l") == 0 && arg + 1 < argc)
+      level = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+      threads = static_cast<unsigned>(atoi(argv[++arg]));
+    else
+      break;
+  }
+
+  if (argc - arg != 2 || level < 0 || level > 9 || threads == 0) {
+    fprintf(stderr,
+            "usage: zip-utils-transcode [-l level] [-j threads] [-s] in.zip "
+            "out.zip\n");
+    return 2;
+  }
+
+  const char *infn{argv[arg]}, *outfn{argv[arg + 1]};
+  const auto start = std::chrono::steady_clock::now();
+
+  HZIP hzsrc{OpenZip(infn, nullptr)};
+  if (!hzsrc) return Fail(infn, ZR_RECENT);
+
+  ZIPENTRY ze;
+  ZRESULT rc{GetZipItem(hzsrc, -1, &ze)};
+  if (rc != ZR_OK) {
+    (void)CloseZip(hzsrc);
+    return Fail(infn, rc);
+  }
+
+  const unsigned count{static_cast<unsigned>(ze.index)};
+  unsigned long long bytes{0};
+  for (unsigned i{0}; i < count && rc == ZR_OK; ++i) {
+    rc = GetZipItem(hzsrc, static_cast<int>(i), &ze);
+    bytes += static_cast<unsigned long>(ze.unc_size);
+  }
+
+  HZIP hzout{rc == ZR_OK ? CreateZip(outfn, nullptr) : nullptr};
+  if (!hzout) {
+    (void)CloseZip(hzsrc);
+    return Fail(rc != ZR_OK ? infn : outfn, rc != ZR_OK ? rc : ZR_RECENT);
+  }
+
+  Transcoder tc;
+  tc.src = infn;
+  tc.level = level;
+  tc.skiplevel = skiplevel;
+  tc.window = 2 * threads;
+  tc.jobs.resize(count);
+
+  std::vector<std::thread> workers;
+  for (unsigned i{0}; i < threads && i < count; ++i)
+    workers.emplace_back([&tc] { tc.Work(); });
+
+  for (unsigned i{0}; i < count && rc == ZR_OK; ++i)
+    rc = tc.Write(hzout, hzsrc, i);
+
+  for (std::thread &worker : workers) worker.join();
+
+  // anything done but never written still holds its zips
+  for (Job &job : tc.jobs) {
+    if (job.hmem) (void)CloseZip(job.hmem);
+    if (job.hzip) (void)CloseZip(job.hzip);
+  }
+
+  const ZRESULT closerc{CloseZip(hzout)};
+  (void)CloseZip(hzsrc);
+
+  if (rc == ZR_RECENT) return Fail(outfn, tc.why);
+  if (rc != ZR_OK) return Fail(outfn, rc);
+  if (closerc != ZR_OK) return Fail(outfn, closerc);
+
+  const double seconds{
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count()};
+  const double mb{static_cast<double>(bytes) / 1e6};
+
+  printf("%u items, %.1f MB uncompressed (%.1f MB recompressed): %.1f MB -> "
+         "%.1f MB in %.2f s on %u threads, %.1f MB/s\n",
+         count, mb, static_cast<double>(tc.recompressed) / 1e6,
+         FileMegabytes(infn), FileMegabytes(outfn), seconds, threads,
+         seconds > 0 ? mb / seconds : 0.0);
+  return 0;
+}